@@ -25,9 +25,11 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <memory.h>
 #include <string.h>
 #include <assert.h>
+#include <math.h>
 
 #if defined(_MSC_VER) || defined(__MINGW32__)
 	#include <windows.h>
@@ -41,9 +43,20 @@
 	#ifndef MSG_NOSIGNAL
 		#define MSG_NOSIGNAL 0
 	#endif
+	#if defined(_MSC_VER) && (_MSC_VER < 1600)
+		typedef __int64 int64_t;
+		typedef unsigned __int64 uint64_t;
+		typedef unsigned int uint32_t;
+		typedef unsigned short uint16_t;
+		typedef unsigned char uint8_t;
+	#else
+		#include <stdint.h>
+	#endif
 #else
 	#include <sys/types.h>
 	#include <sys/socket.h>
+	#include <netinet/in.h>
+	#include <netinet/tcp.h>
 	#include <arpa/inet.h>
 	#include <netdb.h>
 	#include <unistd.h>
@@ -56,391 +69,7853 @@
 	#include <termios.h>
 	#include <unistd.h>
 	#include <signal.h>
+	#include <stdint.h>
+	#include <time.h>
+	#include <sys/stat.h>
+	#include <sys/mman.h>
+	#include <dirent.h>
+	#include <pthread.h>
+#endif
+
+#if defined(HAVE_ZLIB)
+	#include <zlib.h>
+#endif
+
+/*
+USDT probes for bpftrace, SystemTap and the like, e.g. bpftrace -e 'usdt:./TAKtick:taktick:frame { @[arg0] = hist(arg1); }'
+each is a nop plus an ELF note saying where its arguments can be found, so costs nothing until a tracer attaches; <sys/sdt.h> is
+used when the Makefile finds it, and otherwise the same notes are written here for the 64-bit targets it would support
+*/
+#if defined(HAVE_SYS_SDT)
+	#include <sys/sdt.h>
+	#define USDT_PROBE2(name, a, b) DTRACE_PROBE2(taktick, name, a, b)
+	#define USDT_PROBE3(name, a, b, c) DTRACE_PROBE3(taktick, name, a, b, c)
+#elif defined(__GNUC__) && defined(__ELF__) && (defined(__x86_64__) || defined(__aarch64__))
+	#define USDT_NOTE(name, arguments) \
+		"990: nop\n" \
+		".pushsection .note.stapsdt,\"?\",\"note\"\n" \
+		".balign 4\n" \
+		".4byte 992f-991f, 994f-993f, 3\n" \
+		"991: .asciz \"stapsdt\"\n" \
+		"992: .balign 4\n" \
+		"993: .8byte 990b, _.stapsdt.base, 0\n" \
+		".asciz \"taktick\", \"" name "\", \"" arguments "\"\n" \
+		"994: .balign 4\n" \
+		".popsection\n" \
+		".ifndef _.stapsdt.base\n" \
+		".pushsection .stapsdt.base,\"aG\",\"progbits\",.stapsdt.base,comdat\n" \
+		".weak _.stapsdt.base\n" \
+		".hidden _.stapsdt.base\n" \
+		"_.stapsdt.base: .space 1\n" \
+		".size _.stapsdt.base, 1\n" \
+		".popsection\n" \
+		".endif\n"
+	#define USDT_PROBE2(name, a, b) \
+		__asm__ __volatile__ (USDT_NOTE(#name, "-8@%0 -8@%1") : : "nor" ((int64_t)(a)), "nor" ((int64_t)(b)))
+	#define USDT_PROBE3(name, a, b, c) \
+		__asm__ __volatile__ (USDT_NOTE(#name, "-8@%0 -8@%1 -8@%2") : : "nor" ((int64_t)(a)), "nor" ((int64_t)(b)), "nor" ((int64_t)(c)))
+#else
+	#define USDT_PROBE2(name, a, b)
+	#define USDT_PROBE3(name, a, b, c)
 #endif
 
 static const char *terminator_string = "</event>";
 static const int terminator_length = 8;
 static const int buffer_chunk_size = 65536;
+static const int max_backlog_size = 4 * 1048576; /* participants that fall this far behind are dropped */
+static const int history_buffer_size = 1048576; /* history rows held for a slow admin client before its query waits */
+static const int default_batch_window = 2000; /* microseconds */
+static const int default_cache_limit = 100000; /* uids */
+static const int default_snapshot_rate = 20000; /* cached events per second, shared by all joining participants */
+static const int snapshot_backlog_size = 262144; /* snapshot streaming pauses while a participant has this much output pending */
+static const double default_grid_size = 1.0; /* degrees of latitude and longitude per spatial index cell */
+static const char *pong_template = "<?xml version=\"1.0\" encoding=\"UTF-8\" standalone=\"yes\"?>"
+	"<event version=\"2.0\" uid=\"takPong\" type=\"t-x-c-t-r\" how=\"h-g-i-g-o\" "
+	"time=\"1970-01-01T00:00:00.000Z\" start=\"1970-01-01T00:00:00.000Z\" stale=\"1970-01-01T00:00:00.000Z\">"
+	"<point lat=\"0.0\" lon=\"0.0\" hae=\"0.0\" ce=\"9999999.0\" le=\"9999999.0\"/><detail/></event>";
+static const int pong_lifetime = 20000; /* milliseconds until a pong goes stale */
+static const int default_dedup_window = 30; /* seconds */
+static const int default_zombie_silence = 30; /* seconds a connection must be silent before an unconfirmed reconnect may evict it */
+static const int dedup_table_size = 65536; /* must be a power of two */
+static const int dedup_probes = 4;
+static const int max_area_cells = 4096; /* areas of interest spanning more cells than this are checked individually instead */
+static const char *journal_magic = "TAKjrnl"; /* with its terminator, the 8 bytes that open every journal segment */
+static const int journal_version = 1;
+static const int64_t default_journal_segment_size = 64 * 1048576;
+static const int default_journal_sync = 1000; /* milliseconds between group commits */
+static const int journal_window_size = 4 * 1048576; /* bytes of a segment mapped for writing at a time */
+static const int journal_ring_size = 16 * 1048576; /* must be a power of two */
+static const int log_ring_records = 8192; /* must be a power of two */
+static const int default_log_size = 16; /* megabytes at which the log file is rotated */
+static const int log_files_kept = 4; /* rotated log files kept, as <file>.1 (the newest) to <file>.4 */
+static const int journal_index_interval = 65536; /* bytes of records per entry in a segment's time index */
+#if defined(HAVE_ZLIB)
+static const int journal_block_size = 262144; /* bytes of records compressed together, as a unit that can be decompressed alone */
+#endif
+static const char *uid_index_magic = "TAKuidx";
+static const char *state_file_magic = "TAKstat";
+static const int state_file_version = 2;
+static const int default_state_interval = 60; /* seconds between state snapshots */
+static const int replay_batch = 1000; /* most replayed events injected per pass of the main loop */
+static const char *flight_magic = "TAKfltr";
+static const int flight_version = 1;
+static const int default_stall_limit = 250; /* milliseconds of work in one pass of the main loop that count as a stall */
+static const char *phase_names[] = { "prepare", "wait", "accept", "service", "terminate", "admin" }; /* by loop_phase_type */
+static const int default_watchdog_limit = 5; /* seconds the main loop may go without moving on before the watchdog reports it */
+static const int stall_dump_interval = 60; /* seconds; a run of stalls only dumps the flight recorder once */
+
+#define MAX_PARTICIPANT_GROUPS 8
+#define MAX_GROUPS 256 /* groups clients may bring into being with group=*, as groups live for the life of the server */
+#define MAX_GROUP_NAME 255 /* bytes; longer group names are refused, so the names of an event's groups always fit a state file entry */
+#define BITSET_WORD(slot) ((slot) >> 6)
+#define BITSET_BIT(slot) ((uint64_t)1 << ((slot) & 63))
+#define LATENCY_BUCKETS 1184 /* enough for latencies up to 2^41 microseconds; see latency_bucket() */
+#define FLIGHT_RING_SIZE 16384 /* flight recorder records kept per thread; must be a power of two */
+#define FLIGHT_MAX_THREADS 16
+
+/* outbound messages are queued by priority; lower numbers are written first */
+enum lane_type
+{
+	LANE_EMERGENCY = 0, /* b-a-o-* alerts */
+	LANE_CHAT = 1,      /* b-t-f* chat and receipts, and replies from the server itself */
+	LANE_BULK = 2,      /* everything else, such as position reports */
+	LANE_COUNT = 3,
+};
+
+enum schedule_type
+{
+	SCHEDULE_STRICT = 0,   /* a lane is only written when all higher priority lanes are empty */
+	SCHEDULE_WEIGHTED = 1, /* deficit round robin, so bulk traffic still progresses under a flood of alerts or chat */
+};
+
+static const int lane_weights[LANE_COUNT] = { 8, 4, 1 };
+static const int lane_quantum = 16384; /* bytes per unit of weight per round */
+
+enum egress_mode_type
+{
+	EGRESS_LATENCY = 0,    /* TCP_NODELAY and every event is written immediately */
+	EGRESS_THROUGHPUT = 1, /* events are held for a micro-batch window and written together */
+};
+
+struct hash_node_struct
+{
+	uint64_t hash;
+	void *value;
+	int key_length;
+	struct hash_node_struct *next;
+	char key[1]; /* allocated to fit the key */
+};
+
+struct hash_table_type
+{
+	struct hash_node_struct **buckets;
+	int bucket_count, count;
+};
+
+/* fields of interest pulled out of a framed event; strings point into the event itself and are not terminated */
+struct event_header_type
+{
+	const char *uid, *type;
+	int uid_length, type_length;
+	int64_t time, stale; /* milliseconds since the epoch, 0 if absent */
+	double lat, lon;
+	bool has_point; /* false if there is no <point> or it is the 0,0 placeholder used by non-spatial events */
+	double course, speed; /* from <track>; degrees and metres per second */
+	bool has_track;
+};
+
+/* rectangular area of interest; min_lon > max_lon denotes an area that crosses the antimeridian */
+struct area_type
+{
+	bool defined;
+	double min_lat, min_lon, max_lat, max_lon;
+};
+
+/* node of the CoT type filter trie; one node per dash-separated component of the patterns in use */
+struct type_node_struct
+{
+	uint64_t *exact;   /* slots with a pattern ending at this node, NULL if none */
+	uint64_t *subtree; /* slots with a pattern ending "-*" at this node, matching any deeper type; NULL if none */
+	struct type_node_struct *children, *sibling;
+	int component_length;
+	char component[1]; /* allocated to fit; "*" matches any single component */
+};
+
+/* named group of participants; events only reach the members of the groups their sender belongs to */
+struct group_type
+{
+	char *name;
+	struct participant_list_struct **members;
+	int count, max_count;
+};
+
+/* spatial index cell; lists the participant slots whose area of interest overlaps this cell */
+struct grid_cell_type
+{
+	int *slots;
+	int count, max_count;
+};
+
+/* recently seen event fingerprint, used to suppress duplicates */
+struct dedup_slot_type
+{
+	uint64_t hash;
+	int64_t seen; /* microseconds; 0 if unused */
+};
+
+/*
+traffic counters kept for each participant, and exported through the metrics port; the counters of participants that
+have gone are added to a running total, so that the server's totals are those plus the counters of everyone connected
+only the main loop touches them, and it serves the metrics itself, so they need neither locks nor atomic operations
+*/
+struct traffic_counters_type
+{
+	uint64_t bytes_in, bytes_out;
+	uint64_t events_in;       /* complete events framed from the input */
+	uint64_t messages_queued; /* messages fanned out to the participant */
+	uint64_t messages_out;    /* messages completely written */
+	uint64_t messages_shed;   /* bulk messages discarded because the participant wasn't keeping up */
+	uint64_t send_failures;   /* send() errors, and messages refused because the backlog was full */
+};
+
+/*
+log-linear histogram of delivery latencies in microseconds, in the manner of HdrHistogram: values below 64 have a
+bucket each, and every doubling above that is split into 32 buckets, so that any value is known to within about 3%
+*/
+struct latency_histogram_type
+{
+	uint64_t counts[LATENCY_BUCKETS];
+	uint64_t count, sum, max;
+};
+
+/* the parts of one pass of the main loop, timed separately */
+enum loop_phase_type
+{
+	PHASE_PREPARE = 0,   /* building the socket sets, replay and state saving */
+	PHASE_WAIT = 1,      /* in select() */
+	PHASE_ACCEPT = 2,    /* accepting connections */
+	PHASE_SERVICE = 3,   /* reading, framing, fanning out and writing */
+	PHASE_TERMINATE = 4, /* closing sockets */
+	PHASE_ADMIN = 5,     /* admin and metrics clients */
+	PHASE_COUNT = 6,
+};
+
+/* where the main loop spends its time; phase and mark are also read by the watchdog thread */
+struct loop_monitor_type
+{
+	int phase;                      /* being timed now */
+	int64_t mark;                   /* when it began, in microseconds */
+	int64_t pass[PHASE_COUNT];      /* microseconds spent in each phase by the current pass */
+	uint64_t totals[PHASE_COUNT];   /* and by every pass */
+	struct latency_histogram_type lag; /* microseconds of each pass spent other than waiting */
+	uint64_t passes, stalls;
+	int stall_limit;                /* milliseconds; 0 disables stall reports */
+	int64_t last_dump;              /* when a stall last dumped the flight recorder */
+	int watchdog_limit;             /* seconds; 0 disables the watchdog */
+#if !defined(_MSC_VER) && !defined(__MINGW32__)
+	bool watchdog_running, watchdog_stopping;
+	pthread_t watchdog;
+#endif
+};
+
+/*
+the flight recorder keeps the most recent hot-path events of each thread in a ring of its own, to be dumped to a file
+on SIGUSR1 or when the main loop stalls, and decoded with "TAKtick flight <file>"
+*/
+enum flight_kind_type
+{
+	FLIGHT_ACCEPT = 1,  /* value is the port */
+	FLIGHT_RECV = 2,    /* bytes read, 0 at end of stream */
+	FLIGHT_FRAME = 3,   /* length of an event framed */
+	FLIGHT_ENQUEUE = 4, /* length of a message queued for a participant */
+	FLIGHT_SEND = 5,    /* bytes written, or -1 on error */
+	FLIGHT_CLOSE = 6,
+	FLIGHT_SYNC = 7,    /* microseconds taken by a journal group commit */
+	FLIGHT_STALL = 8,   /* milliseconds taken by one pass of the main loop */
+	FLIGHT_HANG = 9,    /* milliseconds the main loop has been stuck, noted by the watchdog */
+	FLIGHT_KIND_COUNT = 10,
+};
+
+struct flight_record_type
+{
+	uint64_t stamp; /* monotonic clock in microseconds, shifted left 8 bits, with the kind in the low 8 bits */
+	int32_t fd;
+	int32_t value;
+};
+
+/* one thread's ring; only that thread writes to it, and a dump writes out the whole structure as it stands */
+struct flight_ring_type
+{
+	char name[16];
+	uint64_t head; /* records ever written */
+	struct flight_record_type records[FLIGHT_RING_SIZE];
+};
+
+/* a dump is this header, then each ring in turn */
+struct flight_file_header_type
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t ring_count;
+	uint32_t ring_size;
+	uint32_t reserved;
+	int64_t wall_time; /* when the dump was taken, in milliseconds since the epoch */
+	int64_t now;       /* and by the monotonic clock used for records, in microseconds */
+};
+
+/* latest event seen for a uid */
+struct state_entry_type
+{
+	char *event;
+	int length;
+	int uid_offset, uid_length; /* location of the uid within event */
+	int type_offset, type_length;
+	int64_t stale;
+	double lat, lon;
+	bool has_point;
+	struct group_type *groups[MAX_PARTICIPANT_GROUPS]; /* groups of the participant that sent it */
+	int group_count;
+	double shared_lat, shared_lon, shared_course, shared_speed; /* as of the last update that was shared, for thinning */
+	int64_t shared_time; /* microseconds; 0 if nothing has been shared yet */
+	double tokens;       /* per-uid rate limit */
+	int64_t token_time;
+	int index; /* position within server_context_type.state_entries */
+};
+
+/*
+on-disk layout of a journal segment, in native byte order: this header, then records, each padded to a multiple of 8 bytes,
+then a sparse time index running to the end of the file
+first_time, last_time, length and the index are only written when the segment is sealed; until then, readers stop
+at the first record with a zero length or a bad check
+*/
+enum journal_flag_type
+{
+	JOURNAL_COMPRESSED = 1, /* the records are held in compressed blocks, described by the block index at the end of the file */
+};
+
+struct journal_segment_header_type
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t flags;                /* journal_flag_type */
+	int64_t first_time, last_time; /* receive times of the first and last records, in milliseconds since the epoch */
+	uint64_t length;               /* bytes of records following the header */
+};
+
+struct journal_record_type
+{
+	uint32_t length; /* of the event that follows */
+	uint32_t check;  /* low 32 bits of hash_bytes() over the event, so that a torn write can be recognised */
+	int64_t time;    /* when the event was received, in milliseconds since the epoch */
+};
+
+/*
+a compressed segment has the same header, followed by blocks of records each compressed with zlib on its own,
+then one journal_block_type for each block, then a journal_trailer_type; offsets of records (as in the uid index)
+are those they had before compression
+*/
+struct journal_block_type
+{
+	int64_t first_time;      /* receive time of the block's first record */
+	uint64_t record_offset;  /* of its first record, before compression */
+	uint64_t file_offset;    /* of the compressed block */
+	uint32_t compressed_length, length;
+};
+
+struct journal_trailer_type
+{
+	uint64_t index_offset; /* of the first journal_block_type */
+	uint64_t block_count;
+};
+
+/* the time index has an entry for the first record at or after every journal_index_interval bytes */
+struct journal_index_entry_type
+{
+	int64_t time;
+	uint64_t offset; /* of the record, from the start of the file */
+};
+
+#if !defined(_MSC_VER) && !defined(__MINGW32__)
+struct journal_type
+{
+	char *directory;
+	int64_t segment_size;
+	int sync_interval;
+	long page_size;
+
+	/* records pass from the reactor (the only producer) to the journal thread (the only consumer) through this ring */
+	char *ring;
+	uint64_t head, tail; /* each written only by its own side */
+	bool stopping;
+	pthread_t thread;
+
+	/* an idle journal thread waits on wake, and only then does the reactor take the lock to signal it */
+	bool sleeping;
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+
+	/* everything below is the journal thread's own */
+	int fd;
+	unsigned int sequence;
+	int64_t file_size, offset, synced_offset;
+	char *window;
+	int64_t window_offset, window_length;
+	int64_t first_time, last_time, last_sync;
+	struct journal_index_entry_type *index;
+	int index_count, index_max;
+	int64_t next_index_offset;
+	struct journal_uid_record_type *uids;
+	int uid_count, uid_max;
+
+	unsigned long records, segments, syncs, dropped;
+	unsigned long oversized; /* events too large to queue; also counted in dropped */
+	uint64_t bytes;
+
+#if defined(HAVE_ZLIB)
+	/* sealed segments are compressed by another thread, so that compression never holds up the journal thread */
+	bool compress, compress_stopping;
+	pthread_t compressor;
+	pthread_mutex_t compress_lock;
+	pthread_cond_t compress_wake;
+	unsigned int sealed_sequence, compressed_sequence; /* these three are protected by compress_lock */
+#endif
+};
+
+/* a journal segment mapped for reading */
+struct journal_reader_type
+{
+	int fd;
+	char *map;
+	int64_t map_length;
+	struct journal_segment_header_type header;
+	int64_t position, end; /* of the next record, and of the records */
+	const struct journal_index_entry_type *index;
+	int index_count;
+	const struct journal_block_type *blocks; /* NULL unless the segment is compressed */
+	int block_count, block; /* and the block currently decompressed, or -1 */
+	char *block_data;
+	int block_max;
+};
+
+/*
+the latest-event-per-uid cache is saved to a state file, in native byte order: this header, then for each entry a
+state_file_entry_type followed by the event and the names of its groups (separated by semicolons), padded to a multiple of 8 bytes
+the fields already extracted from each event are kept alongside it, so that loading doesn't have to parse the events again
+*/
+struct state_file_header_type
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t entry_count;
+	uint64_t length;   /* bytes following the header */
+	int64_t written;   /* milliseconds since the epoch */
+	uint64_t checksum; /* checksum_bytes() over everything following the header */
+};
+
+struct state_file_entry_type
+{
+	int64_t stale;
+	double lat, lon;
+	uint32_t length;       /* of the event */
+	uint32_t uid_offset, uid_length, type_offset, type_length;
+	uint16_t names_length; /* of the group names, separated by ';' */
+	uint8_t has_point;
+	uint8_t group_count;   /* as the default group's name is empty, the names alone can't tell it from no groups at all */
+};
+
+#if !defined(_MSC_VER) && !defined(__MINGW32__)
+/* periodic saving of the cache; the reactor only copies the cache into an image, which a thread of its own writes out */
+struct state_saver_type
+{
+	char *path;
+	int interval;     /* seconds */
+	int64_t next_save; /* microseconds */
+	char *image;
+	int64_t image_length;
+	bool running, done; /* done is set by the thread */
+	pthread_t thread;
+	unsigned long saves, failures;
+};
+
+enum log_kind_type
+{
+	LOG_CONNECT = 1,    /* values: port, peer address (network byte order), peer port */
+	LOG_IDENTIFY = 2,   /* text: uid and callsign */
+	LOG_EVICT = 3,      /* values: socket of the connection replacing it; text: uid */
+	LOG_DISCONNECT = 4, /* values: bytes in, bytes out, events in, milliseconds connected; text: uid and callsign */
+	LOG_CONFLICT = 5,   /* values: socket of the connection holding the identity; text: uid or callsign claimed */
+};
+
+/* the reactor only fills these in; the log thread does all the formatting */
+struct log_record_type
+{
+	int64_t time; /* milliseconds since the epoch */
+	int32_t kind;
+	int32_t fd;
+	uint64_t values[4];
+	char text[80]; /* up to two strings, each terminated by a NUL unless cut short by the end of the field */
+};
+
+/* records pass from the reactor (the only producer) to the log thread (the only consumer) through a ring, as for the journal */
+struct logger_type
+{
+	struct log_record_type *ring;
+	uint64_t head, tail; /* each written only by its own side */
+	unsigned long dropped; /* records the ring had no room for */
+	bool stopping;
+	pthread_t thread;
+
+	/* everything below is the log thread's own, apart from the counts being read for the status display and metrics */
+	char *path; /* NULL for stderr */
+	FILE *file;
+	int64_t size, rotate_size;
+	unsigned long records, rotations;
+};
+
+enum export_format_type
+{
+	EXPORT_GEOJSON = 0, /* one GeoJSON Feature per line */
+	EXPORT_KML = 1,     /* a Placemark per event, stamped with its time */
+	EXPORT_CSV = 2,
+};
+
+/* a segment's share of an export */
+struct export_segment_type
+{
+	FILE *output; /* the formatted events, or NULL if a temporary file couldn't be had */
+	unsigned long count;
+	bool done;
+};
+
+/*
+an export is shared among threads that each take the next segment and format it into a temporary file of its own;
+the main thread copies those to the output in segment order, and threads don't run more than a few segments ahead of it,
+so memory (and temporary disk space) stays the same however long the journal
+*/
+struct export_type
+{
+	const char *directory;
+	int format;
+	int64_t from, to;
+	unsigned int first, last;
+	unsigned int next, written; /* the next segment to be taken, and the next to be written out */
+	int ahead;                  /* most segments taken but not yet written out */
+	struct export_segment_type *segments;
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+};
+#endif
+
+/*
+when a segment is sealed, a sidecar file (same number, extension "uids") indexes its records by uid:
+this header, then one journal_uid_type per uid sorted by hash, then the time index entries of each uid's
+records in turn, in time order
+*/
+struct journal_uid_index_header_type
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t uid_count;
+	uint64_t entry_count;
+};
+
+struct journal_uid_type
+{
+	uint64_t hash; /* hash_bytes() of the uid; readers must check the uid of each record, in case of collisions */
+	uint32_t first, count; /* of this uid's entries */
+};
+
+/* the journal thread's note of a record to be indexed by uid */
+struct journal_uid_record_type
+{
+	uint64_t hash;
+	int64_t time;
+	uint64_t offset;
+};
+
+/* events read back from a journal and injected as if just received, with their original timing scaled */
+struct replay_type
+{
+	char *directory;
+	double speed; /* 0 for as fast as possible */
+	int64_t from; /* receive time at which to begin, 0 for the start of the journal */
+	unsigned int sequence, last_sequence;
+	struct journal_reader_type reader;
+	bool reading, pending, finished;
+	const char *event; /* read but not yet injected */
+	int length;
+	int64_t time;
+	int64_t base_time, last_time;  /* receive times of the first and latest events injected */
+	int64_t started, finished_at;  /* when the first was injected, and when the last had been */
+	unsigned long events;
+	uint64_t bytes;
+};
+
+/* a history query from an admin client, answered by a thread of its own so that reading the journal never holds up the main loop */
+struct history_query_type
+{
+	char *directory, *uid;
+	int64_t from, to;
+	pthread_mutex_t lock;
+	pthread_cond_t taken; /* signalled as the main loop takes the output, or abandons the query */
+
+	/* protected by lock */
+	char *output; /* rows found but not yet taken by the main loop */
+	int output_length, output_max;
+	unsigned long count;
+	bool done, abandoned; /* whichever side sees the other has finished with the query frees it */
+};
+#endif
+
+/*
+synthetic ATAK traffic for exercising the framer, from "TAKtick corpus" and "TAKtick bench framing"
+sizes (of remarks, chat messages and shapes) are drawn from lognormal distributions, as such sizes generally are
+*/
+enum corpus_kind_type
+{
+	CORPUS_SA = 0,     /* position reports with the detail ATAK sends */
+	CORPUS_CHAT = 1,   /* GeoChat messages */
+	CORPUS_SHAPES = 2, /* drawn polylines and polygons */
+	CORPUS_ALERTS = 3, /* emergency alerts and their cancellations */
+	CORPUS_MIXED = 4,  /* all of the above, mostly SA */
+	CORPUS_HUGE = 5,   /* recorded routes of 1 to 4 MB each */
+	CORPUS_KIND_COUNT = 6,
+};
+
+struct corpus_type
+{
+	char *data;
+	int64_t length, max;
+	int64_t *ends; /* offset just past each event */
+	int count, max_count;
+	uint64_t random;
+	int64_t time; /* of the next event, in milliseconds since the epoch */
+};
 
 struct server_context_type
 {
+	struct listener_list_struct *listener_list_base;
 	struct participant_list_struct *participant_list_base;
 	int participant_count;
+	struct hash_table_type state_by_uid;
+	struct state_entry_type **state_entries;
+	int state_count, state_max_count, state_limit;
+	int64_t state_expiry_time;
+	int snapshot_rate;
+	double snapshot_tokens;
+	int64_t snapshot_refill_time;
+	bool snapshot_pending;
+	struct participant_list_struct **slots; /* participants by slot number, used to address bitsets */
+	int slot_count;
+	int bitset_words;
+	uint64_t *unrestricted; /* slots with no area of interest, which receive everything */
+	uint64_t *recipients;   /* slots that the event being shared should go to */
+	double grid_size;
+	struct hash_table_type grid; /* spatial index of areas of interest, keyed by cell row and column */
+	struct participant_list_struct *broad_list_base; /* participants whose area of interest is too large to index */
+	uint64_t *unfiltered; /* slots with no type filter, which receive every type */
+	uint64_t *type_mask;  /* slots whose type filter accepts the event being shared */
+	struct type_node_struct *type_trie;
+	bool type_trie_dirty; /* filters have changed since the trie was compiled */
+	struct hash_table_type groups; /* group_type by name; groups live for the life of the server */
+	unsigned long delivery_serial; /* stamps participants already sent the current event, as groups may overlap */
+	unsigned long groups_refused; /* <__group> names ignored because MAX_GROUPS had been reached, or one was over MAX_GROUP_NAME */
+	struct hash_table_type participant_by_uid;      /* learned from each client's own SA */
+	struct hash_table_type participant_by_callsign;
+	unsigned long events_directed;
+	char *pong;           /* copy of pong_template, whose timestamps are rewritten in place for each reply */
+	int pong_length, pong_time, pong_start, pong_stale; /* length, and offsets of the timestamps */
+	unsigned long pings_answered;
+	unsigned long zombies_evicted;
+	int zombie_silence; /* seconds */
+	unsigned long identity_conflicts; /* claims refused on a uid or callsign held by another connection */
+	struct journal_type *journal; /* NULL unless events are being journalled */
+	struct replay_type *replay;   /* NULL unless a journal is being replayed */
+	struct state_saver_type *state_saver; /* NULL unless the cache is saved to a state file */
+	struct logger_type *logger;   /* NULL unless connections are logged */
+	unsigned short admin_port;    /* 0 if there is no admin port */
+	SOCKET admin_socket;
+	unsigned short metrics_port;  /* 0 if there is no metrics port */
+	SOCKET metrics_socket;
+	struct traffic_counters_type departed; /* totals of the participants no longer connected */
+	int64_t received_time; /* when the events being handled were framed, in microseconds; 0 for those not from a participant */
+	uint64_t accepts;
+	unsigned long connections_refused; /* for want of room in an fd_set */
+	struct loop_monitor_type loop;
+	struct admin_client_struct *admin_list_base;
+	int history_queries; /* running */
+	struct dedup_slot_type *dedup_table;
+	int dedup_window; /* seconds; 0 disables duplicate suppression */
+	unsigned long duplicates_dropped;
+	double thin_distance, thin_turn, thin_interval, thin_speed; /* metres, degrees, seconds, metres per second; thinning is off if all are 0 */
+	double uid_rate, uid_burst; /* events per second per uid; 0 disables the rate limit */
+	unsigned long updates_thinned, updates_rate_limited;
+};
+
+struct listener_list_struct
+{
+	SOCKET socket;
+	unsigned short port;
+	enum egress_mode_type egress_mode;
+	int batch_window; /* microseconds; only used by EGRESS_THROUGHPUT */
+	unsigned long batched_events, batch_flushes; /* used to report the effective batch size */
+	enum schedule_type schedule;
+	unsigned long messages_shed; /* bulk messages discarded because a participant wasn't keeping up */
+	uint64_t accepts;
+	struct latency_histogram_type latency; /* from an event being framed to its last byte being handed to the kernel, per recipient */
+	struct area_type area; /* default area of interest for participants on this port */
+	char *filter; /* default CoT type filter for participants on this port, NULL if none */
+	char *group;  /* groups for participants on this port; "*" takes them from each client's <__group name=".."/> */
+	struct listener_list_struct *next;
+};
+
+/* outbound queue for one priority; sizes records the message boundaries so that lanes are only switched between messages */
+struct outbound_lane_type
+{
+	char *buffer;
+	int offset, length, max_length;
+	int *sizes;
+	int64_t *times; /* alongside sizes, when each message was received (microseconds), or 0 if it didn't come from a participant */
+	int size_head, size_count, size_max;
+	int head_sent; /* bytes of the oldest message already written */
 };
 
 struct participant_list_struct
 {
 	SOCKET socket;
 	bool closed;
+	struct listener_list_struct *listener;
 	char *buffer;
 	int length, max_length;
+	struct outbound_lane_type lanes[LANE_COUNT];
+	int out_pending;        /* bytes queued across all lanes */
+	int partial_lane;       /* lane whose oldest message has been partly written, or -1 */
+	int current_lane, deficit[LANE_COUNT]; /* weighted scheduling state */
+	int out_events;         /* events appended since the last flush */
+	int64_t flush_deadline; /* when a micro-batch must be written; 0 when it may be written now */
+	int snapshot_remaining; /* cached events yet to be streamed to this participant, counting down */
+	int slot;
+	struct area_type area;  /* events with a point outside this area are not sent to this participant */
+	bool broad;             /* area is checked individually rather than through the spatial index */
+	struct participant_list_struct *next_broad;
+	char *filter;           /* CoT type patterns this participant wants, NULL for all */
+	struct group_type *groups[MAX_PARTICIPANT_GROUPS];
+	int group_count;
+	unsigned long delivery_serial;
+	char *uid, *callsign;   /* identity claimed by this client's own SA, NULL until seen */
+	bool conflicted;        /* a refused claim has been logged */
+	int64_t heard;          /* now_us() when anything was last received, or the connection was made */
+	struct traffic_counters_type counters;
+	SOCKADDR_IN peer;
+	int64_t connected;      /* milliseconds since the epoch */
 	struct participant_list_struct *next;
 };
 
+/* a connection to the admin port, which takes one command per line, or to the metrics port, which takes one HTTP request */
+struct admin_client_struct
+{
+	SOCKET socket;
+	bool closed;
+	bool http;
+	char *input, *output;
+	int input_length, input_max, output_offset, output_length, output_max;
+	struct history_query_type *query; /* running for this client, which takes no further commands until it is answered */
+	struct admin_client_struct *next;
+};
+
 /* local function prototypes */
-static void add_participant(SOCKET listen_socket, struct server_context_type *ctx);
-static void service_participants(fd_set *state, struct server_context_type *ctx);
+static bool parse_listener(const char *spec, struct listener_list_struct *listener);
+static bool open_listener(struct listener_list_struct *listener);
+static void add_participant(struct listener_list_struct *listener, struct server_context_type *ctx);
+static void service_participants(fd_set *reads, fd_set *writes, struct server_context_type *ctx);
 static void terminate_participants(struct server_context_type *ctx, bool forceall);
 static void parse_data(struct participant_list_struct *participant, struct server_context_type *ctx);
+static void reserve_input(struct participant_list_struct *participant);
+static void frame_events(struct participant_list_struct *participant, int added,
+	void (*handle)(struct participant_list_struct *sender, const char *buffer, int length, struct server_context_type *ctx), struct server_context_type *ctx);
+static void handle_event(struct participant_list_struct *sender, const char *buffer, int length, struct server_context_type *ctx);
+static bool extract_event_header(const char *buffer, int length, struct event_header_type *header);
+static const char *find_element(const char *buffer, const char *end, const char *name, const char **element_end);
+static const char *find_attribute(const char *element, const char *end, const char *name, int *value_length);
+static bool parse_area(const char *element, const char *end, struct area_type *area);
+static bool area_contains(const struct area_type *area, double lat, double lon);
+static void set_area(struct participant_list_struct *participant, const struct area_type *area, struct server_context_type *ctx);
+static void index_area(struct participant_list_struct *participant, bool add, struct server_context_type *ctx);
+static void select_recipients(const struct event_header_type *header, struct server_context_type *ctx);
+static void select_area_recipients(const struct event_header_type *header, struct server_context_type *ctx);
+static void set_filter(struct participant_list_struct *participant, const char *filter, int length, struct server_context_type *ctx);
+static void build_type_trie(struct server_context_type *ctx);
+static void free_type_trie(struct type_node_struct *node);
+static void match_type_trie(const struct type_node_struct *node, const char *type, const char *end, uint64_t *mask, int words);
+static bool filter_matches(const char *filter, const char *type, int length);
+static void set_groups(struct participant_list_struct *participant, const char *names, int length, struct server_context_type *ctx);
+static struct group_type *find_group(const char *name, int length, struct server_context_type *ctx);
+static int count_new_groups(const char *names, int length, struct server_context_type *ctx);
+static int longest_group_name(const char *names, int length);
+static bool share_group(struct group_type * const *groups, int group_count, const struct participant_list_struct *participant);
+static void assign_slot(struct participant_list_struct *participant, struct server_context_type *ctx);
+static void grow_bitsets(struct server_context_type *ctx);
+static void release_slot(struct participant_list_struct *participant, struct server_context_type *ctx);
+static int64_t parse_cot_time(const char *value, int length);
+static void prepare_pong(struct server_context_type *ctx);
+static void answer_ping(struct participant_list_struct *sender, struct server_context_type *ctx);
+static void format_cot_time(int64_t ms, char *value);
+static void learn_identity(struct participant_list_struct *participant, const char *buffer, int length, const struct event_header_type *header, struct server_context_type *ctx);
+static void forget_identity(struct participant_list_struct *participant, struct server_context_type *ctx);
+static void evict_zombie(struct participant_list_struct *zombie, struct participant_list_struct *participant, struct server_context_type *ctx);
+static bool deliver_directed(struct participant_list_struct *sender, const char *buffer, int length, const struct event_header_type *header, struct server_context_type *ctx);
+static bool is_duplicate(const char *buffer, int length, const struct event_header_type *header, struct server_context_type *ctx);
+static bool is_thinned(struct state_entry_type *entry, const struct event_header_type *header, struct server_context_type *ctx);
+static struct state_entry_type *update_state(struct participant_list_struct *sender, const char *buffer, int length, const struct event_header_type *header, struct server_context_type *ctx);
+static void remove_state(struct state_entry_type *entry, struct server_context_type *ctx);
+static void expire_state(struct server_context_type *ctx, int64_t now);
+static bool stream_snapshots(struct server_context_type *ctx);
+static uint64_t hash_bytes(const void *data, int length);
+static void *hash_find(struct hash_table_type *table, const char *key, int length);
+static void hash_insert(struct hash_table_type *table, const char *key, int length, void *value);
+static void *hash_remove(struct hash_table_type *table, const char *key, int length);
 static SOCKET set_reads(fd_set *state, SOCKET highest_socket, struct server_context_type *ctx);
+static SOCKET set_writes(fd_set *state, SOCKET highest_socket, struct server_context_type *ctx);
+static int64_t next_flush_wait(struct server_context_type *ctx, int64_t now, int64_t limit);
 static void set_nonblocking(SOCKET sock);
-static void share_data(const char *buffer, int length, struct server_context_type *ctx);
+static void set_nodelay(SOCKET sock);
+static void share_data(struct participant_list_struct *sender, const char *buffer, int length, const struct event_header_type *header, struct server_context_type *ctx);
+static enum lane_type classify_lane(const struct event_header_type *header);
+static void send_to_participant(struct participant_list_struct *participant, const char *buffer, int length, enum lane_type lane, int64_t received);
+static void enqueue_data(struct participant_list_struct *participant, const char *buffer, int length, enum lane_type lane, int64_t received);
+static void shed_bulk(struct participant_list_struct *participant, int length);
+static int pick_lane(struct participant_list_struct *participant);
+static void consume_lane(struct participant_list_struct *participant, int lane, int amount);
+static void flush_participant(struct participant_list_struct *participant);
+static bool open_loopback(unsigned short port, const char *name, SOCKET *result);
+static void add_admin_client(SOCKET listener, bool http, struct server_context_type *ctx);
+static void service_admin_clients(fd_set *reads, fd_set *writes, struct server_context_type *ctx);
+static void admin_input(struct admin_client_struct *client, struct server_context_type *ctx);
+static void admin_command(struct admin_client_struct *client, char *line, struct server_context_type *ctx);
+static void admin_output(struct admin_client_struct *client, const char *data, int length);
+static void http_request(struct admin_client_struct *client, struct server_context_type *ctx);
+static void write_metrics(struct admin_client_struct *client, struct server_context_type *ctx);
+static void add_counters(struct traffic_counters_type *total, const struct traffic_counters_type *counters);
+static int format_label(char *output, int size, const char *name, const char *value);
+static int latency_bucket(uint64_t value);
+static void record_latency(struct latency_histogram_type *histogram, int64_t value);
+static void merge_latency(struct latency_histogram_type *total, const struct latency_histogram_type *histogram);
+static uint64_t latency_quantile(const struct latency_histogram_type *histogram, double quantile);
+static void write_latency_metrics(struct admin_client_struct *client, const char *name, const struct latency_histogram_type *histogram, const char *labels);
+static void report_status(struct server_context_type *ctx);
+static int64_t now_us(void);
+static int64_t wall_clock_ms(void);
 static void *memmem(const void *haystack, size_t haystacklen, const void * const needle, const size_t needlelen);
 static void changemode(int dir);
 #if !defined(_MSC_VER) && !defined(__MINGW32__)
 static int _kbhit(void);
 static void intHandler(int);
+static struct journal_type *journal_open(const char *directory, int64_t segment_size, int sync_interval, bool compress);
+static void journal_close(struct journal_type *journal);
+static bool journal_append(struct journal_type *journal, const char *buffer, int length, int64_t time);
+static void journal_ring_copy_in(struct journal_type *journal, uint64_t position, const void *data, int length);
+static void journal_ring_copy_out(struct journal_type *journal, uint64_t position, void *data, int length);
+static void journal_wake(struct journal_type *journal);
+static void *journal_thread(void *argument);
+static bool journal_write(struct journal_type *journal, uint64_t position, int size, int64_t time);
+static bool journal_start_segment(struct journal_type *journal, int size);
+static bool journal_map_window(struct journal_type *journal, int size);
+static void journal_sync(struct journal_type *journal);
+static void journal_seal_segment(struct journal_type *journal);
+static void journal_file_path(const char *directory, unsigned int sequence, const char *extension, char *path, int size);
+static int compare_uid_records(const void *a, const void *b);
+static void journal_write_uid_index(struct journal_type *journal);
+static bool journal_reader_at(struct journal_reader_type *reader, int64_t offset, const char **event, int *length, int64_t *time);
+static bool start_history(struct admin_client_struct *client, const char *directory, const char *uid, int64_t from, int64_t to);
+static void collect_history(struct admin_client_struct *client, struct server_context_type *ctx);
+static void abandon_history(struct history_query_type *query);
+static void free_history(struct history_query_type *query);
+static void *history_thread(void *argument);
+static void history_emit(void *context, const char *event, int length);
+static unsigned long journal_history(const char *directory, const char *uid, int uid_length, int64_t from, int64_t to,
+	void (*emit)(void *context, const char *event, int length), void *context);
+static void print_event(void *context, const char *event, int length);
+static bool load_state(const char *path, struct server_context_type *ctx);
+static void save_state(struct server_context_type *ctx, bool wait);
+static void *state_writer(void *argument);
+static bool write_state_image(const char *path, char *image, int64_t length);
+static uint64_t checksum_bytes(const void *data, int64_t length);
+static int bench_state(int argc, char *argv[]);
+static void *export_thread(void *argument);
+static unsigned long export_segment(struct export_type *export, unsigned int sequence, FILE *output);
+static char *export_text(char *output, const char *value, int length, int format);
+static int xml_character(const char *text, int length, char *decoded, int *consumed);
+static char *export_literal(char *output, const char *text);
+static char *export_number(char *output, double value, int decimals);
+static bool journal_sequence_range(const char *directory, unsigned int *first, unsigned int *last);
+static bool journal_reader_open(struct journal_reader_type *reader, const char *directory, unsigned int sequence);
+static bool journal_reader_next(struct journal_reader_type *reader, const char **event, int *length, int64_t *time);
+static const char *journal_reader_locate(struct journal_reader_type *reader, struct journal_record_type *record);
+static void journal_reader_seek(struct journal_reader_type *reader, int64_t time);
+static void journal_reader_close(struct journal_reader_type *reader);
+static struct replay_type *replay_open(const char *directory, double speed, int64_t from);
+static bool replay_next(struct replay_type *replay);
+static int64_t replay_events(struct server_context_type *ctx, int64_t limit);
+static void report_replay(struct replay_type *replay);
+static int bench_journal(int argc, char *argv[]);
+#if defined(HAVE_ZLIB)
+static void *journal_compressor(void *argument);
+static bool journal_compress_segment(const char *directory, unsigned int sequence);
+static bool journal_reader_load_block(struct journal_reader_type *reader);
+static int bench_compression(int argc, char *argv[]);
+#endif
+#endif
+static int run_bench(int argc, char *argv[]);
+static int run_corpus(int argc, char *argv[]);
+static void corpus_generate(struct corpus_type *corpus, int kind, int count);
+static void corpus_event(struct corpus_type *corpus, int kind);
+static char *corpus_reserve(struct corpus_type *corpus, int length);
+static char *corpus_words(struct corpus_type *corpus, char *output, int length);
+static double corpus_random(struct corpus_type *corpus);
+static double corpus_lognormal(struct corpus_type *corpus, double median, double sigma);
+static int bench_framing(int argc, char *argv[]);
+static void discard_event(struct participant_list_struct *sender, const char *buffer, int length, struct server_context_type *ctx);
+static int run_history(int argc, char *argv[]);
+static int run_export(int argc, char *argv[]);
+static void flight_register(const char *name);
+static void flight_record(int kind, SOCKET fd, int value);
+#if !defined(_MSC_VER) && !defined(__MINGW32__)
+static bool flight_dump(void);
+static void flight_signal(int unused);
+#endif
+static int run_flight(int argc, char *argv[]);
+static void loop_phase(struct loop_monitor_type *loop, int phase);
+static void finish_pass(struct loop_monitor_type *loop);
+#if !defined(_MSC_VER) && !defined(__MINGW32__)
+static void *watchdog_thread(void *argument);
+#endif
+static void log_connect(struct participant_list_struct *participant, struct server_context_type *ctx);
+static void log_identify(struct participant_list_struct *participant, struct server_context_type *ctx);
+static void log_evict(struct participant_list_struct *zombie, struct participant_list_struct *participant, struct server_context_type *ctx);
+static void log_conflict(struct participant_list_struct *participant, struct participant_list_struct *holder, const char *uid, int uid_length, const char *callsign, int callsign_length, struct server_context_type *ctx);
+static void log_disconnect(struct participant_list_struct *participant, struct server_context_type *ctx);
+#if !defined(_MSC_VER) && !defined(__MINGW32__)
+static struct logger_type *log_open(const char *path, int64_t rotate_size);
+static void log_close(struct logger_type *logger);
+static struct log_record_type *log_reserve(struct logger_type *logger, int kind, SOCKET fd);
+static void log_commit(struct logger_type *logger);
+static void log_identity(char *text, int size, const char *uid, const char *callsign);
+static void *log_thread(void *argument);
+static char *log_value(char *output, const char *value, int length);
+static void log_rotate(struct logger_type *logger);
+#endif
+
+#if !defined(_MSC_VER) && !defined(__MINGW32__)
+/* the flight recorder's rings, the calling thread's own ring (NULL if it hasn't one), and where dumps go */
+static struct flight_ring_type *flight_rings[FLIGHT_MAX_THREADS];
+static int flight_ring_count;
+static __thread struct flight_ring_type *flight_ring;
+static char flight_path[1024] = "TAKtick.flight";
+static bool flight_dumping;
 #endif
 
 int main (int argc, char *argv[])
 {
-	int rc;
+	int rc, index;
 #if defined(_MSC_VER) || defined(__MINGW32__)
 	WSADATA wsaData;
 #endif
-	SOCKADDR_IN local;
-	SOCKET local_socket, highest_socket;
+	SOCKET highest_socket;
 	fd_set reads, writes;
 	struct server_context_type ctx;
+	struct listener_list_struct *listener, **tail;
 	char ch;
 	struct timeval tv;
+	int64_t wait;
+	const char *journal_directory, *replay_directory, *state_path, *log_path;
+	int64_t journal_segment_size, replay_from;
+	int journal_sync, state_interval, log_size;
+	bool journal_compress;
+	double replay_speed;
+#if !defined(_MSC_VER) && !defined(__MINGW32__)
+	struct sigaction action;
+#endif
+
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.listener_list_base = NULL;
+	ctx.participant_list_base = NULL;
+	ctx.participant_count = 0;
+	ctx.state_limit = default_cache_limit;
+	ctx.snapshot_rate = default_snapshot_rate;
+	ctx.grid_size = default_grid_size;
+	ctx.dedup_window = default_dedup_window;
+	ctx.zombie_silence = default_zombie_silence;
+	journal_directory = NULL;
+	log_path = NULL;
+	log_size = default_log_size;
+	journal_segment_size = default_journal_segment_size;
+	journal_sync = default_journal_sync;
+	journal_compress = true;
+	replay_directory = NULL;
+	replay_speed = 1.0;
+	state_path = NULL;
+	state_interval = default_state_interval;
+	replay_from = 0;
+	ctx.loop.stall_limit = default_stall_limit;
+	ctx.loop.watchdog_limit = default_watchdog_limit;
+
+	/* "TAKtick bench <name> ..." measures a part of the server in isolation, rather than running it */
+	if ( (argc > 2) && !strcmp(argv[1], "bench") )
+		return run_bench(argc - 2, argv + 2);
+
+	/* "TAKtick history <directory> <uid> [from [to]]" prints a unit's journalled events */
+	if ( (argc > 1) && !strcmp(argv[1], "history") )
+		return run_history(argc - 2, argv + 2);
+
+	/* "TAKtick export <directory> <geojson|kml|csv> [from [to]]" converts a journal for GIS tools */
+	if ( (argc > 1) && !strcmp(argv[1], "export") )
+		return run_export(argc - 2, argv + 2);
+
+	/* "TAKtick flight <file>" prints the timeline held in a flight recorder dump */
+	if ( (argc > 1) && !strcmp(argv[1], "flight") )
+		return run_flight(argc - 2, argv + 2);
+
+	/* "TAKtick corpus <kind> [events [seed]]" writes synthetic traffic to stdout */
+	if ( (argc > 1) && !strcmp(argv[1], "corpus") )
+		return run_corpus(argc - 2, argv + 2);
+
+	/* options come first, each taking a value */
+	for (index = 1; (index + 1 < argc) && ('-' == argv[index][0]); index += 2)
+	{
+		if (!strcmp(argv[index], "-cache"))
+			ctx.state_limit = atoi(argv[index + 1]);
+		else if (!strcmp(argv[index], "-snapshot-rate"))
+			ctx.snapshot_rate = atoi(argv[index + 1]);
+		else if (!strcmp(argv[index], "-grid"))
+			ctx.grid_size = atof(argv[index + 1]);
+		else if (!strcmp(argv[index], "-dedup"))
+			ctx.dedup_window = atoi(argv[index + 1]);
+		else if (!strcmp(argv[index], "-silence"))
+			ctx.zombie_silence = atoi(argv[index + 1]);
+		else if (!strcmp(argv[index], "-thin"))
+		{
+			if (sscanf(argv[index + 1], "%lf/%lf/%lf/%lf", &ctx.thin_distance, &ctx.thin_turn, &ctx.thin_interval, &ctx.thin_speed) < 3)
+				break;
+		}
+		else if (!strcmp(argv[index], "-rate"))
+		{
+			ctx.uid_burst = 0.0;
+			if (sscanf(argv[index + 1], "%lf/%lf", &ctx.uid_rate, &ctx.uid_burst) < 1)
+				break;
+			if (ctx.uid_burst < 1.0) ctx.uid_burst = (ctx.uid_rate > 1.0) ? ctx.uid_rate : 1.0;
+		}
+		else if (!strcmp(argv[index], "-journal"))
+			journal_directory = argv[index + 1];
+		else if (!strcmp(argv[index], "-journal-segment"))
+			journal_segment_size = (int64_t)atoi(argv[index + 1]) * 1048576;
+		else if (!strcmp(argv[index], "-journal-sync"))
+			journal_sync = atoi(argv[index + 1]);
+		else if (!strcmp(argv[index], "-journal-compress"))
+			journal_compress = (0 != atoi(argv[index + 1]));
+		else if (!strcmp(argv[index], "-state"))
+			state_path = argv[index + 1];
+		else if (!strcmp(argv[index], "-state-interval"))
+			state_interval = atoi(argv[index + 1]);
+		else if (!strcmp(argv[index], "-admin"))
+			ctx.admin_port = (unsigned short)atoi(argv[index + 1]);
+		else if (!strcmp(argv[index], "-metrics"))
+			ctx.metrics_port = (unsigned short)atoi(argv[index + 1]);
+		else if (!strcmp(argv[index], "-flight"))
+		{
+#if !defined(_MSC_VER) && !defined(__MINGW32__)
+			if (strlen(argv[index + 1]) >= sizeof(flight_path)) break;
+			strcpy(flight_path, argv[index + 1]);
+#endif
+		}
+		else if (!strcmp(argv[index], "-stall"))
+			ctx.loop.stall_limit = atoi(argv[index + 1]);
+		else if (!strcmp(argv[index], "-watchdog"))
+			ctx.loop.watchdog_limit = atoi(argv[index + 1]);
+		else if (!strcmp(argv[index], "-log"))
+			log_path = argv[index + 1];
+		else if (!strcmp(argv[index], "-log-size"))
+			log_size = atoi(argv[index + 1]);
+		else if (!strcmp(argv[index], "-replay"))
+			replay_directory = argv[index + 1];
+		else if (!strcmp(argv[index], "-replay-speed"))
+			replay_speed = atof(argv[index + 1]);
+		else if (!strcmp(argv[index], "-replay-from"))
+		{
+			replay_from = parse_cot_time(argv[index + 1], (int)strlen(argv[index + 1]));
+			if (0 == replay_from) break;
+		}
+		else
+			break;
+	}
 
-	if (argc < 2)
+	if ( (index >= argc) || ('-' == argv[index][0]) || (ctx.state_limit < 0) || (ctx.snapshot_rate <= 0) || (ctx.grid_size <= 0.0) || (ctx.grid_size > 180.0) || (ctx.dedup_window < 0) || (ctx.zombie_silence < 0) || (ctx.uid_rate < 0.0) ||
+		(journal_segment_size <= 0) || (journal_sync < 0) || (replay_speed < 0.0) || (state_interval <= 0) || (ctx.loop.stall_limit < 0) || (ctx.loop.watchdog_limit < 0) || (log_size <= 0) )
 	{
-		fprintf(stderr, "%s <portno_listen>\n", argv[0]);
+		fprintf(stderr, "%s [-cache entries] [-snapshot-rate events_per_sec] [-grid degrees] [-dedup seconds] [-silence seconds] [-thin metres/degrees/seconds[/metres_per_sec]] [-rate events_per_sec[/burst]] [-journal directory] [-journal-segment MB] [-journal-sync msec] [-journal-compress 0|1] [-replay directory] [-replay-speed factor] [-replay-from time] [-state file] [-state-interval seconds] [-admin port] [-metrics port] [-flight file] [-stall msec] [-watchdog seconds] [-log file|-] [-log-size MB] <portno_listen>[,mode=latency|throughput][,window=usec][,aoi=minlat/minlon/maxlat/maxlon][,filter=type;type...][,group=name;name...|*][,schedule=strict|weighted] ...\n", argv[0]);
 		return -1;
 	}
 
-	ctx.participant_list_base = NULL;
-	ctx.participant_count = 0;
+	/* thinning and rate limits are kept with the cached event, so uids the cache has no room for escape them */
+	if ( (0 == ctx.state_limit) && ((ctx.thin_distance > 0.0) || (ctx.thin_turn > 0.0) || (ctx.thin_interval > 0.0) || (ctx.thin_speed > 0.0) || (ctx.uid_rate > 0.0)) )
+		fprintf(stderr, "WARNING: -thin and -rate have no effect with -cache 0\n");
+
+	/* each remaining argument describes one port to listen on, along with that port's egress policy */
+	tail = &ctx.listener_list_base;
+
+	for (; index < argc; index++)
+	{
+		listener = (struct listener_list_struct *)malloc(sizeof(struct listener_list_struct));
+		assert(listener);
+
+		if (!parse_listener(argv[index], listener))
+		{
+			fprintf(stderr, "ERROR: unable to understand listener '%s'\n", argv[index]);
+			return -1;
+		}
+
+		*tail = listener;
+		tail = &listener->next;
+	}
+
+	prepare_pong(&ctx);
+
+	/* the bitsets exist from the start, as replayed events may be shared before anyone has connected */
+	grow_bitsets(&ctx);
+
+	/* the flight recorder is always running; SIGUSR1 dumps it */
+	flight_register("reactor");
+#if !defined(_MSC_VER) && !defined(__MINGW32__)
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = flight_signal;
+	action.sa_flags = SA_RESTART;
+	sigaction(SIGUSR1, &action, NULL);
+#endif
+
+	if (log_path)
+	{
+#if defined(_MSC_VER) || defined(__MINGW32__)
+		fprintf(stderr, "ERROR: logging is not supported on this platform\n");
+		return -1;
+#else
+		ctx.logger = log_open(strcmp(log_path, "-") ? log_path : NULL, (int64_t)log_size * 1048576);
+		if (NULL == ctx.logger) return -1;
+#endif
+	}
+
+	if (journal_directory)
+	{
+#if defined(_MSC_VER) || defined(__MINGW32__)
+		fprintf(stderr, "ERROR: the journal is not supported on this platform\n");
+		return -1;
+#else
+		ctx.journal = journal_open(journal_directory, journal_segment_size, journal_sync, journal_compress);
+		if (NULL == ctx.journal) return -1;
+#endif
+	}
+
+	/* the cache is restored before listening, so that the first participants to reconnect get the full picture */
+	if (state_path)
+	{
+#if defined(_MSC_VER) || defined(__MINGW32__)
+		fprintf(stderr, "ERROR: the state file is not supported on this platform\n");
+		return -1;
+#else
+		load_state(state_path, &ctx);
+
+		ctx.state_saver = (struct state_saver_type *)calloc(1, sizeof(struct state_saver_type));
+		assert(ctx.state_saver);
+		ctx.state_saver->path = (char *)state_path;
+		ctx.state_saver->interval = state_interval;
+		ctx.state_saver->next_save = now_us() + (int64_t)state_interval * 1000000;
+#endif
+	}
+
+	if (replay_directory)
+	{
+#if defined(_MSC_VER) || defined(__MINGW32__)
+		fprintf(stderr, "ERROR: replay is not supported on this platform\n");
+		return -1;
+#else
+		ctx.replay = replay_open(replay_directory, replay_speed, replay_from);
+		if (NULL == ctx.replay) return -1;
+#endif
+	}
+
+	if (ctx.dedup_window)
+	{
+		ctx.dedup_table = (struct dedup_slot_type *)calloc(dedup_table_size, sizeof(struct dedup_slot_type));
+		assert(ctx.dedup_table);
+	}
+
+#if defined(_MSC_VER) || defined(__MINGW32__)
+	/* Initialize WinSock and check the version */
+	rc = WSAStartup(MAKEWORD(2,0), &wsaData);
+
+	/* check the version */
+	if (MAKEWORD(2,0) != wsaData.wVersion)
+	{
+		fprintf(stderr, "ERROR: WSAStartup() failed\n");
+		goto finished_nochangemode;
+	}
+#endif
+
+	/* establish a socket for each listener to accept incoming connections */
+	for (listener = ctx.listener_list_base; listener; listener = listener->next)
+	{
+		if (!open_listener(listener))
+			goto finished_nochangemode;
+	}
+
+	if (ctx.admin_port && !open_loopback(ctx.admin_port, "admin", &ctx.admin_socket))
+		goto finished_nochangemode;
+
+	if (ctx.metrics_port && !open_loopback(ctx.metrics_port, "metrics", &ctx.metrics_socket))
+		goto finished_nochangemode;
+
+	printf("Press 'Q' to exit program\n");
+	changemode(1); /* disable keyboard echo */
+#if !defined(_MSC_VER) && !defined(__MINGW32__)
+	signal(SIGINT, intHandler);
+#endif
+
+	ctx.loop.phase = PHASE_PREPARE;
+	ctx.loop.mark = now_us();
+#if !defined(_MSC_VER) && !defined(__MINGW32__)
+	if (ctx.loop.watchdog_limit)
+	{
+		if (pthread_create(&ctx.loop.watchdog, NULL, watchdog_thread, &ctx.loop))
+			fprintf(stderr, "ERROR: unable to start watchdog thread\n");
+		else
+			ctx.loop.watchdog_running = true;
+	}
+#endif
+
+	for (;;)
+	{
+		/* FD_SET "reads" with all the sockets we are listening on */
+		FD_ZERO(&reads);
+		highest_socket = 0;
+		for (listener = ctx.listener_list_base; listener; listener = listener->next)
+		{
+			FD_SET(listener->socket, &reads);
+			if (listener->socket > highest_socket) highest_socket = listener->socket;
+		}
+		if (ctx.admin_port)
+		{
+			FD_SET(ctx.admin_socket, &reads);
+			if (ctx.admin_socket > highest_socket) highest_socket = ctx.admin_socket;
+		}
+		if (ctx.metrics_port)
+		{
+			FD_SET(ctx.metrics_socket, &reads);
+			if (ctx.metrics_socket > highest_socket) highest_socket = ctx.metrics_socket;
+		}
+		highest_socket = set_reads(&reads, highest_socket, &ctx);
+
+		/* FD_SET "writes" with all the sockets that have output ready to go */
+		FD_ZERO(&writes);
+		highest_socket = set_writes(&writes, highest_socket, &ctx);
+
+		/* block until something happens, a micro-batch window closes, or timeout occurs */
+		wait = next_flush_wait(&ctx, now_us(), (ctx.snapshot_pending || ctx.history_queries) ? 10000 : 100000);
+#if !defined(_MSC_VER) && !defined(__MINGW32__)
+		if (ctx.replay)
+			wait = replay_events(&ctx, wait);
+		if (ctx.state_saver && (now_us() >= ctx.state_saver->next_save))
+			save_state(&ctx, false);
+#endif
+		tv.tv_sec = 0;
+		tv.tv_usec = (long)wait;
+		loop_phase(&ctx.loop, PHASE_WAIT);
+		rc = select(highest_socket + 1, &reads, &writes, NULL, &tv);
+		loop_phase(&ctx.loop, PHASE_ACCEPT);
+
+		if (_kbhit())
+		{
+#if defined(_MSC_VER) || defined(__MINGW32__)
+			ch = getch();
+#else
+			ch = getchar();
+#endif
+			if ( ('q' == ch) || ('Q' == ch) ) break;
+
+			report_status(&ctx);
+		}
+		
+#if !defined(_MSC_VER) && !defined(__MINGW32__)
+		/* a signal (such as SIGUSR1 for a flight recorder dump) interrupts select() without anything being wrong */
+		if ( (rc < 0) && (EINTR != errno) ) goto finished;
+#else
+		if (rc < 0) goto finished;
+#endif
+
+		if (rc > 0) /* rc is positive, indicating the number of sockets worthy of attention */
+		{
+			/* first, we check the listeners, which will have activity if a new connection is attempted */
+			for (listener = ctx.listener_list_base; listener; listener = listener->next)
+			{
+				if (FD_ISSET(listener->socket, &reads))
+					add_participant(listener, &ctx);
+			}
+
+			if (ctx.admin_port && FD_ISSET(ctx.admin_socket, &reads))
+				add_admin_client(ctx.admin_socket, false, &ctx);
+
+			if (ctx.metrics_port && FD_ISSET(ctx.metrics_socket, &reads))
+				add_admin_client(ctx.metrics_socket, true, &ctx);
+		}
+		else
+		{
+			FD_ZERO(&reads);
+			FD_ZERO(&writes);
+		}
+
+		/* cycle through all the participants, processing all incoming data and flushing output, then close terminated sockets */
+		loop_phase(&ctx.loop, PHASE_SERVICE);
+		service_participants(&reads, &writes, &ctx);
+		loop_phase(&ctx.loop, PHASE_TERMINATE);
+		terminate_participants(&ctx, false);
+		loop_phase(&ctx.loop, PHASE_ADMIN);
+		service_admin_clients(&reads, &writes, &ctx);
+		loop_phase(&ctx.loop, PHASE_PREPARE);
+
+		finish_pass(&ctx.loop);
+	}
+
+	/* mop up any remaining sockets */
+	terminate_participants(&ctx, true);
+
+finished:
+	changemode(0); /* re-enable keyboard echo */
+
+finished_nochangemode:
+#if !defined(_MSC_VER) && !defined(__MINGW32__)
+	if (ctx.loop.watchdog_running)
+	{
+		__atomic_store_n(&ctx.loop.watchdog_stopping, true, __ATOMIC_RELEASE);
+		pthread_join(ctx.loop.watchdog, NULL);
+	}
+	if (ctx.state_saver) save_state(&ctx, true);
+	if (ctx.journal) journal_close(ctx.journal);
+	if (ctx.logger) log_close(ctx.logger);
+#endif
+	return 0;
+}
+
+/* interpret a listener argument of the form "<port>[,mode=latency|throughput][,window=usec][,aoi=minlat/minlon/maxlat/maxlon][,filter=type;type...][,group=name;name...|*][,schedule=strict|weighted]" */
+
+static bool parse_listener(const char *spec, struct listener_list_struct *listener)
+{
+	const char *option;
+	char *end;
+	long value;
+
+	memset(listener, 0, sizeof(struct listener_list_struct));
+	listener->egress_mode = EGRESS_LATENCY;
+	listener->batch_window = default_batch_window;
+
+	value = strtol(spec, &end, 10);
+	if ( (end == spec) || (value <= 0) || (value > 65535) ) return false;
+	listener->port = (unsigned short)value;
+
+	for (option = end; ',' == *option; option = end)
+	{
+		option++;
+
+		if (!strncmp(option, "mode=latency", 12))
+		{
+			listener->egress_mode = EGRESS_LATENCY;
+			end = (char *)option + 12;
+		}
+		else if (!strncmp(option, "mode=throughput", 15))
+		{
+			listener->egress_mode = EGRESS_THROUGHPUT;
+			end = (char *)option + 15;
+		}
+		else if (!strncmp(option, "schedule=strict", 15))
+		{
+			listener->schedule = SCHEDULE_STRICT;
+			end = (char *)option + 15;
+		}
+		else if (!strncmp(option, "schedule=weighted", 17))
+		{
+			listener->schedule = SCHEDULE_WEIGHTED;
+			end = (char *)option + 17;
+		}
+		else if (!strncmp(option, "window=", 7))
+		{
+			value = strtol(option + 7, &end, 10);
+			if ( (end == option + 7) || (value < 0) || (value > 1000000) ) return false;
+			listener->batch_window = (int)value;
+		}
+		else if (!strncmp(option, "aoi=", 4))
+		{
+			listener->area.min_lat = strtod(option + 4, &end);
+			if ('/' != *end) return false;
+			listener->area.min_lon = strtod(end + 1, &end);
+			if ('/' != *end) return false;
+			listener->area.max_lat = strtod(end + 1, &end);
+			if ('/' != *end) return false;
+			listener->area.max_lon = strtod(end + 1, &end);
+			if (listener->area.min_lat > listener->area.max_lat) return false;
+			listener->area.defined = true;
+		}
+		else if (!strncmp(option, "filter=", 7))
+		{
+			end = (char *)option + 7 + strcspn(option + 7, ",");
+			listener->filter = (char *)malloc(end - option - 6);
+			assert(listener->filter);
+			memcpy(listener->filter, option + 7, end - option - 7);
+			listener->filter[end - option - 7] = '\0';
+		}
+		else if (!strncmp(option, "group=", 6))
+		{
+			end = (char *)option + 6 + strcspn(option + 6, ",");
+			listener->group = (char *)malloc(end - option - 5);
+			assert(listener->group);
+			memcpy(listener->group, option + 6, end - option - 6);
+			listener->group[end - option - 6] = '\0';
+			if (longest_group_name(listener->group, (int)strlen(listener->group)) > MAX_GROUP_NAME) return false;
+		}
+		else
+		{
+			return false;
+		}
+	}
+
+	return ('\0' == *end);
+}
+
+/* establish a socket to listen for incoming connections */
+
+static bool open_listener(struct listener_list_struct *listener)
+{
+	SOCKADDR_IN local;
+	int rc;
+
+	local.sin_family = AF_INET;
+	local.sin_addr.s_addr = htonl(INADDR_ANY);
+	local.sin_port = htons(listener->port);
+
+	listener->socket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+
+#if defined(_MSC_VER) || defined(__MINGW32__)
+	if (INVALID_SOCKET == listener->socket)
+#else
+	if (listener->socket <= 0)
+#endif
+		return false;
+
+	rc = bind(listener->socket, (LPSOCKADDR)&local, sizeof(local));
+
+	if (rc)
+	{
+		fprintf(stderr, "ERROR: unable to bind() port %u; the socket may already be in use or is in timeout\n", listener->port);
+		return false;
+	}
+
+	rc = listen(listener->socket, SOMAXCONN);
+
+	return (0 == rc);
+}
+
+/* accept() new socket and add new incoming participant to list */
+
+static void add_participant(struct listener_list_struct *listener, struct server_context_type *ctx)
+{
+	SOCKET participant_socket;
+	struct participant_list_struct *pnt, *prev_pnt, *new_entry;
+	SOCKADDR_IN peer;
+#if defined(_MSC_VER) || defined(__MINGW32__)
+	int peer_length;
+#else
+	socklen_t peer_length;
+#endif
+
+	peer_length = sizeof(peer);
+	memset(&peer, 0, sizeof(peer));
+	participant_socket = accept(listener->socket, (LPSOCKADDR)&peer, &peer_length);
+
+#if defined(_MSC_VER) || defined(__MINGW32__)
+	if (INVALID_SOCKET == participant_socket) return;
+#else
+	if (participant_socket <= 0) return;
+
+	/* select() can't watch a socket numbered FD_SETSIZE or above (usually 1024), and FD_SET() would write past the end of the set */
+	if (participant_socket >= FD_SETSIZE)
+	{
+		close(participant_socket);
+		ctx->connections_refused++;
+		return;
+	}
+#endif
+
+	/* set for non-blocking, as we will use select() to achieve blocking */
+	set_nonblocking(participant_socket);
+	flight_record(FLIGHT_ACCEPT, participant_socket, listener->port);
+	USDT_PROBE2(accept, participant_socket, listener->port);
+	ctx->accepts++;
+	listener->accepts++;
+
+	/* latency mode disables Nagle so that every event leaves as soon as it is written */
+	if (EGRESS_LATENCY == listener->egress_mode)
+		set_nodelay(participant_socket);
+
+	/* search through participant list to for an existing entry */
+
+	pnt = ctx->participant_list_base;
+	prev_pnt = NULL;
+
+	while (pnt)
+	{
+		if (pnt->socket == participant_socket)
+			break;
+		prev_pnt = pnt;
+		pnt = pnt->next;
+	}
+
+	if (pnt)
+	{
+		return;
+	}
+
+	/* create a new entry for this new participant */
+
+	new_entry = (struct participant_list_struct *)malloc(sizeof(struct participant_list_struct));
+	assert(new_entry);
+	memset(new_entry, 0, sizeof(struct participant_list_struct));
+	new_entry->socket = participant_socket;
+	new_entry->closed = false;
+	new_entry->listener = listener;
+	new_entry->max_length = new_entry->length = 0;
+	new_entry->buffer = NULL;
+	new_entry->out_pending = 0;
+	new_entry->partial_lane = -1;
+	new_entry->peer = peer;
+	new_entry->connected = wall_clock_ms();
+	new_entry->heard = now_us();
+	log_connect(new_entry, ctx);
+
+	/* give the newcomer a slot (so it can be addressed by bitsets) and its listener's area of interest */
+	assign_slot(new_entry, ctx);
+	set_area(new_entry, &listener->area, ctx);
+	if (listener->filter)
+		set_filter(new_entry, listener->filter, (int)strlen(listener->filter), ctx);
+
+	/* until told otherwise, everyone is in the unnamed default group */
+	if (listener->group && strcmp(listener->group, "*"))
+		set_groups(new_entry, listener->group, (int)strlen(listener->group), ctx);
+	else
+		set_groups(new_entry, "", 0, ctx);
+
+	/* the newcomer is brought up to date with everything already known, a little at a time */
+	new_entry->snapshot_remaining = ctx->state_count;
+	if (new_entry->snapshot_remaining) ctx->snapshot_pending = true;
+
+	if (NULL == prev_pnt)
+		ctx->participant_list_base = new_entry;
+	else
+		prev_pnt->next = new_entry;
+
+	ctx->participant_count++;
+}
+
+static void terminate_participants(struct server_context_type *ctx, bool force_all)
+{
+	struct participant_list_struct *pnt, *prev_pnt, *next_pnt;
+	int lane;
+
+	pnt = ctx->participant_list_base;
+	prev_pnt = NULL;
+
+	while (pnt)
+	{
+		next_pnt = pnt->next;
+
+		if (pnt->closed || force_all)
+		{
+			flight_record(FLIGHT_CLOSE, pnt->socket, 0);
+			USDT_PROBE3(close, pnt->socket, pnt->counters.bytes_in, pnt->counters.bytes_out);
+			log_disconnect(pnt, ctx);
+#if defined(_MSC_VER) || defined(__MINGW32__)
+			closesocket(pnt->socket);
+#else
+			close(pnt->socket);
+#endif
+
+			ctx->participant_count--;
+			add_counters(&ctx->departed, &pnt->counters);
+
+			set_area(pnt, NULL, ctx);
+			set_filter(pnt, NULL, 0, ctx);
+			set_groups(pnt, NULL, 0, ctx);
+			forget_identity(pnt, ctx);
+			release_slot(pnt, ctx);
+
+			if (prev_pnt)
+				prev_pnt->next = pnt->next;
+			else
+				ctx->participant_list_base = pnt->next;
+
+			if (pnt->buffer) free(pnt->buffer);
+			for (lane = 0; lane < LANE_COUNT; lane++)
+			{
+				if (pnt->lanes[lane].buffer) free(pnt->lanes[lane].buffer);
+				if (pnt->lanes[lane].sizes) free(pnt->lanes[lane].sizes);
+				if (pnt->lanes[lane].times) free(pnt->lanes[lane].times);
+			}
+			free(pnt);
+		}
+		else
+		{
+			prev_pnt = pnt;
+		}
+
+		pnt = next_pnt;
+	}
+}
+
+static void service_participants(fd_set *reads, fd_set *writes, struct server_context_type *ctx)
+{
+	struct participant_list_struct *pnt;
+	int64_t now;
+
+	/*
+	sequence through each entry in the linked list
+	if reads indicates that this socket should be polled, we call parse_data() for it
+	*/
+
+	pnt = ctx->participant_list_base;
+
+	while (pnt)
+	{
+		if (FD_ISSET(pnt->socket, reads))
+			parse_data(pnt, ctx);
+
+		pnt = pnt->next;
+	}
+
+	/* forget events that have gone stale, and continue streaming the cache to newly joined participants */
+	expire_state(ctx, wall_clock_ms());
+
+	if (ctx->snapshot_pending)
+		ctx->snapshot_pending = stream_snapshots(ctx);
+
+	/*
+	sequence again through each entry in the linked list
+	output is written if the socket has become writable or a micro-batch window has closed
+	*/
+
+	pnt = ctx->participant_list_base;
+	now = now_us();
+
+	while (pnt)
+	{
+		if (pnt->out_pending > 0)
+		{
+			if (FD_ISSET(pnt->socket, writes) || (pnt->flush_deadline && (now >= pnt->flush_deadline)))
+				flush_participant(pnt);
+		}
+
+		pnt = pnt->next;
+	}
+
+	/* sockets marked 'closed' are left for terminate_participants(), which the main loop times separately */
+}
+
+static void parse_data(struct participant_list_struct *participant, struct server_context_type *ctx)
+{
+	int numRead;
+
+	do
+	{
+		reserve_input(participant);
+
+		numRead = recv(participant->socket, participant->buffer + participant->length, participant->max_length - participant->length, 0);
+		if (numRead >= 0) flight_record(FLIGHT_RECV, participant->socket, numRead);
+		USDT_PROBE2(recv, participant->socket, numRead);
+
+		switch (numRead)
+		{
+		case -1:
+#if defined(_MSC_VER) || defined(__MINGW32__)
+			if (WSAEWOULDBLOCK == WSAGetLastError())
+#else
+			if (EAGAIN == errno)
+#endif
+				break;
+		case 0:
+			participant->closed = true;
+			break;
+		default:
+			/* everything framed from this read is taken to have been received now, for measuring delivery latency */
+			ctx->received_time = now_us();
+			participant->heard = ctx->received_time;
+			frame_events(participant, numRead, handle_event, ctx);
+			ctx->received_time = 0;
+			break;
+		}
+
+	} while (numRead > 0);
+}
+
+/* make room for at least another buffer_chunk_size bytes of input */
+
+static void reserve_input(struct participant_list_struct *participant)
+{
+	if ( (participant->max_length <= 0) || ((participant->length + buffer_chunk_size) > participant->max_length) )
+	{
+		/* we'll likely run out of buffer space, so re-allocate more (2x as much) */
+		participant->max_length = (participant->max_length <= 0) ? buffer_chunk_size : (participant->max_length << 1);
+		participant->buffer = realloc(participant->buffer, participant->max_length);
+		assert(participant->buffer);
+	}
+}
+
+/*
+take the added bytes just placed at the end of a participant's input, and pass each event they complete to handle()
+only the bytes that could hold a terminator not already searched for are searched, however the input arrives
+*/
+
+static void frame_events(struct participant_list_struct *participant, int added,
+	void (*handle)(struct participant_list_struct *sender, const char *buffer, int length, struct server_context_type *ctx), struct server_context_type *ctx)
+{
+	int onset, consumed, size;
+	char *pnt;
+
+	onset = (participant->length > terminator_length) ? (participant->length - terminator_length) : 0;
+	participant->length += added;
+	participant->counters.bytes_in += added;
+	consumed = 0;
+
+	/* a single recv() may complete any number of events; each is handled in turn */
+	while ((pnt = memmem(participant->buffer + onset, participant->length - onset, terminator_string, terminator_length)))
+	{
+		size = (int)(pnt + terminator_length - (participant->buffer + consumed));
+		participant->counters.events_in++;
+		flight_record(FLIGHT_FRAME, participant->socket, size);
+		USDT_PROBE2(frame, participant->socket, size);
+		handle(participant, participant->buffer + consumed, size, ctx);
+		consumed += size;
+		onset = consumed;
+	}
+
+	/* shift any partial event to the start of the buffer once, rather than after every event */
+	if (consumed)
+	{
+		participant->length -= consumed;
+		memmove(participant->buffer, participant->buffer + consumed, participant->length);
+	}
+}
+
+/* act upon a single complete event received from a participant */
+
+static void handle_event(struct participant_list_struct *sender, const char *buffer, int length, struct server_context_type *ctx)
+{
+	struct event_header_type header;
+	struct area_type area;
+	const char *element, *element_end;
+	bool valid;
+
+	valid = extract_event_header(buffer, length, &header);
+
+	/* keepalive pings are answered here rather than repeated to every participant; any in a replayed journal are dropped */
+	if ( valid && (7 == header.type_length) && !memcmp(header.type, "t-x-c-t", 7) )
+	{
+		if (sender)
+			answer_ping(sender, ctx);
+		return;
+	}
+
+#if !defined(_MSC_VER) && !defined(__MINGW32__)
+	/* everything else received is journalled, before any decision about where (or whether) it goes */
+	if (ctx->journal && sender)
+		journal_append(ctx->journal, buffer, length, wall_clock_ms());
+#endif
+
+	/* the same event arriving again (via another bridge, or resent after a reconnect) is dropped before anything else */
+	if (is_duplicate(buffer, length, valid ? &header : NULL, ctx))
+	{
+		ctx->duplicates_dropped++;
+		return;
+	}
+
+	/* a participant may declare (or clear) its own area of interest with <__aoi minLat=".." minLon=".." maxLat=".." maxLon=".."/> */
+	if (sender && (element = find_element(buffer, buffer + length, "__aoi", &element_end)))
+	{
+		if (!parse_area(element, element_end, &area))
+			area.defined = false;
+		set_area(sender, &area, ctx);
+	}
+
+	/* likewise, it may restrict the CoT types it receives with <__filter type="a-h-*;b-t-f"/> */
+	if (sender && (element = find_element(buffer, buffer + length, "__filter", &element_end)))
+	{
+		const char *value;
+		int value_length;
+
+		value = find_attribute(element, element_end, "type", &value_length);
+		set_filter(sender, value, value ? value_length : 0, ctx);
+	}
+
+	/* on ports that take groups from the client, <__group name=".."/> (the ATAK team) decides the sender's group */
+	if (sender && sender->listener->group && !strcmp(sender->listener->group, "*") &&
+		(element = find_element(buffer, buffer + length, "__group", &element_end)))
+	{
+		const char *value;
+		int value_length;
+
+		value = find_attribute(element, element_end, "name", &value_length);
+
+		/* any client can name a group, so past MAX_GROUPS the names of new ones are ignored */
+		if (value && (ctx->groups.count + count_new_groups(value, value_length, ctx) > MAX_GROUPS))
+		{
+			if (0 == ctx->groups_refused++)
+				printf("WARNING: %d groups exist; further <__group> names are ignored\n", MAX_GROUPS);
+		}
+		else if (value && (longest_group_name(value, value_length) > MAX_GROUP_NAME))
+		{
+			if (0 == ctx->groups_refused++)
+				printf("WARNING: <__group> names longer than %d bytes are ignored\n", MAX_GROUP_NAME);
+		}
+		else if (value)
+			set_groups(sender, value, value_length, ctx);
+	}
+
+	if (valid && sender)
+		learn_identity(sender, buffer, length, &header, ctx);
+
+	if (valid)
+	{
+		/* events addressed with <marti><dest .../></marti> only go to the participants named, and aren't cached for others */
+		if (deliver_directed(sender, buffer, length, &header, ctx))
+			return;
+
+		/* the cache always gets the latest, but insignificant or overly frequent updates go no further */
+		if (is_thinned(update_state(sender, buffer, length, &header, ctx), &header, ctx))
+			return;
+	}
+
+	share_data(sender, buffer, length, valid ? &header : NULL, ctx);
+}
+
+/* locate the <event> element and pull out the attributes we care about */
+
+static bool extract_event_header(const char *buffer, int length, struct event_header_type *header)
+{
+	const char *element, *end, *value;
+	int value_length;
+
+	memset(header, 0, sizeof(struct event_header_type));
+
+	element = memmem(buffer, length, "<event", 6);
+	if (NULL == element) return false;
+
+	end = memchr(element, '>', buffer + length - element);
+	if (NULL == end) return false;
+
+	header->uid = find_attribute(element, end, "uid", &header->uid_length);
+	header->type = find_attribute(element, end, "type", &header->type_length);
+
+	if ((value = find_attribute(element, end, "time", &value_length)))
+		header->time = parse_cot_time(value, value_length);
+	if ((value = find_attribute(element, end, "stale", &value_length)))
+		header->stale = parse_cot_time(value, value_length);
+
+	if ((element = find_element(end, buffer + length, "point", &end)))
+	{
+		value = find_attribute(element, end, "lat", &value_length);
+		if (value) header->lat = strtod(value, NULL);
+		value = find_attribute(element, end, "lon", &value_length);
+		if (value) header->lon = strtod(value, NULL);
+		header->has_point = (header->lat != 0.0) || (header->lon != 0.0);
+	}
+
+	if ((element = find_element(end, buffer + length, "track", &end)))
+	{
+		value = find_attribute(element, end, "course", &value_length);
+		if (value) header->course = strtod(value, NULL);
+		value = find_attribute(element, end, "speed", &value_length);
+		if (value) header->speed = strtod(value, NULL);
+		header->has_track = true;
+	}
+
+	return (NULL != header->uid) && (header->uid_length > 0);
+}
+
+/* return the start of the first <name ...> element tag between buffer and end, setting element_end to its closing '>' */
+
+static const char *find_element(const char *buffer, const char *end, const char *name, const char **element_end)
+{
+	const char *pnt;
+	size_t name_length;
+
+	name_length = strlen(name);
+
+	for (pnt = buffer; (pnt = memmem(pnt, end - pnt, "<", 1)); pnt++)
+	{
+		if ( ((size_t)(end - pnt) <= name_length + 1) || memcmp(pnt + 1, name, name_length) )
+			continue;
+
+		/* the name must not merely be the prefix of a longer one */
+		switch (pnt[name_length + 1])
+		{
+		case ' ': case '\t': case '\r': case '\n': case '/': case '>':
+			*element_end = memchr(pnt, '>', end - pnt);
+			return (*element_end) ? pnt : NULL;
+		}
+	}
+
+	return NULL;
+}
+
+/* return the value of attribute 'name' within the element tag spanning element to end; quotes are excluded */
+
+static const char *find_attribute(const char *element, const char *end, const char *name, int *value_length)
+{
+	const char *pnt, *value, *close;
+	size_t name_length;
+
+	name_length = strlen(name);
+
+	for (pnt = element; (pnt = memmem(pnt, end - pnt, name, name_length)); pnt += name_length)
+	{
+		/* the name must stand alone (preceded by whitespace) and be followed by =" or =' */
+		if ( (pnt == element) || ((' ' != pnt[-1]) && ('\t' != pnt[-1]) && ('\r' != pnt[-1]) && ('\n' != pnt[-1])) )
+			continue;
+
+		value = pnt + name_length;
+		while ( (value < end) && (' ' == *value) ) value++;
+		if ( (value >= end) || ('=' != *value) ) continue;
+		value++;
+		while ( (value < end) && (' ' == *value) ) value++;
+		if ( (value >= end) || (('"' != *value) && ('\'' != *value)) ) continue;
+
+		close = memchr(value + 1, *value, end - value - 1);
+		if (NULL == close) return NULL;
+
+		*value_length = (int)(close - value - 1);
+		return value + 1;
+	}
+
+	return NULL;
+}
+
+/* convert a CoT timestamp (e.g. "2021-10-02T12:34:56.789Z") to milliseconds since the epoch; 0 if malformed */
+
+static int64_t parse_cot_time(const char *value, int length)
+{
+	int field[6], index, digits, millis, scale;
+	int64_t year, month, era, yoe, doy, doe, days;
+	const char *pnt, *end;
+
+	pnt = value;
+	end = value + length;
+
+	/* year, month, day, hour, minute, second, separated by any single non-digit */
+	for (index = 0; index < 6; index++)
+	{
+		field[index] = 0;
+		for (digits = 0; (pnt < end) && (*pnt >= '0') && (*pnt <= '9'); pnt++, digits++)
+			field[index] = field[index] * 10 + (*pnt - '0');
+		if (0 == digits) return 0;
+		if (index < 5)
+		{
+			if (pnt >= end) return 0;
+			pnt++;
+		}
+	}
+
+	millis = 0;
+	if ( (pnt < end) && ('.' == *pnt) )
+	{
+		for (pnt++, scale = 100; (pnt < end) && (*pnt >= '0') && (*pnt <= '9'); pnt++, scale /= 10)
+			millis += (*pnt - '0') * scale;
+	}
+
+	/* days since 1970-01-01 in the proleptic Gregorian calendar */
+	year = field[0];
+	month = field[1];
+	if (month <= 2) year--;
+	era = (year >= 0 ? year : year - 399) / 400;
+	yoe = year - era * 400;
+	doy = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + field[2] - 1;
+	doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+	days = era * 146097 + doe - 719468;
+
+	return ((days * 24 + field[3]) * 60 + field[4]) * 60000 + (int64_t)field[5] * 1000 + millis;
+}
+
+/* read an area of interest from the minLat, minLon, maxLat and maxLon attributes of an element */
+
+static bool parse_area(const char *element, const char *end, struct area_type *area)
+{
+	static const char *names[4] = { "minLat", "minLon", "maxLat", "maxLon" };
+	double values[4];
+	const char *value;
+	int index, value_length;
+
+	for (index = 0; index < 4; index++)
+	{
+		value = find_attribute(element, end, names[index], &value_length);
+		if (NULL == value) return false;
+		values[index] = strtod(value, NULL);
+	}
+
+	if (values[0] > values[2]) return false;
+
+	area->min_lat = values[0];
+	area->min_lon = values[1];
+	area->max_lat = values[2];
+	area->max_lon = values[3];
+	area->defined = true;
+
+	return true;
+}
+
+static bool area_contains(const struct area_type *area, double lat, double lon)
+{
+	if (!area->defined) return true;
+	if ( (lat < area->min_lat) || (lat > area->max_lat) ) return false;
+
+	if (area->min_lon <= area->max_lon)
+		return (lon >= area->min_lon) && (lon <= area->max_lon);
+	else
+		return (lon >= area->min_lon) || (lon <= area->max_lon);
+}
+
+/* replace a participant's area of interest (NULL removes it), keeping the spatial index up to date */
+
+static void set_area(struct participant_list_struct *participant, const struct area_type *area, struct server_context_type *ctx)
+{
+	if (participant->area.defined)
+		index_area(participant, false, ctx);
+	else
+		ctx->unrestricted[BITSET_WORD(participant->slot)] &= ~BITSET_BIT(participant->slot);
+
+	if (area && area->defined)
+	{
+		participant->area = *area;
+		index_area(participant, true, ctx);
+	}
+	else
+	{
+		participant->area.defined = false;
+		ctx->unrestricted[BITSET_WORD(participant->slot)] |= BITSET_BIT(participant->slot);
+	}
+}
+
+/* add (or remove) a participant's slot to (or from) every spatial index cell that its area of interest overlaps */
+
+static void index_area(struct participant_list_struct *participant, bool add, struct server_context_type *ctx)
+{
+	struct participant_list_struct **link;
+	struct grid_cell_type *cell;
+	int key[2], rows, columns, first_row, last_row, first_column, column_count, row, column, index;
+
+	rows = (int)(180.0 / ctx->grid_size) + 1;
+	columns = (int)(360.0 / ctx->grid_size + 0.999999);
+
+	first_row = (int)((participant->area.min_lat + 90.0) / ctx->grid_size);
+	last_row = (int)((participant->area.max_lat + 90.0) / ctx->grid_size);
+	if (first_row < 0) first_row = 0;
+	if (last_row >= rows) last_row = rows - 1;
+
+	first_column = (int)((participant->area.min_lon + 180.0) / ctx->grid_size);
+	column_count = (int)((participant->area.max_lon + 180.0) / ctx->grid_size) - first_column + 1;
+	if (participant->area.min_lon > participant->area.max_lon) column_count += columns;
+	if ( (column_count > columns) || (column_count <= 0) ) column_count = columns;
+
+	if (add)
+		participant->broad = ((last_row - first_row + 1) * column_count > max_area_cells);
+
+	if (participant->broad)
+	{
+		/* too large to index; such areas are few, so they are simply checked one by one */
+		if (add)
+		{
+			participant->next_broad = ctx->broad_list_base;
+			ctx->broad_list_base = participant;
+		}
+		else
+		{
+			for (link = &ctx->broad_list_base; *link; link = &(*link)->next_broad)
+			{
+				if (*link == participant)
+				{
+					*link = participant->next_broad;
+					break;
+				}
+			}
+		}
+		return;
+	}
+
+	for (row = first_row; row <= last_row; row++)
+	{
+		for (column = 0; column < column_count; column++)
+		{
+			key[0] = row;
+			key[1] = (((first_column + column) % columns) + columns) % columns;
+
+			cell = (struct grid_cell_type *)hash_find(&ctx->grid, (const char *)key, sizeof(key));
+
+			if (add)
+			{
+				if (NULL == cell)
+				{
+					cell = (struct grid_cell_type *)malloc(sizeof(struct grid_cell_type));
+					assert(cell);
+					memset(cell, 0, sizeof(struct grid_cell_type));
+					hash_insert(&ctx->grid, (const char *)key, sizeof(key), cell);
+				}
+
+				if (cell->count >= cell->max_count)
+				{
+					cell->max_count = (cell->max_count <= 0) ? 8 : (cell->max_count << 1);
+					cell->slots = realloc(cell->slots, cell->max_count * sizeof(int));
+					assert(cell->slots);
+				}
+
+				cell->slots[cell->count++] = participant->slot;
+			}
+			else if (cell)
+			{
+				for (index = 0; index < cell->count; index++)
+				{
+					if (cell->slots[index] == participant->slot)
+					{
+						cell->slots[index] = cell->slots[--cell->count];
+						break;
+					}
+				}
+
+				if (0 == cell->count)
+				{
+					hash_remove(&ctx->grid, (const char *)key, sizeof(key));
+					free(cell->slots);
+					free(cell);
+				}
+			}
+		}
+	}
+}
+
+/* mark in ctx->recipients the slots of every participant interested in an event, by area and then by type */
+
+static void select_recipients(const struct event_header_type *header, struct server_context_type *ctx)
+{
+	int index;
+
+	if ( (NULL == header) || !header->has_point )
+	{
+		/* events without a location are of interest to everyone */
+		memset(ctx->recipients, 0xFF, ctx->bitset_words * sizeof(uint64_t));
+	}
+	else
+	{
+		memcpy(ctx->recipients, ctx->unrestricted, ctx->bitset_words * sizeof(uint64_t));
+		select_area_recipients(header, ctx);
+	}
+
+	/* then narrow by type; events without a type only go to participants that haven't filtered by type */
+	memcpy(ctx->type_mask, ctx->unfiltered, ctx->bitset_words * sizeof(uint64_t));
+
+	if (header && header->type_length)
+	{
+		if (ctx->type_trie_dirty)
+			build_type_trie(ctx);
+
+		match_type_trie(ctx->type_trie, header->type, header->type + header->type_length, ctx->type_mask, ctx->bitset_words);
+	}
+
+	for (index = 0; index < ctx->bitset_words; index++)
+		ctx->recipients[index] &= ctx->type_mask[index];
+}
+
+/* add to ctx->recipients the slots of participants with an area of interest containing the event's point */
+
+static void select_area_recipients(const struct event_header_type *header, struct server_context_type *ctx)
+{
+	struct participant_list_struct *pnt;
+	struct grid_cell_type *cell;
+	int key[2], columns, index, slot;
+
+	columns = (int)(360.0 / ctx->grid_size + 0.999999);
+	key[0] = (int)((header->lat + 90.0) / ctx->grid_size);
+	key[1] = ((((int)((header->lon + 180.0) / ctx->grid_size)) % columns) + columns) % columns;
+
+	if ((cell = (struct grid_cell_type *)hash_find(&ctx->grid, (const char *)key, sizeof(key))))
+	{
+		for (index = 0; index < cell->count; index++)
+		{
+			slot = cell->slots[index];
+			if (area_contains(&ctx->slots[slot]->area, header->lat, header->lon))
+				ctx->recipients[BITSET_WORD(slot)] |= BITSET_BIT(slot);
+		}
+	}
+
+	for (pnt = ctx->broad_list_base; pnt; pnt = pnt->next_broad)
+	{
+		if (area_contains(&pnt->area, header->lat, header->lon))
+			ctx->recipients[BITSET_WORD(pnt->slot)] |= BITSET_BIT(pnt->slot);
+	}
+}
+
+/* replace a participant's CoT type filter (NULL removes it); the trie is recompiled before it is next used */
+
+static void set_filter(struct participant_list_struct *participant, const char *filter, int length, struct server_context_type *ctx)
+{
+	if (participant->filter)
+	{
+		if (filter && ((int)strlen(participant->filter) == length) && !memcmp(participant->filter, filter, length))
+			return;
+
+		free(participant->filter);
+		participant->filter = NULL;
+		ctx->type_trie_dirty = true;
+	}
+
+	if (filter && (length > 0))
+	{
+		participant->filter = (char *)malloc(length + 1);
+		assert(participant->filter);
+		memcpy(participant->filter, filter, length);
+		participant->filter[length] = '\0';
+		ctx->unfiltered[BITSET_WORD(participant->slot)] &= ~BITSET_BIT(participant->slot);
+		ctx->type_trie_dirty = true;
+	}
+	else
+	{
+		ctx->unfiltered[BITSET_WORD(participant->slot)] |= BITSET_BIT(participant->slot);
+	}
+}
+
+/*
+compile every participant's type filter into one trie over the dash-separated type hierarchy
+each pattern is a list of components; a final "*" matches any deeper type, any other "*" matches any one component
+*/
+
+static void build_type_trie(struct server_context_type *ctx)
+{
+	struct participant_list_struct *pnt;
+	struct type_node_struct *node, *child;
+	const char *pattern, *next, *end, *component, *dash;
+	uint64_t **bits;
+	int slot, length;
+
+	free_type_trie(ctx->type_trie);
+	ctx->type_trie = (struct type_node_struct *)calloc(1, sizeof(struct type_node_struct));
+	assert(ctx->type_trie);
+	ctx->type_trie_dirty = false;
+
+	for (slot = 0; slot < ctx->slot_count; slot++)
+	{
+		pnt = ctx->slots[slot];
+		if ( (NULL == pnt) || (NULL == pnt->filter) ) continue;
+
+		/* patterns are separated by semicolons, commas or spaces */
+		for (pattern = pnt->filter; *pattern; pattern = next)
+		{
+			end = pattern + strcspn(pattern, ";, ");
+			next = (*end) ? (end + 1) : end;
+			if (end == pattern) continue;
+
+			node = ctx->type_trie;
+			bits = NULL;
+
+			for (component = pattern; component < end; component += length + 1)
+			{
+				dash = memchr(component, '-', end - component);
+				length = (int)((dash ? dash : end) - component);
+
+				if ( (NULL == dash) && (1 == length) && ('*' == *component) )
+				{
+					bits = &node->subtree;
+					break;
+				}
+
+				for (child = node->children; child; child = child->sibling)
+				{
+					if ( (child->component_length == length) && !memcmp(child->component, component, length) )
+						break;
+				}
+
+				if (NULL == child)
+				{
+					child = (struct type_node_struct *)calloc(1, sizeof(struct type_node_struct) + length);
+					assert(child);
+					memcpy(child->component, component, length);
+					child->component_length = length;
+					child->sibling = node->children;
+					node->children = child;
+				}
+
+				node = child;
+			}
+
+			if (NULL == bits) bits = &node->exact;
+
+			if (NULL == *bits)
+			{
+				*bits = (uint64_t *)calloc(ctx->bitset_words, sizeof(uint64_t));
+				assert(*bits);
+			}
+
+			(*bits)[BITSET_WORD(slot)] |= BITSET_BIT(slot);
+		}
+	}
+}
+
+static void free_type_trie(struct type_node_struct *node)
+{
+	struct type_node_struct *next;
+
+	while (node)
+	{
+		next = node->sibling;
+		free_type_trie(node->children);
+		if (node->exact) free(node->exact);
+		if (node->subtree) free(node->subtree);
+		free(node);
+		node = next;
+	}
+}
+
+/* OR into mask the slots of every pattern that matches the type from 'type' to 'end'; a single walk of the trie */
+
+static void match_type_trie(const struct type_node_struct *node, const char *type, const char *end, uint64_t *mask, int words)
+{
+	const struct type_node_struct *child;
+	const uint64_t *bits;
+	const char *dash, *next;
+	int index;
+
+	bits = (type >= end) ? node->exact : node->subtree;
+
+	if (bits)
+	{
+		for (index = 0; index < words; index++)
+			mask[index] |= bits[index];
+	}
+
+	if (type >= end) return;
+
+	dash = memchr(type, '-', end - type);
+	next = dash ? (dash + 1) : end;
+	if (NULL == dash) dash = end;
+
+	for (child = node->children; child; child = child->sibling)
+	{
+		if ( ((1 == child->component_length) && ('*' == child->component[0])) ||
+			((child->component_length == (int)(dash - type)) && !memcmp(child->component, type, dash - type)) )
+			match_type_trie(child, next, end, mask, words);
+	}
+}
+
+/* check a type against a single filter without the trie; used when only one participant is involved */
+
+static bool filter_matches(const char *filter, const char *type, int length)
+{
+	const char *pattern, *next, *end, *component, *dash, *t, *t_dash, *t_end;
+	int component_length, t_length;
+
+	if (NULL == filter) return true;
+
+	t_end = type + length;
+
+	for (pattern = filter; *pattern; pattern = next)
+	{
+		end = pattern + strcspn(pattern, ";, ");
+		next = (*end) ? (end + 1) : end;
+		if (end == pattern) continue;
+
+		for (component = pattern, t = type; ; component = dash + 1)
+		{
+			dash = memchr(component, '-', end - component);
+			component_length = (int)((dash ? dash : end) - component);
+
+			/* a final "*" matches any deeper type */
+			if ( (NULL == dash) && (1 == component_length) && ('*' == *component) )
+			{
+				if (t < t_end) return true;
+				break;
+			}
+
+			if (t >= t_end) break;
+
+			t_dash = memchr(t, '-', t_end - t);
+			t_length = (int)((t_dash ? t_dash : t_end) - t);
+
+			if ( !((1 == component_length) && ('*' == *component)) && ((component_length != t_length) || memcmp(component, t, t_length)) )
+				break;
+
+			t = t_dash ? (t_dash + 1) : t_end;
+
+			/* at the end of the pattern, the type must have ended too */
+			if (NULL == dash)
+			{
+				if (NULL == t_dash) return true;
+				break;
+			}
+		}
+	}
+
+	return false;
+}
+
+/* move a participant into the groups named in a semicolon or comma separated list (NULL leaves all groups) */
+
+static void set_groups(struct participant_list_struct *participant, const char *names, int length, struct server_context_type *ctx)
+{
+	struct group_type *group;
+	const char *name, *end;
+	int index, member;
+
+	for (index = 0; index < participant->group_count; index++)
+	{
+		group = participant->groups[index];
+
+		for (member = 0; member < group->count; member++)
+		{
+			if (group->members[member] == participant)
+			{
+				group->members[member] = group->members[--group->count];
+				break;
+			}
+		}
+	}
+
+	participant->group_count = 0;
+
+	if (NULL == names) return;
+
+	for (name = names; (name <= names + length) && (participant->group_count < MAX_PARTICIPANT_GROUPS); name = end + 1)
+	{
+		for (end = name; (end < names + length) && (';' != *end) && (',' != *end); end++);
+
+		/* an empty list means the default group, but empty entries in a longer list are ignored */
+		if ( (end == name) && (length > 0) ) continue;
+
+		group = find_group(name, (int)(end - name), ctx);
+
+		for (index = 0; (index < participant->group_count) && (participant->groups[index] != group); index++);
+		if (index < participant->group_count) continue;
+
+		if (group->count >= group->max_count)
+		{
+			group->max_count = (group->max_count <= 0) ? 16 : (group->max_count << 1);
+			group->members = realloc(group->members, group->max_count * sizeof(struct participant_list_struct *));
+			assert(group->members);
+		}
+
+		group->members[group->count++] = participant;
+		participant->groups[participant->group_count++] = group;
+	}
+}
+
+/* the named group, created if need be */
+
+static struct group_type *find_group(const char *name, int length, struct server_context_type *ctx)
+{
+	struct group_type *group;
+
+	group = (struct group_type *)hash_find(&ctx->groups, name, length);
+
+	if (NULL == group)
+	{
+		group = (struct group_type *)calloc(1, sizeof(struct group_type));
+		assert(group);
+		group->name = (char *)malloc(length + 1);
+		assert(group->name);
+		memcpy(group->name, name, length);
+		group->name[length] = '\0';
+		hash_insert(&ctx->groups, name, length, group);
+	}
+
+	return group;
+}
+
+/* how many of the groups in a list don't exist yet */
+
+static int count_new_groups(const char *names, int length, struct server_context_type *ctx)
+{
+	const char *name, *end;
+	int count;
+
+	count = 0;
+
+	for (name = names; name <= names + length; name = end + 1)
+	{
+		for (end = name; (end < names + length) && (';' != *end) && (',' != *end); end++);
+
+		if ( ((end > name) || (0 == length)) && !hash_find(&ctx->groups, name, (int)(end - name)) )
+			count++;
+	}
+
+	return count;
+}
+
+/* the length of the longest name in a list of groups */
+
+static int longest_group_name(const char *names, int length)
+{
+	const char *name, *end;
+	int longest;
+
+	longest = 0;
+
+	for (name = names; name <= names + length; name = end + 1)
+	{
+		for (end = name; (end < names + length) && (';' != *end) && (',' != *end); end++);
+
+		if (end - name > longest) longest = (int)(end - name);
+	}
+
+	return longest;
+}
+
+/* true if the participant belongs to any of the groups */
+
+static bool share_group(struct group_type * const *groups, int group_count, const struct participant_list_struct *participant)
+{
+	int index, other;
+
+	for (index = 0; index < group_count; index++)
+	{
+		for (other = 0; other < participant->group_count; other++)
+		{
+			if (groups[index] == participant->groups[other])
+				return true;
+		}
+	}
+
+	return false;
+}
+
+/* give a participant the lowest free slot number, growing the bitsets if needed */
+
+static void assign_slot(struct participant_list_struct *participant, struct server_context_type *ctx)
+{
+	int slot;
+
+	for (slot = 0; (slot < ctx->slot_count) && ctx->slots[slot]; slot++);
+
+	if (slot == ctx->slot_count)
+	{
+		ctx->slot_count++;
+		ctx->slots = realloc(ctx->slots, ctx->slot_count * sizeof(struct participant_list_struct *));
+		assert(ctx->slots);
+
+		if (BITSET_WORD(slot) >= ctx->bitset_words)
+			grow_bitsets(ctx);
+	}
+
+	ctx->slots[slot] = participant;
+	participant->slot = slot;
+	participant->area.defined = false;
+	ctx->unrestricted[BITSET_WORD(slot)] |= BITSET_BIT(slot);
+	participant->filter = NULL;
+	ctx->unfiltered[BITSET_WORD(slot)] |= BITSET_BIT(slot);
+}
+
+/* double the bitsets (or create them), the new slots selecting no one */
+
+static void grow_bitsets(struct server_context_type *ctx)
+{
+	int words;
+
+	words = (ctx->bitset_words <= 0) ? 4 : (ctx->bitset_words << 1);
+	ctx->unrestricted = realloc(ctx->unrestricted, words * sizeof(uint64_t));
+	ctx->unfiltered = realloc(ctx->unfiltered, words * sizeof(uint64_t));
+	ctx->recipients = realloc(ctx->recipients, words * sizeof(uint64_t));
+	ctx->type_mask = realloc(ctx->type_mask, words * sizeof(uint64_t));
+	assert(ctx->unrestricted && ctx->unfiltered && ctx->recipients && ctx->type_mask);
+	memset(ctx->unrestricted + ctx->bitset_words, 0, (words - ctx->bitset_words) * sizeof(uint64_t));
+	memset(ctx->unfiltered + ctx->bitset_words, 0, (words - ctx->bitset_words) * sizeof(uint64_t));
+	ctx->bitset_words = words;
+	ctx->type_trie_dirty = true; /* the trie's bitsets must grow too */
+}
+
+static void release_slot(struct participant_list_struct *participant, struct server_context_type *ctx)
+{
+	ctx->unrestricted[BITSET_WORD(participant->slot)] &= ~BITSET_BIT(participant->slot);
+	ctx->unfiltered[BITSET_WORD(participant->slot)] &= ~BITSET_BIT(participant->slot);
+	ctx->slots[participant->slot] = NULL;
+}
+
+/* set up the reusable pong and locate the timestamps within it */
+
+static void prepare_pong(struct server_context_type *ctx)
+{
+	ctx->pong_length = (int)strlen(pong_template);
+	ctx->pong = (char *)malloc(ctx->pong_length + 1);
+	assert(ctx->pong);
+	memcpy(ctx->pong, pong_template, ctx->pong_length + 1);
+
+	ctx->pong_time = (int)(strstr(ctx->pong, "time=\"") - ctx->pong) + 6;
+	ctx->pong_start = (int)(strstr(ctx->pong, "start=\"") - ctx->pong) + 7;
+	ctx->pong_stale = (int)(strstr(ctx->pong, "stale=\"") - ctx->pong) + 7;
+}
+
+/* reply to a t-x-c-t ping with a t-x-c-t-r pong; nothing is allocated */
+
+static void answer_ping(struct participant_list_struct *sender, struct server_context_type *ctx)
+{
+	int64_t now;
+
+	now = wall_clock_ms();
+
+	format_cot_time(now, ctx->pong + ctx->pong_time);
+	memcpy(ctx->pong + ctx->pong_start, ctx->pong + ctx->pong_time, 24);
+	format_cot_time(now + pong_lifetime, ctx->pong + ctx->pong_stale);
+
+	send_to_participant(sender, ctx->pong, ctx->pong_length, LANE_CHAT, 0);
+	ctx->pings_answered++;
+}
+
+/* write milliseconds since the epoch as the 24 characters of a CoT timestamp, e.g. "2021-10-02T12:34:56.789Z" */
+
+static void format_cot_time(int64_t ms, char *value)
+{
+	static const int widths[7] = { 4, 2, 2, 2, 2, 2, 3 };
+	static const char separators[8] = "--T::.Z";
+	int64_t days, era, doe, yoe, year, doy, mp, day, month, seconds;
+	int field[7], index, digit;
+
+	days = ms / 86400000;
+	seconds = (ms % 86400000) / 1000;
+
+	/* inverse of the calculation in parse_cot_time() */
+	days += 719468;
+	era = (days >= 0 ? days : days - 146096) / 146097;
+	doe = days - era * 146097;
+	yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+	year = yoe + era * 400;
+	doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+	mp = (5 * doy + 2) / 153;
+	day = doy - (153 * mp + 2) / 5 + 1;
+	month = mp + (mp < 10 ? 3 : -9);
+	if (month <= 2) year++;
+
+	/* digit by digit, as this is done for every event exported */
+	field[0] = (int)year;
+	field[1] = (int)month;
+	field[2] = (int)day;
+	field[3] = (int)(seconds / 3600);
+	field[4] = (int)((seconds / 60) % 60);
+	field[5] = (int)(seconds % 60);
+	field[6] = (int)(ms % 1000);
+
+	for (index = 0; index < 7; index++)
+	{
+		for (digit = widths[index] - 1; digit >= 0; digit--)
+		{
+			value[digit] = (char)('0' + field[index] % 10);
+			field[index] /= 10;
+		}
+		value += widths[index];
+		*value++ = separators[index];
+	}
+}
+
+/*
+a client's own SA carries <takv> (or a <contact> with an endpoint); relayed events for other units generally don't
+the first such uid a participant sends is taken as its identity, and its callsign is tracked as it changes
+*/
+
+static void learn_identity(struct participant_list_struct *participant, const char *buffer, int length, const struct event_header_type *header, struct server_context_type *ctx)
+{
+	struct participant_list_struct *zombie, *holder;
+	const char *element, *element_end, *takv_end, *callsign;
+	int callsign_length;
+	bool learned, borne_out;
+
+	learned = false;
+
+	if ( (header->type_length < 2) || memcmp(header->type, "a-", 2) ) return;
+	if (participant->uid && ((header->uid_length != (int)strlen(participant->uid)) || memcmp(header->uid, participant->uid, header->uid_length)))
+		return;
+
+	element = find_element(buffer, buffer + length, "contact", &element_end);
+	if (NULL == element) return;
+	if ( !find_element(buffer, buffer + length, "takv", &takv_end) && !find_attribute(element, element_end, "endpoint", &callsign_length) )
+		return;
+
+	if (NULL == participant->uid)
+	{
+		/*
+		a client that reconnects (e.g. after moving from Wi-Fi to LTE) may leave its old connection behind, which should go
+		at once so that its directed traffic follows the client; but a claim alone doesn't prove that, so the old connection
+		is evicted straight away only when the claim is borne out by the same address or callsign, or when the old connection
+		has output the kernel won't take; otherwise only once it has gone quiet
+		*/
+		zombie = (struct participant_list_struct *)hash_find(&ctx->participant_by_uid, header->uid, header->uid_length);
+		if (zombie && (zombie != participant) && !zombie->closed)
+		{
+			callsign = find_attribute(element, element_end, "callsign", &callsign_length);
+			borne_out = (zombie->peer.sin_addr.s_addr == participant->peer.sin_addr.s_addr) ||
+				(callsign && zombie->callsign && ((int)strlen(zombie->callsign) == callsign_length) && !memcmp(zombie->callsign, callsign, callsign_length)) ||
+				((zombie->out_pending > 0) && (0 == zombie->flush_deadline));
+
+			if ( !borne_out && ((now_us() - zombie->heard) < (int64_t)ctx->zombie_silence * 1000000) )
+			{
+				ctx->identity_conflicts++;
+				if (!participant->conflicted)
+					log_conflict(participant, zombie, header->uid, header->uid_length, NULL, 0, ctx);
+				participant->conflicted = true;
+				return;
+			}
+
+			evict_zombie(zombie, participant, ctx);
+		}
+
+		participant->uid = (char *)malloc(header->uid_length + 1);
+		assert(participant->uid);
+		memcpy(participant->uid, header->uid, header->uid_length);
+		participant->uid[header->uid_length] = '\0';
+		hash_remove(&ctx->participant_by_uid, header->uid, header->uid_length);
+		hash_insert(&ctx->participant_by_uid, header->uid, header->uid_length, participant);
+		learned = true;
+	}
+
+	callsign = find_attribute(element, element_end, "callsign", &callsign_length);
+	if ( (NULL == callsign) || (0 == callsign_length) ||
+		(participant->callsign && ((int)strlen(participant->callsign) == callsign_length) && !memcmp(participant->callsign, callsign, callsign_length)) )
+	{
+		if (learned) log_identify(participant, ctx);
+		return;
+	}
+
+	/* the first claim on a callsign stands while its holder is connected, so that no one else can take its directed traffic */
+	holder = (struct participant_list_struct *)hash_find(&ctx->participant_by_callsign, callsign, callsign_length);
+	if (holder && (holder != participant) && !holder->closed)
+	{
+		ctx->identity_conflicts++;
+		if (!participant->conflicted)
+			log_conflict(participant, holder, NULL, 0, callsign, callsign_length, ctx);
+		participant->conflicted = true;
+
+		if (learned) log_identify(participant, ctx);
+		return;
+	}
+
+	if (participant->callsign)
+	{
+		if (hash_find(&ctx->participant_by_callsign, participant->callsign, (int)strlen(participant->callsign)) == participant)
+			hash_remove(&ctx->participant_by_callsign, participant->callsign, (int)strlen(participant->callsign));
+		free(participant->callsign);
+	}
+
+	participant->callsign = (char *)malloc(callsign_length + 1);
+	assert(participant->callsign);
+	memcpy(participant->callsign, callsign, callsign_length);
+	participant->callsign[callsign_length] = '\0';
+	hash_remove(&ctx->participant_by_callsign, callsign, callsign_length);
+	hash_insert(&ctx->participant_by_callsign, callsign, callsign_length, participant);
+
+	log_identify(participant, ctx);
+}
+
+/*
+close the earlier connection of a client that has reconnected, so that fanout stops queueing events for it
+when both arrived on the same port, the subscriptions it made (area of interest, type filter and groups)
+and its callsign carry over to the new connection
+*/
+
+static void evict_zombie(struct participant_list_struct *zombie, struct participant_list_struct *participant, struct server_context_type *ctx)
+{
+	struct group_type *group;
+	int index, member;
+
+	zombie->closed = true;
+	ctx->zombies_evicted++;
+	log_evict(zombie, participant, ctx);
+
+	if (zombie->listener == participant->listener)
+	{
+		set_area(participant, &zombie->area, ctx);
+		set_filter(participant, zombie->filter, zombie->filter ? (int)strlen(zombie->filter) : 0, ctx);
+
+		/* take the zombie's place in each of its groups */
+		set_groups(participant, NULL, 0, ctx);
+		for (index = 0; index < zombie->group_count; index++)
+		{
+			group = zombie->groups[index];
+
+			for (member = 0; member < group->count; member++)
+			{
+				if (group->members[member] == zombie)
+				{
+					group->members[member] = participant;
+					break;
+				}
+			}
+
+			participant->groups[index] = group;
+		}
+		participant->group_count = zombie->group_count;
+		zombie->group_count = 0;
+	}
+
+	if (zombie->callsign && (NULL == participant->callsign))
+	{
+		participant->callsign = zombie->callsign;
+		zombie->callsign = NULL;
+		hash_remove(&ctx->participant_by_callsign, participant->callsign, (int)strlen(participant->callsign));
+		hash_insert(&ctx->participant_by_callsign, participant->callsign, (int)strlen(participant->callsign), participant);
+	}
+}
+
+static void forget_identity(struct participant_list_struct *participant, struct server_context_type *ctx)
+{
+	if (participant->uid)
+	{
+		if (hash_find(&ctx->participant_by_uid, participant->uid, (int)strlen(participant->uid)) == participant)
+			hash_remove(&ctx->participant_by_uid, participant->uid, (int)strlen(participant->uid));
+		free(participant->uid);
+		participant->uid = NULL;
+	}
+
+	if (participant->callsign)
+	{
+		if (hash_find(&ctx->participant_by_callsign, participant->callsign, (int)strlen(participant->callsign)) == participant)
+			hash_remove(&ctx->participant_by_callsign, participant->callsign, (int)strlen(participant->callsign));
+		free(participant->callsign);
+		participant->callsign = NULL;
+	}
+}
+
+/*
+send an event carrying <marti><dest callsign=".."/><dest uid=".."/></marti> to just the named participants
+each destination is a single hash lookup; destinations not currently connected are silently skipped
+returns false if the event has no such destinations and should be shared as usual
+*/
+
+static bool deliver_directed(struct participant_list_struct *sender, const char *buffer, int length, const struct event_header_type *header, struct server_context_type *ctx)
+{
+	struct participant_list_struct *recipient;
+	const char *marti, *marti_end, *element, *element_end, *value;
+	enum lane_type lane;
+	int value_length;
+	bool directed;
+
+	marti = find_element(buffer, buffer + length, "marti", &marti_end);
+	if ( (NULL == marti) || ('/' == marti_end[-1]) ) return false;
+
+	marti_end = memmem(marti_end, buffer + length - marti_end, "</marti>", 8);
+	if (NULL == marti_end) return false;
+
+	directed = false;
+	lane = classify_lane(header);
+	ctx->delivery_serial++;
+
+	for (element = marti; (element = find_element(element + 1, marti_end, "dest", &element_end)); )
+	{
+		recipient = NULL;
+
+		if ((value = find_attribute(element, element_end, "uid", &value_length)))
+		{
+			directed = true;
+			recipient = (struct participant_list_struct *)hash_find(&ctx->participant_by_uid, value, value_length);
+		}
+		else if ((value = find_attribute(element, element_end, "callsign", &value_length)))
+		{
+			directed = true;
+			recipient = (struct participant_list_struct *)hash_find(&ctx->participant_by_callsign, value, value_length);
+		}
+
+		if ( (NULL == recipient) || recipient->closed || (recipient->delivery_serial == ctx->delivery_serial) ) continue;
+		recipient->delivery_serial = ctx->delivery_serial;
+
+		/* directed traffic still doesn't cross between groups */
+		if (sender && !share_group(sender->groups, sender->group_count, recipient)) continue;
+
+		send_to_participant(recipient, buffer, length, lane, ctx->received_time);
+	}
+
+	if (directed) ctx->events_directed++;
+
+	return directed;
+}
+
+/*
+check an event against those seen within the dedup window, and remember it
+events are identified by uid, type and time where available, otherwise by their entire content
+the table is fixed in size and only a few neighbouring slots are probed, so the cost per event is constant;
+when all are in use the oldest is overwritten, so under extreme load a repeat may occasionally get through
+*/
+
+static bool is_duplicate(const char *buffer, int length, const struct event_header_type *header, struct server_context_type *ctx)
+{
+	struct dedup_slot_type *slot, *victim;
+	uint64_t hash;
+	int64_t now;
+	int probe;
+
+	if (NULL == ctx->dedup_table) return false;
+
+	if (header && header->type_length && header->time)
+	{
+		hash = hash_bytes(header->uid, header->uid_length);
+		hash = (hash ^ hash_bytes(header->type, header->type_length)) * 1099511628211ULL;
+		hash = (hash ^ (uint64_t)header->time) * 1099511628211ULL;
+	}
+	else
+	{
+		hash = hash_bytes(buffer, length);
+	}
+
+	if (0 == hash) hash = 1; /* zero marks an empty slot */
+
+	now = now_us();
+	victim = NULL;
+
+	for (probe = 0; probe < dedup_probes; probe++)
+	{
+		slot = &ctx->dedup_table[(hash + probe) & (dedup_table_size - 1)];
+
+		if ( (slot->hash == hash) && slot->seen && ((now - slot->seen) < (int64_t)ctx->dedup_window * 1000000) )
+			return true;
+
+		/* the least recently seen slot is replaced; empty and expired slots are naturally the oldest */
+		if ( (NULL == victim) || (slot->seen < victim->seen) )
+			victim = slot;
+	}
+
+	victim->hash = hash;
+	victim->seen = now;
+
+	return false;
+}
+
+/*
+decide whether an update for a cached uid should be withheld from fanout
+position reports are withheld unless the unit has moved, turned, changed speed or been quiet long enough (-thin),
+and every uid but those raising emergency alerts is held to a token bucket (-rate)
+uids without a cache entry (with -cache 0, or once the cache is full) are never withheld
+*/
+
+static bool is_thinned(struct state_entry_type *entry, const struct event_header_type *header, struct server_context_type *ctx)
+{
+	double north, east, turn, speed;
+	int64_t now;
+
+	if (NULL == entry) return false;
+
+	/* an alert must get through, however chatty its sender */
+	if ( (header->type_length >= 6) && !memcmp(header->type, "b-a-o-", 6) )
+		return false;
+
+	now = now_us();
+
+	if ( entry->shared_time && header->has_point && (header->type_length >= 2) && !memcmp(header->type, "a-", 2) &&
+		((ctx->thin_distance > 0.0) || (ctx->thin_turn > 0.0) || (ctx->thin_interval > 0.0) || (ctx->thin_speed > 0.0)) )
+	{
+		/* equirectangular approximation; plenty for distances of interest here */
+		north = (header->lat - entry->shared_lat) * 111320.0;
+		east = (header->lon - entry->shared_lon);
+		if (east > 180.0) east -= 360.0;
+		if (east < -180.0) east += 360.0;
+		east *= 111320.0 * cos(header->lat * 3.14159265358979 / 180.0);
+
+		turn = header->has_track ? fabs(header->course - entry->shared_course) : 0.0;
+		if (turn > 180.0) turn = 360.0 - turn;
+		speed = header->has_track ? fabs(header->speed - entry->shared_speed) : 0.0;
+
+		if ( !((ctx->thin_distance > 0.0) && ((north * north + east * east) > (ctx->thin_distance * ctx->thin_distance))) &&
+			!((ctx->thin_turn > 0.0) && (turn > ctx->thin_turn)) &&
+			!((ctx->thin_speed > 0.0) && (speed > ctx->thin_speed)) &&
+			!((ctx->thin_interval > 0.0) && ((now - entry->shared_time) >= (int64_t)(ctx->thin_interval * 1000000.0))) )
+		{
+			ctx->updates_thinned++;
+			return true;
+		}
+	}
+
+	if (ctx->uid_rate > 0.0)
+	{
+		if (0 == entry->token_time)
+			entry->tokens = ctx->uid_burst;
+		else
+			entry->tokens += (double)(now - entry->token_time) * ctx->uid_rate / 1000000.0;
+		if (entry->tokens > ctx->uid_burst) entry->tokens = ctx->uid_burst;
+		entry->token_time = now;
+
+		if (entry->tokens < 1.0)
+		{
+			ctx->updates_rate_limited++;
+			return true;
+		}
+
+		entry->tokens -= 1.0;
+	}
+
+	entry->shared_lat = header->lat;
+	entry->shared_lon = header->lon;
+	entry->shared_course = header->course;
+	entry->shared_speed = header->speed;
+	entry->shared_time = now;
+
+	return false;
+}
+
+/* remember this event as the latest for its uid */
+
+static struct state_entry_type *update_state(struct participant_list_struct *sender, const char *buffer, int length, const struct event_header_type *header, struct server_context_type *ctx)
+{
+	struct state_entry_type *entry;
+
+	/* transient events (pings and other tasking) and events without a lifetime aren't worth replaying */
+	if ( (header->stale <= 0) || ((header->type_length >= 2) && !memcmp(header->type, "t-", 2)) )
+		return NULL;
+
+	entry = (struct state_entry_type *)hash_find(&ctx->state_by_uid, header->uid, header->uid_length);
+
+	if (NULL == entry)
+	{
+		if (ctx->state_count >= ctx->state_limit) return NULL;
+
+		if (ctx->state_count >= ctx->state_max_count)
+		{
+			ctx->state_max_count = (ctx->state_max_count <= 0) ? 1024 : (ctx->state_max_count << 1);
+			ctx->state_entries = realloc(ctx->state_entries, ctx->state_max_count * sizeof(struct state_entry_type *));
+			assert(ctx->state_entries);
+		}
+
+		entry = (struct state_entry_type *)malloc(sizeof(struct state_entry_type));
+		assert(entry);
+		memset(entry, 0, sizeof(struct state_entry_type));
+		entry->index = ctx->state_count++;
+		ctx->state_entries[entry->index] = entry;
+		hash_insert(&ctx->state_by_uid, header->uid, header->uid_length, entry);
+	}
+
+	if (entry->length < length)
+	{
+		entry->event = realloc(entry->event, length);
+		assert(entry->event);
+	}
+
+	memcpy(entry->event, buffer, length);
+	entry->length = length;
+	entry->uid_offset = (int)(header->uid - buffer);
+	entry->uid_length = header->uid_length;
+	entry->type_offset = header->type ? (int)(header->type - buffer) : 0;
+	entry->type_length = header->type_length;
+	entry->stale = header->stale;
+	entry->lat = header->lat;
+	entry->lon = header->lon;
+	entry->has_point = header->has_point;
+	entry->group_count = sender ? sender->group_count : 0;
+	if (entry->group_count)
+		memcpy(entry->groups, sender->groups, entry->group_count * sizeof(struct group_type *));
+
+	return entry;
+}
+
+/* drop a cache entry; the last entry takes its place so that the array stays dense */
+
+static void remove_state(struct state_entry_type *entry, struct server_context_type *ctx)
+{
+	struct state_entry_type *last;
+
+	hash_remove(&ctx->state_by_uid, entry->event + entry->uid_offset, entry->uid_length);
+
+	last = ctx->state_entries[--ctx->state_count];
+	last->index = entry->index;
+	ctx->state_entries[entry->index] = last;
+
+	free(entry->event);
+	free(entry);
+}
+
+/* periodically sweep out cache entries whose stale time has passed */
+
+static void expire_state(struct server_context_type *ctx, int64_t now)
+{
+	int index;
+
+	if (now < ctx->state_expiry_time) return;
+	ctx->state_expiry_time = now + 10000;
+
+	/* walking downward keeps the sweep correct as remove_state() moves the last entry into the gap */
+	for (index = ctx->state_count - 1; index >= 0; index--)
+	{
+		if (ctx->state_entries[index]->stale <= now)
+			remove_state(ctx->state_entries[index], ctx);
+	}
+}
+
+/*
+send cached events to participants that have recently joined
+a shared token bucket bounds the overall rate, so that a mass reconnect doesn't flood the server
+each participant's cursor counts down, so entries moved by remove_state() are never skipped
+returns true if there is more to send
+*/
+
+static bool stream_snapshots(struct server_context_type *ctx)
+{
+	struct participant_list_struct *pnt;
+	struct state_entry_type *entry;
+	int64_t now, wall;
+	bool pending, progress;
+
+	now = now_us();
+	wall = wall_clock_ms();
+
+	ctx->snapshot_tokens += (double)(now - ctx->snapshot_refill_time) * ctx->snapshot_rate / 1000000.0;
+	if ( (ctx->snapshot_tokens > ctx->snapshot_rate / 10.0) || (ctx->snapshot_refill_time <= 0) )
+		ctx->snapshot_tokens = (ctx->snapshot_rate >= 10) ? (ctx->snapshot_rate / 10.0) : 1.0;
+	ctx->snapshot_refill_time = now;
+
+	do
+	{
+		pending = progress = false;
+
+		/* one event per participant per pass, so that joiners share the budget fairly */
+		for (pnt = ctx->participant_list_base; pnt; pnt = pnt->next)
+		{
+			if (pnt->closed || (pnt->snapshot_remaining <= 0)) continue;
+
+			if (pnt->snapshot_remaining > ctx->state_count)
+				pnt->snapshot_remaining = ctx->state_count;
+
+			if (pnt->snapshot_remaining <= 0) continue;
+
+			pending = true;
+
+			if ( (ctx->snapshot_tokens < 1.0) || (pnt->out_pending > snapshot_backlog_size) )
+				continue;
+
+			entry = NULL;
+			while (pnt->snapshot_remaining > 0)
+			{
+				entry = ctx->state_entries[--pnt->snapshot_remaining];
+				if ( (entry->stale > wall) && (!entry->has_point || area_contains(&pnt->area, entry->lat, entry->lon)) &&
+					filter_matches(pnt->filter, entry->event + entry->type_offset, entry->type_length) &&
+					(!entry->group_count || share_group(entry->groups, entry->group_count, pnt)) )
+					break;
+				entry = NULL;
+			}
+
+			if (entry)
+			{
+				send_to_participant(pnt, entry->event, entry->length, LANE_BULK, 0);
+				ctx->snapshot_tokens -= 1.0;
+				progress = true;
+			}
+		}
+
+	} while (progress && (ctx->snapshot_tokens >= 1.0));
+
+	return pending;
+}
+
+/* utility function to FD_SET all sockets in the participant list, and track the highest socket (for select()) */
+
+static SOCKET set_reads(fd_set *state, SOCKET highest_socket, struct server_context_type *ctx)
+{
+	struct participant_list_struct *pnt;
+	struct admin_client_struct *client;
+
+	pnt = ctx->participant_list_base;
+
+	while (pnt)
+	{
+		FD_SET(pnt->socket, state);
+
+		if (pnt->socket > highest_socket)
+			highest_socket = pnt->socket;
+
+		pnt = pnt->next;
+	}
+
+	for (client = ctx->admin_list_base; client; client = client->next)
+	{
+		FD_SET(client->socket, state);
+		if (client->socket > highest_socket) highest_socket = client->socket;
+	}
+
+	return highest_socket;
+}
+
+/* utility function to FD_SET all sockets with output that may be written now, and track the highest socket (for select()) */
+
+static SOCKET set_writes(fd_set *state, SOCKET highest_socket, struct server_context_type *ctx)
+{
+	struct participant_list_struct *pnt;
+	struct admin_client_struct *client;
+
+	pnt = ctx->participant_list_base;
+
+	while (pnt)
+	{
+		if ( (pnt->out_pending > 0) && (0 == pnt->flush_deadline) )
+		{
+			FD_SET(pnt->socket, state);
+
+			if (pnt->socket > highest_socket)
+				highest_socket = pnt->socket;
+		}
+
+		pnt = pnt->next;
+	}
+
+	for (client = ctx->admin_list_base; client; client = client->next)
+	{
+		if (client->output_length > client->output_offset)
+		{
+			FD_SET(client->socket, state);
+			if (client->socket > highest_socket) highest_socket = client->socket;
+		}
+	}
+
+	return highest_socket;
+}
+
+/* utility function to determine how long select() may wait before the earliest micro-batch window closes */
+
+static int64_t next_flush_wait(struct server_context_type *ctx, int64_t now, int64_t limit)
+{
+	struct participant_list_struct *pnt;
+
+	for (pnt = ctx->participant_list_base; pnt; pnt = pnt->next)
+	{
+		if ( (pnt->out_pending > 0) && pnt->flush_deadline )
+		{
+			if (pnt->flush_deadline <= now) return 0;
+			if ((pnt->flush_deadline - now) < limit) limit = pnt->flush_deadline - now;
+		}
+	}
+
+	return limit;
+}
+
+/* utility function to configure a socket as non-blocking */
+
+static void set_nonblocking(SOCKET sock)
+{
+#if defined(_MSC_VER) || defined(__MINGW32__)
+	u_long nonblocking = 1;
+	ioctlsocket(sock, FIONBIO, &nonblocking);
+#else
+	int opts;
+
+	opts = fcntl(sock, F_GETFL);
+
+	if (opts > 0)
+	{
+		opts = (opts | O_NONBLOCK);
+		fcntl(sock, F_SETFL, opts);
+	}
+#endif
+}
+
+/* utility function to disable Nagle's algorithm on a socket */
+
+static void set_nodelay(SOCKET sock)
+{
+	int flag = 1;
+
+	setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, (const char *)&flag, sizeof(flag));
+}
+
+/* send provided message to all participants interested in it; with a sender, only members of its groups are considered */
+
+static void share_data(struct participant_list_struct *sender, const char *buffer, int length, const struct event_header_type *header, struct server_context_type *ctx)
+{
+	struct participant_list_struct *pnt;
+	struct group_type *group;
+	enum lane_type lane;
+	int index, member;
+
+	select_recipients(header, ctx);
+	lane = classify_lane(header);
+
+	if (NULL == sender)
+	{
+		for (pnt = ctx->participant_list_base; pnt; pnt = pnt->next)
+		{
+			if (!pnt->closed && (ctx->recipients[BITSET_WORD(pnt->slot)] & BITSET_BIT(pnt->slot)))
+			{
+				USDT_PROBE3(fanout, -1, pnt->socket, length);
+				send_to_participant(pnt, buffer, length, lane, ctx->received_time);
+			}
+		}
+		return;
+	}
+
+	ctx->delivery_serial++;
+
+	for (index = 0; index < sender->group_count; index++)
+	{
+		group = sender->groups[index];
+
+		for (member = 0; member < group->count; member++)
+		{
+			pnt = group->members[member];
+
+			/* a participant in several of the sender's groups is only sent the event once */
+			if (pnt->delivery_serial == ctx->delivery_serial) continue;
+			pnt->delivery_serial = ctx->delivery_serial;
+
+			if (!pnt->closed && (ctx->recipients[BITSET_WORD(pnt->slot)] & BITSET_BIT(pnt->slot)))
+			{
+				USDT_PROBE3(fanout, sender->socket, pnt->socket, length);
+				send_to_participant(pnt, buffer, length, lane, ctx->received_time);
+			}
+		}
+	}
+}
+
+/* choose the outbound priority of an event from its CoT type */
+
+static enum lane_type classify_lane(const struct event_header_type *header)
+{
+	if (header && (header->type_length >= 6) && !memcmp(header->type, "b-a-o-", 6))
+		return LANE_EMERGENCY;
+	if (header && (header->type_length >= 5) && !memcmp(header->type, "b-t-f", 5))
+		return LANE_CHAT;
+
+	return LANE_BULK;
+}
+
+/* queue a message for a participant; latency mode writes immediately, throughput mode waits for the micro-batch window to close */
+
+static void send_to_participant(struct participant_list_struct *participant, const char *buffer, int length, enum lane_type lane, int64_t received)
+{
+	enqueue_data(participant, buffer, length, lane, received);
+
+	if (0 == participant->flush_deadline)
+		flush_participant(participant);
+}
+
+/* append a message to one of a participant's outbound lanes, opening a micro-batch window if appropriate */
+
+static void enqueue_data(struct participant_list_struct *participant, const char *buffer, int length, enum lane_type lane, int64_t received)
+{
+	struct outbound_lane_type *queue;
+	int pending;
+
+	queue = &participant->lanes[lane];
+	pending = queue->length - queue->offset;
+
+	if ((pending + length) > max_backlog_size)
+	{
+		/* bulk traffic for a slow consumer is shed, oldest first; a backlog of alerts or chat means it is hopelessly stuck */
+		if (LANE_BULK == lane)
+			shed_bulk(participant, length);
+
+		pending = queue->length - queue->offset;
+
+		if ((pending + length) > max_backlog_size)
+		{
+			participant->counters.send_failures++;
+			participant->closed = true;
+			return;
+		}
+	}
+
+	/* emergencies never wait for a micro-batch window */
+	if (LANE_EMERGENCY == lane)
+		participant->flush_deadline = 0;
+	else if ( (0 == participant->out_pending) && (EGRESS_THROUGHPUT == participant->listener->egress_mode) && (participant->listener->batch_window > 0) )
+		participant->flush_deadline = now_us() + participant->listener->batch_window;
+
+	if ((queue->length + length) > queue->max_length)
+	{
+		/* reclaim the space already written before considering growing the buffer */
+		memmove(queue->buffer, queue->buffer + queue->offset, pending);
+		queue->offset = 0;
+		queue->length = pending;
+
+		while ((pending + length) > queue->max_length)
+		{
+			queue->max_length = (queue->max_length <= 0) ? buffer_chunk_size : (queue->max_length << 1);
+			queue->buffer = realloc(queue->buffer, queue->max_length);
+			assert(queue->buffer);
+		}
+	}
+
+	if ((queue->size_head + queue->size_count) >= queue->size_max)
+	{
+		if (queue->size_head > 0)
+		{
+			memmove(queue->sizes, queue->sizes + queue->size_head, queue->size_count * sizeof(int));
+			memmove(queue->times, queue->times + queue->size_head, queue->size_count * sizeof(int64_t));
+			queue->size_head = 0;
+		}
+		else
+		{
+			queue->size_max = (queue->size_max <= 0) ? 64 : (queue->size_max << 1);
+			queue->sizes = realloc(queue->sizes, queue->size_max * sizeof(int));
+			assert(queue->sizes);
+			queue->times = realloc(queue->times, queue->size_max * sizeof(int64_t));
+			assert(queue->times);
+		}
+	}
+
+	memcpy(queue->buffer + queue->length, buffer, length);
+	queue->length += length;
+	queue->times[queue->size_head + queue->size_count] = received;
+	queue->sizes[queue->size_head + queue->size_count++] = length;
+	participant->out_pending += length;
+	participant->out_events++;
+	participant->counters.messages_queued++;
+	flight_record(FLIGHT_ENQUEUE, participant->socket, length);
+}
+
+/* discard the oldest whole bulk messages until 'length' more bytes fit; a partly written message is kept */
+
+static void shed_bulk(struct participant_list_struct *participant, int length)
+{
+	struct outbound_lane_type *queue;
+	int keep, first, drop, count, bytes;
+
+	queue = &participant->lanes[LANE_BULK];
+
+	/* the unwritten remainder of a partly written message must still go out intact */
+	keep = queue->head_sent ? (queue->sizes[queue->size_head] - queue->head_sent) : 0;
+	first = queue->size_head + (queue->head_sent ? 1 : 0);
+
+	for (count = 0, bytes = 0, drop = first; drop < queue->size_head + queue->size_count; drop++)
+	{
+		if ((queue->length - queue->offset - bytes + length) <= max_backlog_size) break;
+		bytes += queue->sizes[drop];
+		count++;
+	}
+
+	if (0 == count) return;
+
+	memmove(queue->buffer + queue->offset + keep, queue->buffer + queue->offset + keep + bytes, queue->length - queue->offset - keep - bytes);
+	queue->length -= bytes;
+	memmove(queue->sizes + first, queue->sizes + first + count, (queue->size_head + queue->size_count - first - count) * sizeof(int));
+	memmove(queue->times + first, queue->times + first + count, (queue->size_head + queue->size_count - first - count) * sizeof(int64_t));
+	queue->size_count -= count;
+	participant->out_pending -= bytes;
+	participant->listener->messages_shed += count;
+	participant->counters.messages_shed += count;
+}
+
+/* choose the lane to write next, according to the listener's scheduling policy; -1 if nothing is queued */
+
+static int pick_lane(struct participant_list_struct *participant)
+{
+	struct outbound_lane_type *queue;
+	int lane, visits;
+
+	if (SCHEDULE_STRICT == participant->listener->schedule)
+	{
+		for (lane = 0; lane < LANE_COUNT; lane++)
+		{
+			if (participant->lanes[lane].length > participant->lanes[lane].offset)
+				return lane;
+		}
+		return -1;
+	}
+
+	/* deficit round robin: each visit to a lane grants it a quantum in proportion to its weight */
+	for (visits = 0; visits <= 2 * LANE_COUNT; visits++)
+	{
+		lane = participant->current_lane;
+		queue = &participant->lanes[lane];
+
+		if (queue->length <= queue->offset)
+		{
+			participant->deficit[lane] = 0;
+			participant->current_lane = (lane + 1) % LANE_COUNT;
+			continue;
+		}
+
+		if (participant->deficit[lane] <= 0)
+			participant->deficit[lane] += lane_weights[lane] * lane_quantum;
+
+		if (participant->deficit[lane] > 0)
+			return lane;
+
+		participant->current_lane = (lane + 1) % LANE_COUNT;
+	}
+
+	return -1;
+}
+
+/* account for 'amount' bytes of a lane having been written */
+
+static void consume_lane(struct participant_list_struct *participant, int lane, int amount)
+{
+	struct outbound_lane_type *queue;
+	int remainder;
+	int64_t now;
+
+	now = 0;
+
+	queue = &participant->lanes[lane];
+	queue->offset += amount;
+	participant->out_pending -= amount;
+
+	while (amount > 0)
+	{
+		remainder = queue->sizes[queue->size_head] - queue->head_sent;
+
+		if (amount < remainder)
+		{
+			queue->head_sent += amount;
+			break;
+		}
+
+		/* a message received from a participant has crossed the server once its last byte has been handed to the kernel */
+		if (queue->times[queue->size_head])
+		{
+			if (0 == now) now = now_us();
+			record_latency(&participant->listener->latency, now - queue->times[queue->size_head]);
+		}
+
+		amount -= remainder;
+		queue->head_sent = 0;
+		queue->size_head++;
+		queue->size_count--;
+		participant->counters.messages_out++;
+	}
+
+	participant->partial_lane = queue->head_sent ? lane : -1;
+
+	if (queue->offset >= queue->length)
+		queue->offset = queue->length = queue->size_head = 0;
+}
+
+/* write as much pending output to a participant as the socket will accept, highest priority first */
+
+static void flush_participant(struct participant_list_struct *participant)
+{
+	struct outbound_lane_type *queue;
+	int outcome, lane, amount;
+
+	participant->flush_deadline = 0;
+
+	if (participant->out_events)
+	{
+		participant->listener->batch_flushes++;
+		participant->listener->batched_events += participant->out_events;
+		participant->out_events = 0;
+	}
+
+	while (!participant->closed && (participant->out_pending > 0))
+	{
+		if (participant->partial_lane >= 0)
+		{
+			/* finish the message in progress before anything else may go */
+			lane = participant->partial_lane;
+			queue = &participant->lanes[lane];
+			amount = queue->sizes[queue->size_head] - queue->head_sent;
+		}
+		else
+		{
+			lane = pick_lane(participant);
+			if (lane < 0) break;
+			queue = &participant->lanes[lane];
+			amount = queue->length - queue->offset;
+			if ( (SCHEDULE_WEIGHTED == participant->listener->schedule) && (amount > participant->deficit[lane]) )
+				amount = participant->deficit[lane];
+		}
+
+		outcome = send(participant->socket, queue->buffer + queue->offset, amount, MSG_NOSIGNAL);
+		flight_record(FLIGHT_SEND, participant->socket, outcome);
+
+		if (outcome > 0)
+		{
+			participant->counters.bytes_out += outcome;
+			consume_lane(participant, lane, outcome);
+
+			if (SCHEDULE_WEIGHTED == participant->listener->schedule)
+			{
+				participant->deficit[lane] -= outcome;
+				if ( (participant->deficit[lane] <= 0) && (participant->partial_lane < 0) )
+					participant->current_lane = (lane + 1) % LANE_COUNT;
+			}
+		}
+		else
+		{
+#if defined(_MSC_VER) || defined(__MINGW32__)
+			if ( (outcome < 0) && (WSAEWOULDBLOCK == WSAGetLastError()) )
+#else
+			if ( (outcome < 0) && ((EAGAIN == errno) || (EWOULDBLOCK == errno)) )
+#endif
+				break; /* select() will tell us when there is room for the remainder */
+
+			participant->counters.send_failures++;
+			participant->closed = true;
+		}
+	}
+}
+
+/* the admin and metrics ports only listen on the loopback interface, as they answer to anyone who connects */
+
+static bool open_loopback(unsigned short port, const char *name, SOCKET *result)
+{
+	SOCKADDR_IN local;
+
+	local.sin_family = AF_INET;
+	local.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	local.sin_port = htons(port);
+
+	*result = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+
+#if defined(_MSC_VER) || defined(__MINGW32__)
+	if (INVALID_SOCKET == *result)
+#else
+	if (*result <= 0)
+#endif
+		return false;
+
+	if (bind(*result, (LPSOCKADDR)&local, sizeof(local)))
+	{
+		fprintf(stderr, "ERROR: unable to bind() %s port %u; the socket may already be in use or is in timeout\n", name, port);
+		return false;
+	}
+
+	return (0 == listen(*result, SOMAXCONN));
+}
+
+static void add_admin_client(SOCKET listener, bool http, struct server_context_type *ctx)
+{
+	struct admin_client_struct *client;
+	SOCKET client_socket;
+
+	client_socket = accept(listener, NULL, NULL);
+
+#if defined(_MSC_VER) || defined(__MINGW32__)
+	if (INVALID_SOCKET == client_socket) return;
+#else
+	if (client_socket <= 0) return;
+
+	if (client_socket >= FD_SETSIZE)
+	{
+		close(client_socket);
+		ctx->connections_refused++;
+		return;
+	}
+#endif
+
+	set_nonblocking(client_socket);
+
+	client = (struct admin_client_struct *)calloc(1, sizeof(struct admin_client_struct));
+	assert(client);
+	client->socket = client_socket;
+	client->http = http;
+	client->next = ctx->admin_list_base;
+	ctx->admin_list_base = client;
+}
+
+/* read and act upon commands from admin clients, write out their responses, and close those that are finished with */
+
+static void service_admin_clients(fd_set *reads, fd_set *writes, struct server_context_type *ctx)
+{
+	struct admin_client_struct *client, **link;
+	int outcome;
+
+	for (client = ctx->admin_list_base; client; client = client->next)
+	{
+		if (FD_ISSET(client->socket, reads))
+		{
+			if (client->input_length + 1024 > client->input_max)
+			{
+				client->input_max = (client->input_max <= 0) ? 4096 : (client->input_max << 1);
+				client->input = realloc(client->input, client->input_max);
+				assert(client->input);
+			}
+
+			outcome = recv(client->socket, client->input + client->input_length, client->input_max - client->input_length - 1, 0);
+
+			if (outcome > 0)
+			{
+				client->input_length += outcome;
+				client->input[client->input_length] = '\0';
+
+				/* a metrics client sends a single request, answered once its headers are complete */
+				if (client->http)
+				{
+					if ( !client->closed && (strstr(client->input, "\r\n\r\n") || strstr(client->input, "\n\n")) )
+						http_request(client, ctx);
+				}
+				else
+					admin_input(client, ctx);
+
+				/* nobody needs a command this long */
+				if (client->input_length > 65536) client->closed = true;
+			}
+#if defined(_MSC_VER) || defined(__MINGW32__)
+			else if ( (outcome < 0) && (WSAEWOULDBLOCK == WSAGetLastError()) )
+#else
+			else if ( (outcome < 0) && ((EAGAIN == errno) || (EWOULDBLOCK == errno)) )
+#endif
+				;
+			else
+			{
+				/* the client has gone, so there is no one to send anything still pending to */
+				client->closed = true;
+				client->output_offset = client->output_length = 0;
+			}
+		}
+
+#if !defined(_MSC_VER) && !defined(__MINGW32__)
+		if (client->query)
+			collect_history(client, ctx);
+#endif
+
+		if ( (client->output_length > client->output_offset) && FD_ISSET(client->socket, writes) )
+		{
+			outcome = send(client->socket, client->output + client->output_offset, client->output_length - client->output_offset, MSG_NOSIGNAL);
+
+			if (outcome > 0)
+			{
+				client->output_offset += outcome;
+				if (client->output_offset == client->output_length)
+					client->output_offset = client->output_length = 0;
+			}
+#if defined(_MSC_VER) || defined(__MINGW32__)
+			else if (WSAEWOULDBLOCK != WSAGetLastError())
+#else
+			else if ( (EAGAIN != errno) && (EWOULDBLOCK != errno) )
+#endif
+			{
+				client->closed = true;
+				client->output_offset = client->output_length = 0;
+			}
+		}
+	}
+
+	for (link = &ctx->admin_list_base; (client = *link); )
+	{
+		if (client->closed && (0 == client->output_length))
+		{
+#if defined(_MSC_VER) || defined(__MINGW32__)
+			closesocket(client->socket);
+#else
+			close(client->socket);
+			if (client->query)
+			{
+				abandon_history(client->query);
+				ctx->history_queries--;
+			}
+#endif
+			*link = client->next;
+			free(client->input);
+			free(client->output);
+			free(client);
+		}
+		else
+		{
+			link = &client->next;
+		}
+	}
+}
+
+/* act upon each complete line of input, holding back those that arrive while a history query is being answered */
+
+static void admin_input(struct admin_client_struct *client, struct server_context_type *ctx)
+{
+	char *line, *end;
+
+	for (line = client->input; !client->query && (end = strchr(line, '\n')); line = end + 1)
+	{
+		*end = '\0';
+		if ( (end > line) && ('\r' == end[-1]) ) end[-1] = '\0';
+		admin_command(client, line, ctx);
+	}
+
+	/* the terminator moves too, as held back lines are searched again once the query is answered */
+	client->input_length -= (int)(line - client->input);
+	memmove(client->input, line, client->input_length + 1);
+}
+
+/*
+commands, one per line; each response ends with a line starting "OK" or "ERROR"
+  history <uid> [<from> [<to>]]  the journalled events of a uid, one per line, between two CoT times
+  quit
+*/
+
+static void admin_command(struct admin_client_struct *client, char *line, struct server_context_type *ctx)
+{
+	static const char *bad_time = "ERROR times are like 2021-10-02T12:00:00Z\n";
+	static const char *no_journal = "ERROR there is no journal\n";
+	static const char *no_thread = "ERROR unable to start the query\n";
+	static const char *usage = "ERROR commands are: history <uid> [<from> [<to>]], quit\n";
+	char *argument[4];
+	int count;
+	int64_t from, to;
+
+	for (count = 0; count < 4; count++)
+	{
+		argument[count] = strtok(count ? NULL : line, " \t");
+		if (NULL == argument[count]) break;
+	}
+
+	if (0 == count) return;
+
+	if (!strcmp(argument[0], "quit"))
+	{
+		admin_output(client, "OK\n", 3);
+		client->closed = true;
+	}
+	else if ( !strcmp(argument[0], "history") && (count >= 2) )
+	{
+		from = (count > 2) ? parse_cot_time(argument[2], (int)strlen(argument[2])) : 0;
+		to = (count > 3) ? parse_cot_time(argument[3], (int)strlen(argument[3])) : 0;
+
+		if ( ((count > 2) && (0 == from)) || ((count > 3) && (0 == to)) )
+			admin_output(client, bad_time, (int)strlen(bad_time));
+		else if (NULL == ctx->journal)
+			admin_output(client, no_journal, (int)strlen(no_journal));
+		else
+		{
+#if !defined(_MSC_VER) && !defined(__MINGW32__)
+			/* the rows, then the count, are passed on by collect_history() */
+			if (start_history(client, ctx->journal->directory, argument[1], from, to))
+				ctx->history_queries++;
+			else
+#endif
+				admin_output(client, no_thread, (int)strlen(no_thread));
+		}
+	}
+	else
+	{
+		admin_output(client, usage, (int)strlen(usage));
+	}
+}
+
+/* queue a response, which goes out as the client can take it */
+
+static void admin_output(struct admin_client_struct *client, const char *data, int length)
+{
+	if (client->output_length + length > client->output_max)
+	{
+		while (client->output_length + length > client->output_max)
+			client->output_max = (client->output_max <= 0) ? buffer_chunk_size : (client->output_max << 1);
+		client->output = realloc(client->output, client->output_max);
+		assert(client->output);
+	}
+
+	memcpy(client->output + client->output_length, data, length);
+	client->output_length += length;
+}
+
+#if !defined(_MSC_VER) && !defined(__MINGW32__)
+
+/* start a thread to find the journalled events of a uid for an admin client */
+
+static bool start_history(struct admin_client_struct *client, const char *directory, const char *uid, int64_t from, int64_t to)
+{
+	struct history_query_type *query;
+	pthread_attr_t attributes;
+	pthread_t thread;
+	bool started;
+
+	query = (struct history_query_type *)calloc(1, sizeof(struct history_query_type));
+	assert(query);
+	query->directory = strdup(directory);
+	query->uid = strdup(uid);
+	assert(query->directory && query->uid);
+	query->from = from;
+	query->to = to;
+	pthread_mutex_init(&query->lock, NULL);
+	pthread_cond_init(&query->taken, NULL);
+
+	/* nobody waits for the thread; it, or the main loop, frees the query */
+	pthread_attr_init(&attributes);
+	pthread_attr_setdetachstate(&attributes, PTHREAD_CREATE_DETACHED);
+	started = (0 == pthread_create(&thread, &attributes, history_thread, query));
+	pthread_attr_destroy(&attributes);
+
+	if (started)
+		client->query = query;
+	else
+		free_history(query);
+
+	return started;
+}
+
+/* pass on to the client the rows found since last time and, once the query is finished, the count */
+
+static void collect_history(struct admin_client_struct *client, struct server_context_type *ctx)
+{
+	struct history_query_type *query;
+	char response[64];
+	bool done;
+
+	query = client->query;
+	pthread_mutex_lock(&query->lock);
+
+	/* rows are only taken as the client takes them, so a slow client holds up its own query rather than filling memory */
+	if ( query->output_length && ((client->output_length - client->output_offset) < history_buffer_size) )
+	{
+		admin_output(client, query->output, query->output_length);
+		query->output_length = 0;
+		pthread_cond_signal(&query->taken);
+	}
+
+	done = query->done && (0 == query->output_length);
+	pthread_mutex_unlock(&query->lock);
+
+	if (done)
+	{
+		sprintf(response, "OK %lu events\n", query->count);
+		admin_output(client, response, (int)strlen(response));
+
+		free_history(query);
+		client->query = NULL;
+		ctx->history_queries--;
+
+		/* commands that arrived while the query ran */
+		admin_input(client, ctx);
+	}
+}
+
+/* give up on a query whose client has gone; if its thread is still running, it frees the query when it finishes */
+
+static void abandon_history(struct history_query_type *query)
+{
+	bool done;
+
+	pthread_mutex_lock(&query->lock);
+	done = query->done;
+	query->abandoned = true;
+	pthread_cond_signal(&query->taken);
+	pthread_mutex_unlock(&query->lock);
+
+	if (done)
+		free_history(query);
+}
+
+static void free_history(struct history_query_type *query)
+{
+	pthread_mutex_destroy(&query->lock);
+	pthread_cond_destroy(&query->taken);
+	free(query->output);
+	free(query->directory);
+	free(query->uid);
+	free(query);
+}
+
+static void *history_thread(void *argument)
+{
+	struct history_query_type *query;
+	unsigned long count;
+	bool abandoned;
+
+	query = (struct history_query_type *)argument;
+	count = journal_history(query->directory, query->uid, (int)strlen(query->uid), query->from, query->to, history_emit, query);
+
+	pthread_mutex_lock(&query->lock);
+	query->count = count;
+	query->done = true;
+	abandoned = query->abandoned;
+	pthread_mutex_unlock(&query->lock);
+
+	if (abandoned)
+		free_history(query);
+
+	return NULL;
+}
+
+/* add a row to the query's output, waiting while the main loop has yet to take enough of what is already there */
+
+static void history_emit(void *context, const char *event, int length)
+{
+	struct history_query_type *query;
+
+	query = (struct history_query_type *)context;
+	pthread_mutex_lock(&query->lock);
+
+	while ( !query->abandoned && (query->output_length >= history_buffer_size) )
+		pthread_cond_wait(&query->taken, &query->lock);
+
+	if (!query->abandoned)
+	{
+		if (query->output_length + length + 1 > query->output_max)
+		{
+			while (query->output_length + length + 1 > query->output_max)
+				query->output_max = (query->output_max <= 0) ? buffer_chunk_size : (query->output_max << 1);
+			query->output = realloc(query->output, query->output_max);
+			assert(query->output);
+		}
+
+		memcpy(query->output + query->output_length, event, length);
+		query->output[query->output_length + length] = '\n';
+		query->output_length += length + 1;
+	}
+
+	pthread_mutex_unlock(&query->lock);
+}
+
+#endif
+
+/*
+the metrics port answers a single HTTP GET of /metrics (or /) in the Prometheus text format, then closes the connection
+the response is put together at once and written out as the client takes it, like any admin response
+*/
+
+static void http_request(struct admin_client_struct *client, struct server_context_type *ctx)
+{
+	static const char *not_found = "HTTP/1.0 404 Not Found\r\nContent-Type: text/plain\r\nContent-Length: 10\r\nConnection: close\r\n\r\nnot found\n";
+	char header[160];
+	int header_length, body_start, body_length;
+
+	client->closed = true;
+
+	if ( strncmp(client->input, "GET /metrics ", 13) && strncmp(client->input, "GET / ", 6) && strncmp(client->input, "GET /metrics?", 13) )
+	{
+		admin_output(client, not_found, (int)strlen(not_found));
+		return;
+	}
+
+	/* the body is written first, so that its length is known, and then moved up to make room for the header */
+	body_start = client->output_length;
+	write_metrics(client, ctx);
+	body_length = client->output_length - body_start;
+
+	header_length = sprintf(header, "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %d\r\nConnection: close\r\n\r\n", body_length);
+	admin_output(client, header, header_length);
+	memmove(client->output + body_start + header_length, client->output + body_start, body_length);
+	memcpy(client->output + body_start, header, header_length);
+}
+
+/* the server's counters and gauges, then the counters of each participant labelled with its port and identity */
+
+static void write_metrics(struct admin_client_struct *client, struct server_context_type *ctx)
+{
+	static const struct
+	{
+		const char *name, *help;
+		int offset;
+	}
+	counters[] =
+	{
+		{ "bytes_received", "Bytes read from participants.", offsetof(struct traffic_counters_type, bytes_in) },
+		{ "bytes_sent", "Bytes written to participants.", offsetof(struct traffic_counters_type, bytes_out) },
+		{ "events_received", "Complete events framed from participant input.", offsetof(struct traffic_counters_type, events_in) },
+		{ "messages_queued", "Messages fanned out to participants.", offsetof(struct traffic_counters_type, messages_queued) },
+		{ "messages_sent", "Messages completely written to participants.", offsetof(struct traffic_counters_type, messages_out) },
+		{ "messages_shed", "Bulk messages discarded because a participant wasn't keeping up.", offsetof(struct traffic_counters_type, messages_shed) },
+		{ "send_failures", "Failed writes to participants, including messages refused for a full backlog.", offsetof(struct traffic_counters_type, send_failures) },
+	};
+	struct traffic_counters_type total;
+	struct latency_histogram_type latency;
+	struct participant_list_struct *participant;
+	struct listener_list_struct *listener;
+	char line[1024], port[16], socket_number[24];
+	int index, length, queued, lane;
+	uint64_t pending;
+
+	total = ctx->departed;
+	pending = 0;
+	for (participant = ctx->participant_list_base; participant; participant = participant->next)
+	{
+		add_counters(&total, &participant->counters);
+		pending += participant->out_pending;
+	}
+
+	for (index = 0; index < (int)(sizeof(counters) / sizeof(counters[0])); index++)
+	{
+		length = sprintf(line, "# HELP taktick_%s_total %s\n# TYPE taktick_%s_total counter\ntaktick_%s_total %llu\n", counters[index].name, counters[index].help,
+			counters[index].name, counters[index].name, (unsigned long long)*(const uint64_t *)((const char *)&total + counters[index].offset));
+		admin_output(client, line, length);
+	}
+
+	length = sprintf(line, "# HELP taktick_accepts_total Connections accepted, by port.\n# TYPE taktick_accepts_total counter\n");
+	admin_output(client, line, length);
+	for (listener = ctx->listener_list_base; listener; listener = listener->next)
+	{
+		length = sprintf(line, "taktick_accepts_total{port=\"%u\"} %llu\n", listener->port, (unsigned long long)listener->accepts);
+		admin_output(client, line, length);
+	}
+
+	length = sprintf(line,
+		"# HELP taktick_participants Participants currently connected.\n# TYPE taktick_participants gauge\ntaktick_participants %d\n"
+		"# HELP taktick_queued_bytes Bytes queued for participants but not yet written.\n# TYPE taktick_queued_bytes gauge\ntaktick_queued_bytes %llu\n"
+		"# HELP taktick_cached_uids Uids held by the cache for joining participants.\n# TYPE taktick_cached_uids gauge\ntaktick_cached_uids %d\n",
+		ctx->participant_count, (unsigned long long)pending, ctx->state_count);
+	admin_output(client, line, length);
+
+	length = sprintf(line,
+		"# HELP taktick_duplicates_dropped_total Duplicate events dropped.\n# TYPE taktick_duplicates_dropped_total counter\ntaktick_duplicates_dropped_total %lu\n"
+		"# HELP taktick_events_directed_total Events delivered directly to their marti destinations.\n# TYPE taktick_events_directed_total counter\ntaktick_events_directed_total %lu\n"
+		"# HELP taktick_pings_answered_total Pings answered by the server.\n# TYPE taktick_pings_answered_total counter\ntaktick_pings_answered_total %lu\n"
+		"# HELP taktick_groups_refused_total Group names ignored because the most groups allowed exist, or a name was too long.\n# TYPE taktick_groups_refused_total counter\ntaktick_groups_refused_total %lu\n",
+		ctx->duplicates_dropped, ctx->events_directed, ctx->pings_answered, ctx->groups_refused);
+	admin_output(client, line, length);
+
+	length = sprintf(line,
+		"# HELP taktick_updates_thinned_total Position reports withheld by thinning.\n# TYPE taktick_updates_thinned_total counter\ntaktick_updates_thinned_total %lu\n"
+		"# HELP taktick_updates_rate_limited_total Events withheld by the per-uid rate limit.\n# TYPE taktick_updates_rate_limited_total counter\ntaktick_updates_rate_limited_total %lu\n"
+		"# HELP taktick_zombies_evicted_total Stale connections evicted when their uid reconnected.\n# TYPE taktick_zombies_evicted_total counter\ntaktick_zombies_evicted_total %lu\n"
+		"# HELP taktick_connections_refused_total Connections closed at once because select() couldn't watch their sockets.\n# TYPE taktick_connections_refused_total counter\ntaktick_connections_refused_total %lu\n",
+		ctx->updates_thinned, ctx->updates_rate_limited, ctx->zombies_evicted, ctx->connections_refused);
+	admin_output(client, line, length);
+
+	length = sprintf(line,
+		"# HELP taktick_identity_conflicts_total Claims refused on a uid or callsign held by another connection.\n# TYPE taktick_identity_conflicts_total counter\ntaktick_identity_conflicts_total %lu\n",
+		ctx->identity_conflicts);
+	admin_output(client, line, length);
+
+#if !defined(_MSC_VER) && !defined(__MINGW32__)
+	if (ctx->journal)
+	{
+		length = sprintf(line,
+			"# HELP taktick_journal_events_total Events journalled.\n# TYPE taktick_journal_events_total counter\ntaktick_journal_events_total %lu\n"
+			"# HELP taktick_journal_dropped_total Events left out of the journal because the disk couldn't keep up or they were too large.\n# TYPE taktick_journal_dropped_total counter\ntaktick_journal_dropped_total %lu\n"
+			"# HELP taktick_journal_oversized_total Events left out of the journal because they were too large.\n# TYPE taktick_journal_oversized_total counter\ntaktick_journal_oversized_total %lu\n",
+			__atomic_load_n(&ctx->journal->records, __ATOMIC_RELAXED), __atomic_load_n(&ctx->journal->dropped, __ATOMIC_RELAXED),
+			__atomic_load_n(&ctx->journal->oversized, __ATOMIC_RELAXED));
+		admin_output(client, line, length);
+	}
+
+	if (ctx->logger)
+	{
+		length = sprintf(line,
+			"# HELP taktick_log_records_total Log records written.\n# TYPE taktick_log_records_total counter\ntaktick_log_records_total %lu\n"
+			"# HELP taktick_log_dropped_total Log records discarded because the log thread couldn't keep up.\n# TYPE taktick_log_dropped_total counter\ntaktick_log_dropped_total %lu\n",
+			__atomic_load_n(&ctx->logger->records, __ATOMIC_RELAXED), __atomic_load_n(&ctx->logger->dropped, __ATOMIC_RELAXED));
+		admin_output(client, line, length);
+	}
+#endif
+
+	/* delivery latency over every port, then for each port */
+	memset(&latency, 0, sizeof(latency));
+	for (listener = ctx->listener_list_base; listener; listener = listener->next)
+		merge_latency(&latency, &listener->latency);
+
+	length = sprintf(line,
+		"# HELP taktick_delivery_latency_seconds Time from an event being framed to its last byte being handed to the kernel, per recipient, since the server started.\n"
+		"# TYPE taktick_delivery_latency_seconds summary\n");
+	admin_output(client, line, length);
+	write_latency_metrics(client, "taktick_delivery_latency_seconds", &latency, "");
+	for (listener = ctx->listener_list_base; listener; listener = listener->next)
+	{
+		sprintf(port, "port=\"%u\",", listener->port);
+		write_latency_metrics(client, "taktick_delivery_latency_seconds", &listener->latency, port);
+	}
+
+	length = sprintf(line, "# HELP taktick_delivery_latency_max_seconds Longest delivery latency since the server started.\n# TYPE taktick_delivery_latency_max_seconds gauge\n"
+		"taktick_delivery_latency_max_seconds %.6f\n", latency.max / 1e6);
+	admin_output(client, line, length);
+	for (listener = ctx->listener_list_base; listener; listener = listener->next)
+	{
+		length = sprintf(line, "taktick_delivery_latency_max_seconds{port=\"%u\"} %.6f\n", listener->port, listener->latency.max / 1e6);
+		admin_output(client, line, length);
+	}
+
+	/* how long each pass of the main loop held up every participant, and where the time went */
+	length = sprintf(line,
+		"# HELP taktick_loop_lag_seconds Time each pass of the main loop spent working rather than waiting, since the server started.\n"
+		"# TYPE taktick_loop_lag_seconds summary\n");
+	admin_output(client, line, length);
+	write_latency_metrics(client, "taktick_loop_lag_seconds", &ctx->loop.lag, "");
+
+	length = sprintf(line,
+		"# HELP taktick_loop_lag_max_seconds Longest pass of the main loop since the server started.\n# TYPE taktick_loop_lag_max_seconds gauge\ntaktick_loop_lag_max_seconds %.6f\n"
+		"# HELP taktick_loop_stalls_total Passes of the main loop that took longer than the stall limit.\n# TYPE taktick_loop_stalls_total counter\ntaktick_loop_stalls_total %llu\n"
+		"# HELP taktick_loop_phase_seconds_total Time spent by the main loop in each phase.\n# TYPE taktick_loop_phase_seconds_total counter\n",
+		ctx->loop.lag.max / 1e6, (unsigned long long)ctx->loop.stalls);
+	admin_output(client, line, length);
+	for (index = 0; index < PHASE_COUNT; index++)
+	{
+		length = sprintf(line, "taktick_loop_phase_seconds_total{phase=\"%s\"} %.6f\n", phase_names[index], ctx->loop.totals[index] / 1e6);
+		admin_output(client, line, length);
+	}
+
+	/* each participant is labelled by its socket (which is unique while it is connected), port, and uid and callsign once known */
+	for (index = 0; index <= (int)(sizeof(counters) / sizeof(counters[0])) + 1; index++)
+	{
+		if (index < (int)(sizeof(counters) / sizeof(counters[0])))
+			length = sprintf(line, "# HELP taktick_participant_%s_total %s\n# TYPE taktick_participant_%s_total counter\n",
+				counters[index].name, counters[index].help, counters[index].name);
+		else if (index == (int)(sizeof(counters) / sizeof(counters[0])))
+			length = sprintf(line, "# HELP taktick_participant_queued_bytes Bytes queued for a participant but not yet written.\n# TYPE taktick_participant_queued_bytes gauge\n");
+		else
+			length = sprintf(line, "# HELP taktick_participant_queued_messages Messages queued for a participant but not yet completely written.\n# TYPE taktick_participant_queued_messages gauge\n");
+		admin_output(client, line, length);
+
+		for (participant = ctx->participant_list_base; participant; participant = participant->next)
+		{
+			if (participant->closed) continue;
+
+			if (index < (int)(sizeof(counters) / sizeof(counters[0])))
+				length = sprintf(line, "taktick_participant_%s_total{", counters[index].name);
+			else if (index == (int)(sizeof(counters) / sizeof(counters[0])))
+				length = sprintf(line, "taktick_participant_queued_bytes{");
+			else
+				length = sprintf(line, "taktick_participant_queued_messages{");
+
+			sprintf(socket_number, "%lu", (unsigned long)participant->socket);
+			sprintf(port, "%u", participant->listener->port);
+			length += format_label(line + length, sizeof(line) - length, "participant", socket_number);
+			length += format_label(line + length, sizeof(line) - length, "port", port);
+			if (participant->uid)
+				length += format_label(line + length, sizeof(line) - length, "uid", participant->uid);
+			if (participant->callsign)
+				length += format_label(line + length, sizeof(line) - length, "callsign", participant->callsign);
+			line[length - 1] = '}'; /* replaces the comma following the last label */
+
+			if (index < (int)(sizeof(counters) / sizeof(counters[0])))
+				length += sprintf(line + length, " %llu\n", (unsigned long long)*(const uint64_t *)((const char *)&participant->counters + counters[index].offset));
+			else if (index == (int)(sizeof(counters) / sizeof(counters[0])))
+				length += sprintf(line + length, " %d\n", participant->out_pending);
+			else
+			{
+				for (lane = 0, queued = 0; lane < LANE_COUNT; lane++)
+					queued += participant->lanes[lane].size_count;
+				length += sprintf(line + length, " %d\n", queued);
+			}
+
+			admin_output(client, line, length);
+		}
+	}
+}
+
+static void add_counters(struct traffic_counters_type *total, const struct traffic_counters_type *counters)
+{
+	total->bytes_in += counters->bytes_in;
+	total->bytes_out += counters->bytes_out;
+	total->events_in += counters->events_in;
+	total->messages_queued += counters->messages_queued;
+	total->messages_out += counters->messages_out;
+	total->messages_shed += counters->messages_shed;
+	total->send_failures += counters->send_failures;
+}
+
+/* the quantiles, sum and count of a latency summary named name; labels is empty or a list of name="value" pairs, each followed by a comma */
+
+static void write_latency_metrics(struct admin_client_struct *client, const char *name, const struct latency_histogram_type *histogram, const char *labels)
+{
+	static const char *quantiles[] = { "0.5", "0.99", "0.999" };
+	char line[256];
+	int index, length;
+
+	for (index = 0; index < 3; index++)
+	{
+		length = sprintf(line, "%s{%squantile=\"%s\"} %.6f\n", name, labels, quantiles[index],
+			latency_quantile(histogram, atof(quantiles[index])) / 1e6);
+		admin_output(client, line, length);
+	}
+
+	length = (int)strlen(labels);
+	length = sprintf(line, "%s_sum%s%.*s%s %.6f\n%s_count%s%.*s%s %llu\n",
+		name, length ? "{" : "", length - 1, labels, length ? "}" : "", histogram->sum / 1e6,
+		name, length ? "{" : "", length - 1, labels, length ? "}" : "", (unsigned long long)histogram->count);
+	admin_output(client, line, length);
+}
+
+/* name="value", with the value escaped as Prometheus requires and cut short to fit; returns the length written */
+
+static int format_label(char *output, int size, const char *name, const char *value)
+{
+	int length;
+
+	/* the name and punctuation, and the longest escape, must fit along with the closing brace and the sample value */
+	length = sprintf(output, "%s=\"", name);
+	for (; *value && (length + 2 < size - 64); value++)
+	{
+		if ( ('\\' == *value) || ('"' == *value) )
+			output[length++] = '\\';
+		if ('\n' == *value)
+		{
+			output[length++] = '\\';
+			output[length++] = 'n';
+		}
+		else
+			output[length++] = *value;
+	}
+	output[length++] = '"';
+	output[length++] = ',';
+
+	return length;
+}
+
+#if !defined(_MSC_VER) && !defined(__MINGW32__)
+
+/*
+the journal keeps every event received, for after-action review
+
+events are appended to numbered segment files of (roughly) a fixed size, each written through a window
+mapped into memory; the reactor only copies each event into a ring, and a thread of its own drains
+the ring into the segments, so disk latency never holds up share_data()
+the journal is made durable by a single fsync() every sync_interval milliseconds (a group commit)
+rather than per event; a segment is sealed (header completed, file trimmed) when it fills or on exit
+*/
+
+static struct journal_type *journal_open(const char *directory, int64_t segment_size, int sync_interval, bool compress)
+{
+	struct journal_type *journal;
+	unsigned int first;
+
+	if ( mkdir(directory, 0755) && (EEXIST != errno) )
+	{
+		fprintf(stderr, "ERROR: unable to create journal directory '%s'\n", directory);
+		return NULL;
+	}
+
+	journal = (struct journal_type *)calloc(1, sizeof(struct journal_type));
+	assert(journal);
+	journal->directory = strdup(directory);
+	assert(journal->directory);
+	journal->segment_size = segment_size;
+	journal->sync_interval = sync_interval;
+	journal->page_size = sysconf(_SC_PAGESIZE);
+	journal->fd = -1;
+	if (!journal_sequence_range(directory, &first, &journal->sequence))
+		journal->sequence = 0;
+
+	journal->ring = (char *)malloc(journal_ring_size);
+	assert(journal->ring);
+	pthread_mutex_init(&journal->lock, NULL);
+	pthread_cond_init(&journal->wake, NULL);
+
+#if defined(HAVE_ZLIB)
+	/* segments left by an earlier run are left as they are */
+	journal->sealed_sequence = journal->compressed_sequence = journal->sequence;
+	pthread_mutex_init(&journal->compress_lock, NULL);
+	pthread_cond_init(&journal->compress_wake, NULL);
+#endif
+
+	if (pthread_create(&journal->thread, NULL, journal_thread, journal))
+	{
+		fprintf(stderr, "ERROR: unable to start journal thread\n");
+		if (journal->window) munmap(journal->window, journal->window_length);
+		if (journal->fd >= 0) close(journal->fd);
+		pthread_mutex_destroy(&journal->lock);
+		pthread_cond_destroy(&journal->wake);
+#if defined(HAVE_ZLIB)
+		pthread_mutex_destroy(&journal->compress_lock);
+		pthread_cond_destroy(&journal->compress_wake);
+#endif
+		free(journal->ring);
+		free(journal->directory);
+		free(journal);
+		return NULL;
+	}
+
+#if defined(HAVE_ZLIB)
+	/*
+	the compressor is started only once the journal thread is running, so a failure above has no other thread to stop;
+	segments sealed before it starts are still waiting for it, as it works through everything after compressed_sequence
+	*/
+	journal->compress = compress;
+	if ( compress && pthread_create(&journal->compressor, NULL, journal_compressor, journal) )
+	{
+		fprintf(stderr, "ERROR: unable to start journal compression thread\n");
+		journal->compress = false;
+	}
+#else
+	(void)compress; /* without zlib, segments stay as they were written */
+#endif
+
+	return journal;
+}
+
+/* stop the journal thread once it has written everything queued, and seal the last segment */
+
+static void journal_close(struct journal_type *journal)
+{
+	__atomic_store_n(&journal->stopping, true, __ATOMIC_SEQ_CST);
+	journal_wake(journal);
+	pthread_join(journal->thread, NULL);
+	pthread_mutex_destroy(&journal->lock);
+	pthread_cond_destroy(&journal->wake);
+
+#if defined(HAVE_ZLIB)
+	/* the compressor finishes with every segment sealed, including the last */
+	if (journal->compress)
+	{
+		pthread_mutex_lock(&journal->compress_lock);
+		journal->compress_stopping = true;
+		pthread_cond_signal(&journal->compress_wake);
+		pthread_mutex_unlock(&journal->compress_lock);
+		pthread_join(journal->compressor, NULL);
+	}
+	pthread_mutex_destroy(&journal->compress_lock);
+	pthread_cond_destroy(&journal->compress_wake);
+#endif
+
+	printf("journal: %lu events written to %lu segments with %lu group commits, %lu dropped (%lu too large)\n",
+		journal->records, journal->segments, journal->syncs, journal->dropped, journal->oversized);
+
+	free(journal->ring);
+	free(journal->index);
+	free(journal->uids);
+	free(journal->directory);
+	free(journal);
+}
+
+/*
+queue an event for the journal; called only by the reactor
+never blocks: if the journal thread has fallen a whole ring behind, the event is counted as dropped and false returned
+*/
+
+static bool journal_append(struct journal_type *journal, const char *buffer, int length, int64_t time)
+{
+	struct journal_record_type record;
+	uint64_t head, tail;
+	int size;
+	static const char padding[8];
+
+	size = (int)((sizeof(record) + length + 7) & ~7);
+
+	head = journal->head;
+	tail = __atomic_load_n(&journal->tail, __ATOMIC_ACQUIRE);
+
+	/* an event this large would hold up everything behind it, so is never journalled */
+	if (size > journal_ring_size / 4)
+	{
+		if (0 == __atomic_fetch_add(&journal->oversized, 1, __ATOMIC_RELAXED))
+			fprintf(stderr, "WARNING: a %d byte event is too large to journal; such events are counted and left out\n", length);
+		__atomic_add_fetch(&journal->dropped, 1, __ATOMIC_RELAXED);
+		return false;
+	}
+
+	if ((uint64_t)size > journal_ring_size - (head - tail))
+	{
+		__atomic_add_fetch(&journal->dropped, 1, __ATOMIC_RELAXED);
+		return false;
+	}
+
+	record.length = length;
+	record.check = (uint32_t)hash_bytes(buffer, length);
+	record.time = time;
+
+	journal_ring_copy_in(journal, head, &record, sizeof(record));
+	journal_ring_copy_in(journal, head + sizeof(record), buffer, length);
+	journal_ring_copy_in(journal, head + sizeof(record) + length, padding, size - (int)sizeof(record) - length);
+
+	/* publishing head and then checking sleeping pairs with the journal thread doing the reverse, so a wake-up is never missed */
+	__atomic_store_n(&journal->head, head + size, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&journal->sleeping, __ATOMIC_SEQ_CST))
+		journal_wake(journal);
+
+	return true;
+}
+
+static void journal_wake(struct journal_type *journal)
+{
+	pthread_mutex_lock(&journal->lock);
+	pthread_cond_signal(&journal->wake);
+	pthread_mutex_unlock(&journal->lock);
+}
+
+static void journal_ring_copy_in(struct journal_type *journal, uint64_t position, const void *data, int length)
+{
+	int offset, first;
+
+	offset = (int)(position & (journal_ring_size - 1));
+	first = (length < journal_ring_size - offset) ? length : (journal_ring_size - offset);
+
+	memcpy(journal->ring + offset, data, first);
+	memcpy(journal->ring, (const char *)data + first, length - first);
+}
+
+static void journal_ring_copy_out(struct journal_type *journal, uint64_t position, void *data, int length)
+{
+	int offset, first;
+
+	offset = (int)(position & (journal_ring_size - 1));
+	first = (length < journal_ring_size - offset) ? length : (journal_ring_size - offset);
+
+	memcpy(data, journal->ring + offset, first);
+	memcpy((char *)data + first, journal->ring, length - first);
+}
+
+/*
+drain the ring into the current segment, committing at each sync interval, until asked to stop
+with the ring empty the thread sleeps until the reactor queues something, or the next commit is due
+*/
+
+static void *journal_thread(void *argument)
+{
+	struct journal_type *journal;
+	struct journal_record_type record;
+	struct timespec deadline;
+	uint64_t head, tail;
+	int64_t now, wait;
+	bool stopping;
+	int size;
+
+	journal = (struct journal_type *)argument;
+	journal->last_sync = now_us();
+	flight_register("journal");
+
+	for (;;)
+	{
+		/* read the flag first, so that nothing queued before it was raised can be missed */
+		stopping = __atomic_load_n(&journal->stopping, __ATOMIC_ACQUIRE);
+		head = __atomic_load_n(&journal->head, __ATOMIC_ACQUIRE);
+		tail = journal->tail;
+
+		while (tail != head)
+		{
+			journal_ring_copy_out(journal, tail, &record, sizeof(record));
+			size = (int)((sizeof(record) + record.length + 7) & ~7);
+
+			if (!journal_write(journal, tail, size, record.time))
+				__atomic_add_fetch(&journal->dropped, 1, __ATOMIC_RELAXED);
+
+			tail += size;
+			__atomic_store_n(&journal->tail, tail, __ATOMIC_RELEASE);
+		}
+
+		now = now_us();
+		if ( (journal->offset > journal->synced_offset) && ((now - journal->last_sync) >= (int64_t)journal->sync_interval * 1000) )
+		{
+			journal_sync(journal);
+			flight_record(FLIGHT_SYNC, journal->fd, (int)(now_us() - now));
+		}
+
+		if (stopping) break;
+
+		/* the condition is rechecked after sleeping is raised, as journal_append() checks sleeping after moving head */
+		pthread_mutex_lock(&journal->lock);
+		__atomic_store_n(&journal->sleeping, true, __ATOMIC_SEQ_CST);
+
+		if ( (__atomic_load_n(&journal->head, __ATOMIC_SEQ_CST) == tail) && !__atomic_load_n(&journal->stopping, __ATOMIC_SEQ_CST) )
+		{
+			if (journal->offset > journal->synced_offset)
+			{
+				/* condition variables time out by the wall clock */
+				wait = (int64_t)journal->sync_interval * 1000 - (now_us() - journal->last_sync);
+				if (wait < 0) wait = 0;
+				clock_gettime(CLOCK_REALTIME, &deadline);
+				wait += (int64_t)deadline.tv_nsec / 1000;
+				deadline.tv_sec += (time_t)(wait / 1000000);
+				deadline.tv_nsec = (long)(wait % 1000000) * 1000;
+				pthread_cond_timedwait(&journal->wake, &journal->lock, &deadline);
+			}
+			else
+				pthread_cond_wait(&journal->wake, &journal->lock);
+		}
+
+		__atomic_store_n(&journal->sleeping, false, __ATOMIC_RELAXED);
+		pthread_mutex_unlock(&journal->lock);
+	}
+
+	if (journal->fd >= 0)
+		journal_seal_segment(journal);
+
+	return NULL;
+}
+
+/* copy one record from the ring into the current segment, starting a new segment or moving the window as needed */
+
+static bool journal_write(struct journal_type *journal, uint64_t position, int size, int64_t time)
+{
+	struct event_header_type header;
+
+	if ( (journal->fd < 0) || (journal->offset + size > journal->file_size) )
+	{
+		if (journal->fd >= 0)
+			journal_seal_segment(journal);
+		if (!journal_start_segment(journal, size))
+			return false;
+	}
+
+	if ( (NULL == journal->window) || (journal->offset + size > journal->window_offset + journal->window_length) )
+	{
+		if (!journal_map_window(journal, size))
+			return false;
+	}
+
+	journal_ring_copy_out(journal, position, journal->window + (journal->offset - journal->window_offset), size);
+
+	if (journal->offset >= journal->next_index_offset)
+	{
+		if (journal->index_count >= journal->index_max)
+		{
+			journal->index_max = (journal->index_max <= 0) ? 1024 : (journal->index_max << 1);
+			journal->index = realloc(journal->index, journal->index_max * sizeof(struct journal_index_entry_type));
+			assert(journal->index);
+		}
+		journal->index[journal->index_count].time = time;
+		journal->index[journal->index_count].offset = journal->offset;
+		journal->index_count++;
+		journal->next_index_offset = journal->offset + journal_index_interval;
+	}
+
+	/* the uid is noted now, while the record is at hand, for the index written when the segment is sealed */
+	if (extract_event_header(journal->window + (journal->offset - journal->window_offset) + sizeof(struct journal_record_type),
+		size - (int)sizeof(struct journal_record_type), &header) && header.uid_length)
+	{
+		if (journal->uid_count >= journal->uid_max)
+		{
+			journal->uid_max = (journal->uid_max <= 0) ? 4096 : (journal->uid_max << 1);
+			journal->uids = realloc(journal->uids, journal->uid_max * sizeof(struct journal_uid_record_type));
+			assert(journal->uids);
+		}
+		journal->uids[journal->uid_count].hash = hash_bytes(header.uid, header.uid_length);
+		journal->uids[journal->uid_count].time = time;
+		journal->uids[journal->uid_count].offset = journal->offset;
+		journal->uid_count++;
+	}
+
+	if (0 == journal->first_time) journal->first_time = time;
+	journal->last_time = time;
+	journal->offset += size;
+
+	__atomic_add_fetch(&journal->records, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&journal->bytes, size, __ATOMIC_RELAXED);
+
+	return true;
+}
+
+/* create the next segment file, preallocated so that writing through the window never has to extend it */
+
+static bool journal_start_segment(struct journal_type *journal, int size)
+{
+	struct journal_segment_header_type header;
+	char path[1024];
+	bool allocated;
+
+	journal->sequence++;
+	journal_file_path(journal->directory, journal->sequence, "journal", path, sizeof(path));
+
+	journal->fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (journal->fd < 0)
+	{
+		fprintf(stderr, "ERROR: unable to create journal segment '%s'\n", path);
+		return false;
+	}
+
+	journal->file_size = journal->segment_size;
+	if (journal->file_size < (int64_t)sizeof(header) + size)
+		journal->file_size = (int64_t)sizeof(header) + size;
+
+	/* where the blocks can't be reserved up front, a sparse file will have to do */
+	allocated = false;
+#if defined(__linux__)
+	allocated = (0 == posix_fallocate(journal->fd, 0, journal->file_size));
+#endif
+	if (!allocated)
+		allocated = (0 == ftruncate(journal->fd, journal->file_size));
+
+	if (!allocated)
+	{
+		fprintf(stderr, "ERROR: unable to allocate journal segment '%s'\n", path);
+		close(journal->fd);
+		journal->fd = -1;
+		return false;
+	}
+
+	/* the header is completed when the segment is sealed; until then readers go by the records alone */
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, journal_magic, sizeof(header.magic));
+	header.version = journal_version;
+	if (pwrite(journal->fd, &header, sizeof(header), 0) != (ssize_t)sizeof(header))
+	{
+		close(journal->fd);
+		journal->fd = -1;
+		return false;
+	}
+
+	journal->offset = journal->synced_offset = journal->next_index_offset = sizeof(header);
+	journal->first_time = journal->last_time = 0;
+	journal->index_count = 0;
+	journal->uid_count = 0;
+
+	return true;
+}
+
+/* map the part of the segment starting at the current offset, at least size bytes of it */
+
+static bool journal_map_window(struct journal_type *journal, int size)
+{
+	if (journal->window)
+	{
+		msync(journal->window, journal->window_length, MS_ASYNC);
+		munmap(journal->window, journal->window_length);
+		journal->window = NULL;
+	}
+
+	journal->window_offset = journal->offset & ~(int64_t)(journal->page_size - 1);
+	journal->window_length = journal_window_size;
+	if (journal->offset - journal->window_offset + size > journal->window_length)
+		journal->window_length = (journal->offset - journal->window_offset + size + journal->page_size - 1) & ~(int64_t)(journal->page_size - 1);
+	if (journal->window_offset + journal->window_length > journal->file_size)
+		journal->window_length = journal->file_size - journal->window_offset;
+
+	journal->window = (char *)mmap(NULL, journal->window_length, PROT_READ | PROT_WRITE, MAP_SHARED, journal->fd, journal->window_offset);
+	if (MAP_FAILED == (void *)journal->window)
+	{
+		fprintf(stderr, "ERROR: unable to map journal segment %u\n", journal->sequence);
+		journal->window = NULL;
+		return false;
+	}
+
+	return true;
+}
+
+/* the group commit: everything written so far reaches the disk with a single flush */
+
+static void journal_sync(struct journal_type *journal)
+{
+	if (journal->window)
+		msync(journal->window, journal->window_length, MS_SYNC);
+	fsync(journal->fd);
+
+	journal->synced_offset = journal->offset;
+	journal->last_sync = now_us();
+	__atomic_add_fetch(&journal->syncs, 1, __ATOMIC_RELAXED);
+}
+
+/* complete the header of the current segment, replace the unused preallocation with the time index, and close it */
+
+static void journal_seal_segment(struct journal_type *journal)
+{
+	struct journal_segment_header_type header;
+	size_t index_size;
+
+	if (journal->window)
+	{
+		munmap(journal->window, journal->window_length);
+		journal->window = NULL;
+	}
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, journal_magic, sizeof(header.magic));
+	header.version = journal_version;
+	header.first_time = journal->first_time;
+	header.last_time = journal->last_time;
+	header.length = journal->offset - sizeof(header);
+
+	index_size = journal->index_count * sizeof(struct journal_index_entry_type);
+
+	if ( (pwrite(journal->fd, journal->index, index_size, journal->offset) != (ssize_t)index_size) || ftruncate(journal->fd, journal->offset + index_size) ||
+		(pwrite(journal->fd, &header, sizeof(header), 0) != (ssize_t)sizeof(header)) || fsync(journal->fd) )
+		fprintf(stderr, "ERROR: unable to seal journal segment %u\n", journal->sequence);
+
+	close(journal->fd);
+	journal->fd = -1;
+	journal->synced_offset = journal->offset;
+	__atomic_add_fetch(&journal->segments, 1, __ATOMIC_RELAXED);
+
+	journal_write_uid_index(journal);
+
+#if defined(HAVE_ZLIB)
+	pthread_mutex_lock(&journal->compress_lock);
+	journal->sealed_sequence = journal->sequence;
+	pthread_cond_signal(&journal->compress_wake);
+	pthread_mutex_unlock(&journal->compress_lock);
+#endif
+}
+
+static int compare_uid_records(const void *a, const void *b)
+{
+	const struct journal_uid_record_type *first, *second;
+
+	first = (const struct journal_uid_record_type *)a;
+	second = (const struct journal_uid_record_type *)b;
+
+	if (first->hash != second->hash) return (first->hash < second->hash) ? -1 : 1;
+	if (first->time != second->time) return (first->time < second->time) ? -1 : 1;
+	if (first->offset != second->offset) return (first->offset < second->offset) ? -1 : 1;
+	return 0;
+}
+
+/* write the uid index of the segment just sealed; it appears under its final name only once complete */
+
+static void journal_write_uid_index(struct journal_type *journal)
+{
+	struct journal_uid_index_header_type header;
+	struct journal_uid_type uid;
+	struct journal_index_entry_type entry;
+	char path[1024], final_path[1024];
+	FILE *file;
+	int index, first;
+	bool failed;
+
+	qsort(journal->uids, journal->uid_count, sizeof(struct journal_uid_record_type), compare_uid_records);
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, uid_index_magic, sizeof(header.magic));
+	header.version = journal_version;
+	header.entry_count = journal->uid_count;
+	for (index = 0; index < journal->uid_count; index++)
+	{
+		if ( (0 == index) || (journal->uids[index].hash != journal->uids[index - 1].hash) )
+			header.uid_count++;
+	}
+
+	journal_file_path(journal->directory, journal->sequence, "uids.tmp", path, sizeof(path));
+	journal_file_path(journal->directory, journal->sequence, "uids", final_path, sizeof(final_path));
+
+	file = fopen(path, "wb");
+	if (NULL == file)
+	{
+		fprintf(stderr, "ERROR: unable to create journal uid index '%s'\n", path);
+		return;
+	}
+
+	failed = (1 != fwrite(&header, sizeof(header), 1, file));
+
+	for (index = first = 0; index < journal->uid_count; index++)
+	{
+		if ( (index + 1 < journal->uid_count) && (journal->uids[index + 1].hash == journal->uids[index].hash) ) continue;
+
+		uid.hash = journal->uids[index].hash;
+		uid.first = first;
+		uid.count = index + 1 - first;
+		failed |= (1 != fwrite(&uid, sizeof(uid), 1, file));
+		first = index + 1;
+	}
+
+	for (index = 0; index < journal->uid_count; index++)
+	{
+		entry.time = journal->uids[index].time;
+		entry.offset = journal->uids[index].offset;
+		failed |= (1 != fwrite(&entry, sizeof(entry), 1, file));
+	}
+
+	failed |= (0 != fflush(file)) || (0 != fsync(fileno(file)));
+	failed |= (0 != fclose(file));
+
+	if (failed || rename(path, final_path))
+	{
+		fprintf(stderr, "ERROR: unable to write journal uid index '%s'\n", final_path);
+		unlink(path);
+	}
+}
+
+/* segments are named by sequence number, so that they sort in the order written; files that accompany a segment differ only in extension */
+
+static void journal_file_path(const char *directory, unsigned int sequence, const char *extension, char *path, int size)
+{
+	snprintf(path, size, "%s/%08u.%s", directory, sequence, extension);
+}
+
+/* the lowest and highest sequence numbers of the segments in a directory; false if there are none */
+
+static bool journal_sequence_range(const char *directory, unsigned int *first, unsigned int *last)
+{
+	DIR *dir;
+	struct dirent *entry;
+	unsigned int sequence;
+	char *end;
+	bool found;
+
+	found = false;
+	dir = opendir(directory);
+	if (NULL == dir) return false;
+
+	while ((entry = readdir(dir)))
+	{
+		sequence = (unsigned int)strtoul(entry->d_name, &end, 10);
+		if ( (end == entry->d_name) || strcmp(end, ".journal") ) continue;
+
+		if (!found || (sequence < *first)) *first = sequence;
+		if (!found || (sequence > *last)) *last = sequence;
+		found = true;
+	}
+
+	closedir(dir);
+
+	return found;
+}
+
+/* map a segment for reading; false if it is missing or isn't a journal segment */
+
+static bool journal_reader_open(struct journal_reader_type *reader, const char *directory, unsigned int sequence)
+{
+	struct stat status;
+	char path[1024];
+
+	memset(reader, 0, sizeof(struct journal_reader_type));
+	journal_file_path(directory, sequence, "journal", path, sizeof(path));
+
+	reader->fd = open(path, O_RDONLY);
+	if (reader->fd < 0) return false;
+
+	if ( fstat(reader->fd, &status) || (status.st_size < (off_t)sizeof(struct journal_segment_header_type)) )
+	{
+		close(reader->fd);
+		return false;
+	}
+
+	reader->map_length = status.st_size;
+	reader->map = (char *)mmap(NULL, reader->map_length, PROT_READ, MAP_PRIVATE, reader->fd, 0);
+	if (MAP_FAILED == (void *)reader->map)
+	{
+		close(reader->fd);
+		return false;
+	}
+
+	memcpy(&reader->header, reader->map, sizeof(struct journal_segment_header_type));
+	if ( memcmp(reader->header.magic, journal_magic, sizeof(reader->header.magic)) || (reader->header.version != (uint32_t)journal_version) )
+	{
+		fprintf(stderr, "ERROR: '%s' is not a journal segment\n", path);
+		journal_reader_close(reader);
+		return false;
+	}
+
+	madvise(reader->map, reader->map_length, MADV_SEQUENTIAL);
+
+	reader->position = sizeof(struct journal_segment_header_type);
+	reader->end = reader->map_length;
+
+	reader->block = -1;
+
+	if (reader->header.flags & JOURNAL_COMPRESSED)
+	{
+#if defined(HAVE_ZLIB)
+		struct journal_trailer_type trailer;
+
+		if (reader->map_length >= (int64_t)(sizeof(struct journal_segment_header_type) + sizeof(trailer)))
+		{
+			memcpy(&trailer, reader->map + reader->map_length - sizeof(trailer), sizeof(trailer));
+			if ( (trailer.index_offset >= sizeof(struct journal_segment_header_type)) &&
+				(trailer.index_offset + trailer.block_count * sizeof(struct journal_block_type) + sizeof(trailer) == (uint64_t)reader->map_length) )
+			{
+				reader->blocks = (const struct journal_block_type *)(reader->map + trailer.index_offset);
+				reader->block_count = (int)trailer.block_count;
+				reader->end = sizeof(struct journal_segment_header_type) + reader->header.length;
+				return true;
+			}
+		}
+		fprintf(stderr, "ERROR: compressed journal segment '%s' is damaged\n", path);
+#else
+		fprintf(stderr, "ERROR: journal segment '%s' is compressed, but TAKtick was built without zlib\n", path);
+#endif
+		journal_reader_close(reader);
+		return false;
+	}
+
+	/* a sealed segment says where its records end and its index begins */
+	if ( reader->header.length && ((int64_t)(sizeof(struct journal_segment_header_type) + reader->header.length) <= reader->map_length) )
+	{
+		reader->end = sizeof(struct journal_segment_header_type) + reader->header.length;
+		reader->index = (const struct journal_index_entry_type *)(reader->map + reader->end);
+		reader->index_count = (int)((reader->map_length - reader->end) / sizeof(struct journal_index_entry_type));
+	}
+
+	return true;
+}
+
+/* the next record of a segment; false at the end (or, for a segment that was never sealed, at the first damaged record) */
+
+static bool journal_reader_next(struct journal_reader_type *reader, const char **event, int *length, int64_t *time)
+{
+	struct journal_record_type record;
+	const char *data;
+
+	data = journal_reader_locate(reader, &record);
+
+	if ( (NULL == data) || ((0 == reader->header.length) && (record.check != (uint32_t)hash_bytes(data + sizeof(record), record.length))) )
+	{
+		reader->position = reader->end;
+		return false;
+	}
+
+	*event = data + sizeof(record);
+	*length = (int)record.length;
+	*time = record.time;
+	reader->position += (sizeof(record) + record.length + 7) & ~7;
+
+	return true;
+}
+
+/* the record at the reader's position (decompressing its block if need be), or NULL if there isn't a whole one */
+
+static const char *journal_reader_locate(struct journal_reader_type *reader, struct journal_record_type *record)
+{
+	const char *data;
+	int64_t available;
+
+	if (reader->position + (int64_t)sizeof(struct journal_record_type) > reader->end) return NULL;
+
+#if defined(HAVE_ZLIB)
+	if (reader->blocks)
+	{
+		if (!journal_reader_load_block(reader)) return NULL;
+		data = reader->block_data + (reader->position - reader->blocks[reader->block].record_offset);
+		available = reader->blocks[reader->block].record_offset + reader->blocks[reader->block].length - reader->position;
+	}
+	else
+#endif
+	{
+		data = reader->map + reader->position;
+		available = reader->end - reader->position;
+	}
+
+	if (available < (int64_t)sizeof(struct journal_record_type)) return NULL;
+
+	memcpy(record, data, sizeof(struct journal_record_type));
+	if ( (0 == record->length) || ((int64_t)sizeof(struct journal_record_type) + record->length > available) ) return NULL;
+
+	return data;
+}
+
+/* position a segment at its first record received at or after the given time, starting from the nearest index entry */
+
+static void journal_reader_seek(struct journal_reader_type *reader, int64_t time)
+{
+	struct journal_record_type record;
+	int low, high, middle;
+
+	reader->position = sizeof(struct journal_segment_header_type);
+
+	/* a compressed segment is indexed by the first time in each block instead */
+	if (reader->block_count)
+	{
+		low = 0;
+		high = reader->block_count - 1;
+		if (reader->blocks[0].first_time >= time) high = -1;
+		while (low < high)
+		{
+			middle = (low + high + 1) / 2;
+			if (reader->blocks[middle].first_time < time)
+				low = middle;
+			else
+				high = middle - 1;
+		}
+		if (high >= 0)
+			reader->position = (int64_t)reader->blocks[low].record_offset;
+	}
+
+	if (reader->index_count)
+	{
+		low = 0;
+		high = reader->index_count - 1;
+		if (reader->index[0].time >= time) high = -1;
+		while (low < high)
+		{
+			middle = (low + high + 1) / 2;
+			if (reader->index[middle].time < time)
+				low = middle;
+			else
+				high = middle - 1;
+		}
+		if (high >= 0)
+			reader->position = (int64_t)reader->index[low].offset;
+	}
+
+	while (journal_reader_locate(reader, &record) && (record.time < time))
+		reader->position += (sizeof(record) + record.length + 7) & ~7;
+}
+
+/* the record at a given offset, e.g. from an index */
+
+static bool journal_reader_at(struct journal_reader_type *reader, int64_t offset, const char **event, int *length, int64_t *time)
+{
+	if ( (offset < (int64_t)sizeof(struct journal_segment_header_type)) || (offset >= reader->end) ) return false;
+
+	reader->position = offset;
+
+	return journal_reader_next(reader, event, length, time);
+}
+
+static void journal_reader_close(struct journal_reader_type *reader)
+{
+	free(reader->block_data);
+	reader->block_data = NULL;
+	munmap(reader->map, reader->map_length);
+	close(reader->fd);
+	reader->map = NULL;
+	reader->fd = -1;
+}
+
+#if defined(HAVE_ZLIB)
+
+/* compress each segment as it is sealed */
+
+static void *journal_compressor(void *argument)
+{
+	struct journal_type *journal;
+	unsigned int sequence;
+
+	journal = (struct journal_type *)argument;
+
+	pthread_mutex_lock(&journal->compress_lock);
+
+	for (;;)
+	{
+		while ( (journal->compressed_sequence == journal->sealed_sequence) && !journal->compress_stopping )
+			pthread_cond_wait(&journal->compress_wake, &journal->compress_lock);
+
+		if (journal->compressed_sequence == journal->sealed_sequence) break;
+
+		sequence = journal->compressed_sequence + 1;
+		pthread_mutex_unlock(&journal->compress_lock);
+
+		journal_compress_segment(journal->directory, sequence);
+
+		pthread_mutex_lock(&journal->compress_lock);
+		journal->compressed_sequence = sequence;
+	}
+
+	pthread_mutex_unlock(&journal->compress_lock);
+
+	return NULL;
+}
+
+/*
+rewrite a sealed segment as blocks of whole records, compressed one by one; the compressed copy replaces
+the original only once complete, so readers always find one or the other
+*/
+
+static bool journal_compress_segment(const char *directory, unsigned int sequence)
+{
+	struct journal_reader_type reader;
+	struct journal_segment_header_type header;
+	struct journal_trailer_type trailer;
+	struct journal_block_type *blocks;
+	int block_count, block_max, length;
+	int64_t start, previous, time;
+	uint64_t file_offset;
+	const char *event;
+	char *compressed, path[1024], final_path[1024];
+	uLongf compressed_length, compressed_max;
+	FILE *file;
+	bool failed;
+
+	if (!journal_reader_open(&reader, directory, sequence)) return false;
+	if ( (0 == reader.header.length) || (reader.header.flags & JOURNAL_COMPRESSED) )
+	{
+		journal_reader_close(&reader);
+		return false;
+	}
+
+	journal_file_path(directory, sequence, "journal.tmp", path, sizeof(path));
+	journal_file_path(directory, sequence, "journal", final_path, sizeof(final_path));
+
+	file = fopen(path, "wb");
+	if (NULL == file)
+	{
+		fprintf(stderr, "ERROR: unable to create '%s'\n", path);
+		journal_reader_close(&reader);
+		return false;
+	}
+
+	header = reader.header;
+	header.flags |= JOURNAL_COMPRESSED;
+	failed = (1 != fwrite(&header, sizeof(header), 1, file));
+	file_offset = sizeof(header);
+
+	blocks = NULL;
+	block_count = block_max = 0;
+	compressed_max = compressBound(journal_block_size);
+	compressed = (char *)malloc(compressed_max);
+	assert(compressed);
+
+	while (!failed && (reader.position < reader.end))
+	{
+		/* gather whole records up to the block size; a record larger than that makes a block by itself */
+		start = previous = reader.position;
+		if (!journal_reader_next(&reader, &event, &length, &time)) break;
+
+		if (block_count >= block_max)
+		{
+			block_max = (block_max <= 0) ? 256 : (block_max << 1);
+			blocks = realloc(blocks, block_max * sizeof(struct journal_block_type));
+			assert(blocks);
+		}
+		blocks[block_count].first_time = time;
+		blocks[block_count].record_offset = start;
+
+		do
+		{
+			previous = reader.position;
+		} while ( journal_reader_next(&reader, &event, &length, &time) && (reader.position - start <= journal_block_size) );
+
+		if (reader.position - start > journal_block_size) reader.position = previous;
+
+		compressed_length = compressBound(reader.position - start);
+		if (compressed_length > compressed_max)
+		{
+			compressed_max = compressed_length;
+			compressed = realloc(compressed, compressed_max);
+			assert(compressed);
+		}
+
+		if (Z_OK != compress2((Bytef *)compressed, &compressed_length, (const Bytef *)(reader.map + start), (uLong)(reader.position - start), Z_DEFAULT_COMPRESSION))
+		{
+			failed = true;
+			break;
+		}
+
+		blocks[block_count].file_offset = file_offset;
+		blocks[block_count].compressed_length = (uint32_t)compressed_length;
+		blocks[block_count].length = (uint32_t)(reader.position - start);
+		block_count++;
+
+		failed |= (1 != fwrite(compressed, compressed_length, 1, file));
+		file_offset += compressed_length;
+	}
+
+	trailer.index_offset = file_offset;
+	trailer.block_count = block_count;
+	if (block_count)
+		failed |= ((size_t)block_count != fwrite(blocks, sizeof(struct journal_block_type), block_count, file));
+	failed |= (1 != fwrite(&trailer, sizeof(trailer), 1, file));
+	failed |= (0 != fflush(file)) || (0 != fsync(fileno(file)));
+	failed |= (0 != fclose(file));
+
+	/* every record must have been read, or the compressed copy would be missing some */
+	failed |= (reader.position != reader.end);
+
+	journal_reader_close(&reader);
+	free(compressed);
+	free(blocks);
+
+	if (failed || rename(path, final_path))
+	{
+		fprintf(stderr, "ERROR: unable to compress journal segment '%s'\n", final_path);
+		unlink(path);
+		return false;
+	}
+
+	return true;
+}
+
+/* make sure the block holding the reader's position is the one decompressed */
+
+static bool journal_reader_load_block(struct journal_reader_type *reader)
+{
+	const struct journal_block_type *block;
+	uLongf length;
+	int low, high, middle;
+
+	if (reader->block >= 0)
+	{
+		block = &reader->blocks[reader->block];
+		if ( (reader->position >= (int64_t)block->record_offset) && (reader->position < (int64_t)(block->record_offset + block->length)) )
+			return true;
+	}
+
+	/* the last block starting at or before the position */
+	low = 0;
+	high = reader->block_count - 1;
+	while (low < high)
+	{
+		middle = (low + high + 1) / 2;
+		if ((int64_t)reader->blocks[middle].record_offset <= reader->position)
+			low = middle;
+		else
+			high = middle - 1;
+	}
+
+	reader->block = -1;
+	if (high < 0) return false;
+	block = &reader->blocks[low];
+
+	if ( (reader->position < (int64_t)block->record_offset) || (reader->position >= (int64_t)(block->record_offset + block->length)) ||
+		((int64_t)(block->file_offset + block->compressed_length) > reader->map_length) )
+		return false;
+
+	if ((int)block->length > reader->block_max)
+	{
+		reader->block_max = block->length;
+		reader->block_data = realloc(reader->block_data, reader->block_max);
+		assert(reader->block_data);
+	}
+
+	length = block->length;
+	if ( (Z_OK != uncompress((Bytef *)reader->block_data, &length, (const Bytef *)(reader->map + block->file_offset), block->compressed_length)) ||
+		(length != block->length) )
+		return false;
+
+	reader->block = low;
+
+	return true;
+}
+
+/* "TAKtick bench compression [directory]": compress whatever segments (e.g. from "bench journal") aren't already, then read them all back */
+
+static int bench_compression(int argc, char *argv[])
+{
+	struct journal_reader_type reader;
+	const char *directory, *event;
+	unsigned int sequence, first, last;
+	unsigned long events;
+	uint64_t compressed_bytes, raw_bytes, stored_bytes;
+	int64_t started, compress_time, read_time, time;
+	int length;
+	bool uncompressed;
+
+	directory = (argc > 0) ? argv[0] : "bench-journal";
+
+	if (!journal_sequence_range(directory, &first, &last))
+	{
+		fprintf(stderr, "ERROR: no journal segments in '%s'; try \"TAKtick bench journal\" first\n", directory);
+		return -1;
+	}
+
+	compressed_bytes = 0;
+	started = now_us();
+	for (sequence = first; sequence <= last; sequence++)
+	{
+		if (!journal_reader_open(&reader, directory, sequence)) continue;
+		uncompressed = (reader.header.length && !(reader.header.flags & JOURNAL_COMPRESSED));
+		if (uncompressed) compressed_bytes += reader.header.length;
+		journal_reader_close(&reader);
+
+		if (uncompressed) journal_compress_segment(directory, sequence);
+	}
+	compress_time = now_us() - started;
+
+	events = 0;
+	raw_bytes = stored_bytes = 0;
+	started = now_us();
+	for (sequence = first; sequence <= last; sequence++)
+	{
+		if (!journal_reader_open(&reader, directory, sequence)) continue;
+		if (reader.blocks)
+		{
+			raw_bytes += reader.header.length;
+			stored_bytes += reader.map_length;
+			while (journal_reader_next(&reader, &event, &length, &time))
+				events++;
+		}
+		journal_reader_close(&reader);
+	}
+	read_time = now_us() - started;
+
+	if (0 == stored_bytes)
+	{
+		fprintf(stderr, "ERROR: no sealed journal segments in '%s'\n", directory);
+		return -1;
+	}
+	if (compress_time <= 0) compress_time = 1;
+	if (read_time <= 0) read_time = 1;
+
+	if (compressed_bytes)
+		printf("compression: %.1f MB of records compressed at %.1f MB/s\n", compressed_bytes / 1048576.0, compressed_bytes / 1048576.0 * 1000000.0 / compress_time);
+	printf("compression: %.1f MB of records stored in %.1f MB, a ratio of %.1f:1; read back at %.1f MB/s (%.0f events/s)\n",
+		raw_bytes / 1048576.0, stored_bytes / 1048576.0, (double)raw_bytes / stored_bytes,
+		raw_bytes / 1048576.0 * 1000000.0 / read_time, events * 1000000.0 / read_time);
+
+	return 0;
+}
+
+#endif
+
+/*
+pass every journalled event for a uid received between two times (inclusive; 0 for no limit) to emit(), in order
+sealed segments outside the times are passed over, and where a segment has a uid index only that uid's records are read;
+otherwise (a segment still being written, or one never sealed) the segment is read from the first record at or after 'from'
+*/
+
+static unsigned long journal_history(const char *directory, const char *uid, int uid_length, int64_t from, int64_t to,
+	void (*emit)(void *context, const char *event, int length), void *context)
+{
+	struct journal_reader_type reader;
+	struct journal_uid_index_header_type header;
+	const struct journal_uid_type *uids;
+	const struct journal_index_entry_type *entries;
+	struct event_header_type event_header;
+	struct stat status;
+	unsigned int sequence, first, last;
+	unsigned long count;
+	uint64_t hash;
+	int64_t time, map_length;
+	const char *event;
+	char *map, path[1024];
+	int length, low, high, middle, entry, entry_count, fd;
+
+	if (0 == to) to = INT64_MAX;
+	count = 0;
+	hash = hash_bytes(uid, uid_length);
+
+	if (!journal_sequence_range(directory, &first, &last)) return 0;
+
+	for (sequence = first; sequence <= last; sequence++)
+	{
+		if (!journal_reader_open(&reader, directory, sequence)) continue;
+
+		if ( reader.header.length && ((reader.header.last_time < from) || (reader.header.first_time > to)) )
+		{
+			journal_reader_close(&reader);
+			continue;
+		}
+
+		/* the uid index, if the segment has one that makes sense */
+		map = NULL;
+		map_length = 0;
+		journal_file_path(directory, sequence, "uids", path, sizeof(path));
+		fd = reader.header.length ? open(path, O_RDONLY) : -1;
+		if ( (fd >= 0) && !fstat(fd, &status) && (status.st_size >= (off_t)sizeof(header)) )
+		{
+			map_length = status.st_size;
+			map = (char *)mmap(NULL, map_length, PROT_READ, MAP_PRIVATE, fd, 0);
+			if (MAP_FAILED == (void *)map) map = NULL;
+		}
+		if (fd >= 0) close(fd);
+
+		if (map)
+		{
+			memcpy(&header, map, sizeof(header));
+			if ( memcmp(header.magic, uid_index_magic, sizeof(header.magic)) || (header.version != (uint32_t)journal_version) ||
+				((int64_t)(sizeof(header) + header.uid_count * sizeof(struct journal_uid_type) + header.entry_count * sizeof(struct journal_index_entry_type)) != map_length) )
+			{
+				munmap(map, map_length);
+				map = NULL;
+			}
+		}
+
+		if (map)
+		{
+			uids = (const struct journal_uid_type *)(map + sizeof(header));
+			entries = (const struct journal_index_entry_type *)(uids + header.uid_count);
+
+			/* binary search for the uid, then for the first of its entries at or after 'from' */
+			low = 0;
+			high = (int)header.uid_count - 1;
+			while (low < high)
+			{
+				middle = (low + high) / 2;
+				if (uids[middle].hash < hash)
+					low = middle + 1;
+				else
+					high = middle;
+			}
+
+			if ( (high >= 0) && (uids[low].hash == hash) && ((uint64_t)uids[low].first + uids[low].count <= header.entry_count) )
+			{
+				entries += uids[low].first;
+				entry_count = (int)uids[low].count;
+
+				low = 0;
+				high = entry_count;
+				while (low < high)
+				{
+					middle = (low + high) / 2;
+					if (entries[middle].time < from)
+						low = middle + 1;
+					else
+						high = middle;
+				}
+
+				for (entry = low; (entry < entry_count) && (entries[entry].time <= to); entry++)
+				{
+					if ( journal_reader_at(&reader, (int64_t)entries[entry].offset, &event, &length, &time) &&
+						extract_event_header(event, length, &event_header) &&
+						(event_header.uid_length == uid_length) && !memcmp(event_header.uid, uid, uid_length) )
+					{
+						emit(context, event, length);
+						count++;
+					}
+				}
+			}
+
+			munmap(map, map_length);
+		}
+		else
+		{
+			journal_reader_seek(&reader, from);
+
+			while (journal_reader_next(&reader, &event, &length, &time) && (time <= to))
+			{
+				if ( extract_event_header(event, length, &event_header) &&
+					(event_header.uid_length == uid_length) && !memcmp(event_header.uid, uid, uid_length) )
+				{
+					emit(context, event, length);
+					count++;
+				}
+			}
+		}
+
+		journal_reader_close(&reader);
+	}
+
+	return count;
+}
+
+/* begin replaying the journal in a directory from the given receive time */
+
+static struct replay_type *replay_open(const char *directory, double speed, int64_t from)
+{
+	struct replay_type *replay;
+
+	replay = (struct replay_type *)calloc(1, sizeof(struct replay_type));
+	assert(replay);
+
+	if (!journal_sequence_range(directory, &replay->sequence, &replay->last_sequence))
+	{
+		fprintf(stderr, "ERROR: no journal segments in '%s'\n", directory);
+		free(replay);
+		return NULL;
+	}
+
+	replay->directory = strdup(directory);
+	assert(replay->directory);
+	replay->speed = speed;
+	replay->from = from;
+
+	return replay;
+}
+
+/* read the next event to replay, moving on through the segments; false once there are no more */
+
+static bool replay_next(struct replay_type *replay)
+{
+	for (;;)
+	{
+		if (replay->reading)
+		{
+			if (journal_reader_next(&replay->reader, &replay->event, &replay->length, &replay->time))
+			{
+				replay->pending = true;
+				return true;
+			}
+
+			journal_reader_close(&replay->reader);
+			replay->reading = false;
+			replay->sequence++;
+		}
+
+		if (replay->sequence > replay->last_sequence)
+			return false;
+
+		if (!journal_reader_open(&replay->reader, replay->directory, replay->sequence))
+		{
+			replay->sequence++;
+			continue;
+		}
+
+		replay->reading = true;
+
+		/* sealed segments wholly before the starting time are passed over without reading them */
+		if (replay->from)
+		{
+			if (replay->reader.header.length && (replay->reader.header.last_time < replay->from))
+			{
+				journal_reader_close(&replay->reader);
+				replay->reading = false;
+				replay->sequence++;
+				continue;
+			}
+
+			journal_reader_seek(&replay->reader, replay->from);
+		}
+	}
+}
+
+/*
+inject every replayed event now due into the normal path, as though received from no particular participant
+returns how long until the next is due, at most limit microseconds
+*/
+
+static int64_t replay_events(struct server_context_type *ctx, int64_t limit)
+{
+	struct replay_type *replay;
+	int64_t now, due;
+	int count;
+
+	replay = ctx->replay;
+	if (replay->finished) return limit;
+
+	now = now_us();
+
+	for (count = 0; count < replay_batch; count++)
+	{
+		if (!replay->pending && !replay_next(replay))
+		{
+			replay->finished = true;
+			replay->finished_at = now_us();
+			report_replay(replay);
+			return limit;
+		}
+
+		if (0 == replay->started)
+		{
+			replay->started = now;
+			replay->base_time = replay->time;
+		}
+
+		if (replay->speed > 0.0)
+		{
+			due = replay->started + (int64_t)((replay->time - replay->base_time) * 1000.0 / replay->speed);
+			if (due > now)
+				return (due - now < limit) ? (due - now) : limit;
+		}
+
+		handle_event(NULL, replay->event, replay->length, ctx);
+
+		replay->pending = false;
+		replay->last_time = replay->time;
+		replay->events++;
+		replay->bytes += replay->length;
+	}
+
+	return 0;
+}
+
+static void report_replay(struct replay_type *replay)
+{
+	int64_t elapsed;
+
+	elapsed = replay->started ? ((replay->finished ? replay->finished_at : now_us()) - replay->started) : 0;
+	if (elapsed <= 0) elapsed = 1;
+
+	printf("replay%s: %lu events (%.1f MB) in %.3f s, %.0f events/s, %.1fx the original pace\n",
+		replay->finished ? " complete" : "", replay->events, replay->bytes / 1048576.0, elapsed / 1000000.0,
+		replay->events * 1000000.0 / elapsed, (replay->last_time - replay->base_time) * 1000.0 / elapsed);
+}
+
+/* measure how quickly events can be journalled: "TAKtick bench journal [directory] [events]" */
+
+static int bench_journal(int argc, char *argv[])
+{
+	struct journal_type *journal;
+	const char *directory;
+	char *events, *event;
+	int event_count, count, index, length, lengths[1024];
+	int64_t started, elapsed;
+	uint64_t bytes;
+	struct timespec pause;
+
+	directory = (argc > 0) ? argv[0] : "bench-journal";
+	event_count = (argc > 1) ? atoi(argv[1]) : 1000000;
+
+	/* a thousand distinct position reports of typical size, used in turn */
+	events = (char *)malloc(1024 * 512);
+	assert(events);
+	for (index = 0; index < 1024; index++)
+	{
+		event = events + index * 512;
+		lengths[index] = snprintf(event, 512, "<?xml version=\"1.0\" encoding=\"UTF-8\" standalone=\"yes\"?>"
+			"<event version=\"2.0\" uid=\"BENCH-%04d\" type=\"a-f-G-U-C\" how=\"m-g\" time=\"2021-10-02T12:00:%02d.000Z\" start=\"2021-10-02T12:00:%02d.000Z\" stale=\"2021-10-02T12:02:00.000Z\">"
+			"<point lat=\"%.6f\" lon=\"%.6f\" hae=\"0.0\" ce=\"9999999.0\" le=\"9999999.0\"/>"
+			"<detail><contact callsign=\"BENCH-%04d\"/><__group name=\"Cyan\" role=\"Team Member\"/><track course=\"90.0\" speed=\"1.0\"/></detail></event>",
+			index, index % 60, index % 60, 51.0 + index * 0.0001, -1.0 - index * 0.0001, index);
+	}
+
+	/* compression is measured separately, by "bench compression" */
+	journal = journal_open(directory, default_journal_segment_size, default_journal_sync, false);
+	if (NULL == journal) return -1;
+
+	pause.tv_sec = 0;
+	pause.tv_nsec = 10000;
+	bytes = 0;
+	started = now_us();
+
+	for (count = 0; count < event_count; count++)
+	{
+		index = count & 1023;
+		length = lengths[index];
+
+		/* unlike the server, the benchmark waits for room rather than dropping */
+		while (!journal_append(journal, events + index * 512, length, wall_clock_ms()))
+		{
+			__atomic_sub_fetch(&journal->dropped, 1, __ATOMIC_RELAXED);
+			nanosleep(&pause, NULL);
+		}
+
+		bytes += length;
+	}
+
+	journal_close(journal);
+	elapsed = now_us() - started;
+	if (elapsed <= 0) elapsed = 1;
+
+	printf("journal: %d events (%.1f MB) into '%s' in %.3f s: %.0f events/s, %.1f MB/s\n",
+		event_count, bytes / 1048576.0, directory, elapsed / 1000000.0,
+		event_count * 1000000.0 / elapsed, bytes / 1048576.0 * 1000000.0 / elapsed);
+
+	free(events);
+
+	return 0;
+}
+
+/*
+restore the cache from a state file; entries gone stale since are left out
+a missing file is fine (the first run), while a damaged one is reported and ignored
+*/
+
+static bool load_state(const char *path, struct server_context_type *ctx)
+{
+	struct state_file_header_type header;
+	struct state_file_entry_type entry;
+	struct state_entry_type *state;
+	struct event_header_type event_header;
+	struct stat status;
+	const char *pnt, *end, *event, *names, *name, *name_end;
+	char *map;
+	int64_t now;
+	uint32_t count;
+	int fd, group;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) return false;
+
+	if ( fstat(fd, &status) || (status.st_size < (off_t)sizeof(header)) )
+	{
+		close(fd);
+		fprintf(stderr, "ERROR: state file '%s' is damaged; starting with an empty cache\n", path);
+		return false;
+	}
+
+	map = (char *)mmap(NULL, status.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (MAP_FAILED == (void *)map) return false;
+	madvise(map, status.st_size, MADV_SEQUENTIAL);
+
+	memcpy(&header, map, sizeof(header));
+	if ( memcmp(header.magic, state_file_magic, sizeof(header.magic)) || (header.version != (uint32_t)state_file_version) ||
+		(sizeof(header) + header.length != (uint64_t)status.st_size) || (header.checksum != checksum_bytes(map + sizeof(header), header.length)) )
+	{
+		munmap(map, status.st_size);
+		fprintf(stderr, "ERROR: state file '%s' is damaged or of another version; starting with an empty cache\n", path);
+		return false;
+	}
+
+	now = wall_clock_ms();
+	pnt = map + sizeof(header);
+	end = pnt + header.length;
+
+	for (count = 0; (count < header.entry_count) && (pnt + sizeof(entry) <= end); count++)
+	{
+		memcpy(&entry, pnt, sizeof(entry));
+		event = pnt + sizeof(entry);
+		names = event + entry.length;
+		pnt += (sizeof(entry) + entry.length + entry.names_length + 7) & ~7;
+		if (pnt > end) break;
+
+		if ( (entry.stale <= now) || (entry.uid_offset + entry.uid_length > entry.length) || (entry.type_offset + entry.type_length > entry.length) )
+			continue;
+
+		memset(&event_header, 0, sizeof(event_header));
+		event_header.uid = event + entry.uid_offset;
+		event_header.uid_length = entry.uid_length;
+		event_header.type = event + entry.type_offset;
+		event_header.type_length = entry.type_length;
+		event_header.stale = entry.stale;
+		event_header.lat = entry.lat;
+		event_header.lon = entry.lon;
+		event_header.has_point = entry.has_point;
+
+		state = update_state(NULL, event, entry.length, &event_header, ctx);
+		if (NULL == state) continue;
+
+		/* the cached event keeps the groups of its sender, by name; the default group is the one with an empty name */
+		name = names;
+		for (group = 0; (group < entry.group_count) && (group < MAX_PARTICIPANT_GROUPS) && (name <= names + entry.names_length); group++)
+		{
+			name_end = memchr(name, ';', names + entry.names_length - name);
+			if (NULL == name_end) name_end = names + entry.names_length;
+			state->groups[state->group_count++] = find_group(name, (int)(name_end - name), ctx);
+			name = name_end + 1;
+		}
+	}
+
+	munmap(map, status.st_size);
+
+	return true;
+}
+
+/*
+save the cache to the state file, by copying it into an image that is written out by a thread of its own
+(or, on the way out, written out before returning); a save is skipped if the last is still being written
+*/
+
+static void save_state(struct server_context_type *ctx, bool wait)
+{
+	struct state_saver_type *saver;
+	struct state_file_header_type header;
+	struct state_file_entry_type entry;
+	struct state_entry_type *state;
+	int64_t length;
+	char *pnt;
+	int index, group, names_length;
+
+	saver = ctx->state_saver;
+	saver->next_save = now_us() + (int64_t)saver->interval * 1000000;
+
+	if (saver->running)
+	{
+		if ( !wait && !__atomic_load_n(&saver->done, __ATOMIC_ACQUIRE) ) return;
+		pthread_join(saver->thread, NULL);
+		saver->running = false;
+	}
+
+	length = sizeof(header);
+	for (index = 0; index < ctx->state_count; index++)
+	{
+		state = ctx->state_entries[index];
+		names_length = 0;
+		for (group = 0; group < state->group_count; group++)
+			names_length += (int)strlen(state->groups[group]->name) + (group ? 1 : 0);
+		length += (sizeof(entry) + state->length + names_length + 7) & ~7;
+	}
+
+	saver->image = (char *)malloc(length);
+	assert(saver->image);
+	saver->image_length = length;
+	pnt = saver->image + sizeof(header);
+
+	for (index = 0; index < ctx->state_count; index++)
+	{
+		state = ctx->state_entries[index];
+
+		memset(&entry, 0, sizeof(entry));
+		entry.stale = state->stale;
+		entry.lat = state->lat;
+		entry.lon = state->lon;
+		entry.has_point = state->has_point;
+		entry.length = state->length;
+		entry.uid_offset = state->uid_offset;
+		entry.uid_length = state->uid_length;
+		entry.type_offset = state->type_offset;
+		entry.type_length = state->type_length;
+		entry.group_count = (uint8_t)state->group_count;
+		memcpy(pnt + sizeof(entry), state->event, state->length);
+
+		/* with at most MAX_PARTICIPANT_GROUPS names of at most MAX_GROUP_NAME bytes, names_length can't overflow */
+		for (group = 0; group < state->group_count; group++)
+		{
+			if (group) pnt[sizeof(entry) + state->length + entry.names_length++] = ';';
+			memcpy(pnt + sizeof(entry) + state->length + entry.names_length, state->groups[group]->name, strlen(state->groups[group]->name));
+			entry.names_length += (uint16_t)strlen(state->groups[group]->name);
+		}
+
+		memcpy(pnt, &entry, sizeof(entry));
+		memset(pnt + sizeof(entry) + entry.length + entry.names_length, 0, ((sizeof(entry) + entry.length + entry.names_length + 7) & ~7) - (sizeof(entry) + entry.length + entry.names_length));
+		pnt += (sizeof(entry) + entry.length + entry.names_length + 7) & ~7;
+	}
+
+	/* the checksum is left to the writer */
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, state_file_magic, sizeof(header.magic));
+	header.version = state_file_version;
+	header.entry_count = ctx->state_count;
+	header.length = length - sizeof(header);
+	header.written = wall_clock_ms();
+	memcpy(saver->image, &header, sizeof(header));
+
+	saver->done = false;
+
+	if (wait || pthread_create(&saver->thread, NULL, state_writer, saver))
+	{
+		state_writer(saver);
+		return;
+	}
+
+	saver->running = true;
+}
+
+static void *state_writer(void *argument)
+{
+	struct state_saver_type *saver;
+
+	saver = (struct state_saver_type *)argument;
+
+	if (write_state_image(saver->path, saver->image, saver->image_length))
+		saver->saves++;
+	else
+		saver->failures++;
+
+	free(saver->image);
+	saver->image = NULL;
+	__atomic_store_n(&saver->done, true, __ATOMIC_RELEASE);
+
+	return NULL;
+}
+
+/* checksum an image and write it through a mapping of a new file, which then replaces the old state file */
+
+static bool write_state_image(const char *path, char *image, int64_t length)
+{
+	struct state_file_header_type header;
+	char temporary[1024];
+	char *map;
+	int fd;
+	bool failed;
+
+	memcpy(&header, image, sizeof(header));
+	header.checksum = checksum_bytes(image + sizeof(header), header.length);
+	memcpy(image, &header, sizeof(header));
+
+	snprintf(temporary, sizeof(temporary), "%s.tmp", path);
+	fd = open(temporary, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) return false;
+
+	failed = (0 != ftruncate(fd, length));
+	map = failed ? NULL : (char *)mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if ( (NULL == map) || (MAP_FAILED == (void *)map) )
+		failed = true;
+	else
+	{
+		memcpy(map, image, length);
+		failed |= (0 != msync(map, length, MS_SYNC));
+		munmap(map, length);
+	}
+	failed |= (0 != fsync(fd));
+	close(fd);
+
+	if (failed || rename(temporary, path))
+	{
+		fprintf(stderr, "ERROR: unable to write state file '%s'\n", path);
+		unlink(temporary);
+		return false;
+	}
+
+	return true;
+}
+
+/* FNV-1a taken a 64-bit word at a time, which is quick enough to check a state file of many megabytes at startup */
+
+static uint64_t checksum_bytes(const void *data, int64_t length)
+{
+	const unsigned char *pnt;
+	uint64_t sum, word;
+
+	pnt = (const unsigned char *)data;
+	sum = 14695981039346656037ULL;
+
+	for (; length >= 8; length -= 8, pnt += 8)
+	{
+		memcpy(&word, pnt, sizeof(word));
+		sum = (sum ^ word) * 1099511628211ULL;
+	}
+
+	for (; length > 0; length--, pnt++)
+		sum = (sum ^ *pnt) * 1099511628211ULL;
+
+	return sum;
+}
+
+/* "TAKtick bench state [entries]": save and reload a cache of (by default) 100000 uids */
+
+static int bench_state(int argc, char *argv[])
+{
+	struct server_context_type ctx, restored;
+	struct event_header_type header;
+	char event[512];
+	int entry_count, index, length;
+	int64_t started, save_time, load_time;
+
+	entry_count = (argc > 0) ? atoi(argv[0]) : 100000;
+
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.state_limit = entry_count;
+
+	/* stale well into the future, so that nothing is left out on loading */
+	for (index = 0; index < entry_count; index++)
+	{
+		length = snprintf(event, sizeof(event), "<?xml version=\"1.0\" encoding=\"UTF-8\" standalone=\"yes\"?>"
+			"<event version=\"2.0\" uid=\"BENCH-%06d\" type=\"a-f-G-U-C\" how=\"m-g\" time=\"2021-10-02T12:00:00.000Z\" start=\"2021-10-02T12:00:00.000Z\" stale=\"2099-01-01T00:00:00.000Z\">"
+			"<point lat=\"%.6f\" lon=\"%.6f\" hae=\"0.0\" ce=\"9999999.0\" le=\"9999999.0\"/>"
+			"<detail><contact callsign=\"BENCH-%06d\"/><__group name=\"Cyan\" role=\"Team Member\"/></detail></event>",
+			index, -60.0 + (index % 1200) * 0.1, -180.0 + (index / 1200) * 0.1, index);
+		extract_event_header(event, length, &header);
+		update_state(NULL, event, length, &header, &ctx);
+	}
+
+	ctx.state_saver = (struct state_saver_type *)calloc(1, sizeof(struct state_saver_type));
+	assert(ctx.state_saver);
+	ctx.state_saver->path = "bench-state";
+	ctx.state_saver->interval = default_state_interval;
+
+	started = now_us();
+	save_state(&ctx, true);
+	save_time = now_us() - started;
+
+	memset(&restored, 0, sizeof(restored));
+	restored.state_limit = entry_count;
+
+	started = now_us();
+	load_state("bench-state", &restored);
+	load_time = now_us() - started;
+
+	printf("state: saved %d entries in %.1f ms, loaded %d in %.1f ms\n", ctx.state_count, save_time / 1000.0, restored.state_count, load_time / 1000.0);
+
+	return (restored.state_count == ctx.state_count) ? 0 : -1;
+}
+
+static void print_event(void *context, const char *event, int length)
+{
+	fwrite(event, 1, length, (FILE *)context);
+	fputc('\n', (FILE *)context);
+}
+
+/* take segments in turn and format each into a temporary file, for the main thread to copy out */
+
+static void *export_thread(void *argument)
+{
+	struct export_type *export;
+	struct export_segment_type segment;
+	unsigned int sequence;
+
+	export = (struct export_type *)argument;
+
+	pthread_mutex_lock(&export->lock);
+
+	for (;;)
+	{
+		while ( (export->next <= export->last) && (export->next - export->written >= (unsigned int)export->ahead) )
+			pthread_cond_wait(&export->wake, &export->lock);
+		if (export->next > export->last) break;
+		sequence = export->next++;
+		pthread_mutex_unlock(&export->lock);
+
+		memset(&segment, 0, sizeof(segment));
+		segment.output = tmpfile();
+		if (segment.output)
+			segment.count = export_segment(export, sequence, segment.output);
+		else
+			fprintf(stderr, "ERROR: can't create a temporary file for the export\n");
+		segment.done = true;
+
+		pthread_mutex_lock(&export->lock);
+		export->segments[sequence - export->first] = segment;
+		pthread_cond_broadcast(&export->wake);
+	}
+
+	pthread_mutex_unlock(&export->lock);
+
+	return NULL;
+}
+
+/* format the located events of one segment received within the export's times; returns how many */
+
+static unsigned long export_segment(struct export_type *export, unsigned int sequence, FILE *output)
+{
+	struct journal_reader_type reader;
+	struct event_header_type header;
+	const char *event, *element, *element_end, *callsign;
+	char *line, *pnt;
+	unsigned long count;
+	int64_t time;
+	int length, callsign_length, line_max;
+
+	count = 0;
+
+	if (!journal_reader_open(&reader, export->directory, sequence)) return 0;
+
+	if ( reader.header.length && ((reader.header.last_time < export->from) || (reader.header.first_time > export->to)) )
+	{
+		journal_reader_close(&reader);
+		return 0;
+	}
+
+	if (export->from) journal_reader_seek(&reader, export->from);
+
+	/* each line is put together here and written at once; escaping makes a value at most six times longer */
+	line_max = 0;
+	line = NULL;
+
+	while (journal_reader_next(&reader, &event, &length, &time) && (time <= export->to))
+	{
+		if ( !extract_event_header(event, length, &header) || !header.has_point ) continue;
+
+		callsign = NULL;
+		callsign_length = 0;
+		if ((element = find_element(event, event + length, "contact", &element_end)))
+			callsign = find_attribute(element, element_end, "callsign", &callsign_length);
+
+		if (line_max < 6 * length + 1024)
+		{
+			line_max = 6 * length + 1024;
+			line = (char *)realloc(line, line_max);
+			assert(line);
+		}
+		pnt = line;
+
+		switch (export->format)
+		{
+		case EXPORT_GEOJSON:
+			pnt = export_literal(pnt, "{\"type\":\"Feature\",\"geometry\":{\"type\":\"Point\",\"coordinates\":[");
+			pnt = export_number(pnt, header.lon, 7);
+			*pnt++ = ',';
+			pnt = export_number(pnt, header.lat, 7);
+			pnt = export_literal(pnt, "]},\"properties\":{\"uid\":");
+			pnt = export_text(pnt, header.uid, header.uid_length, export->format);
+			pnt = export_literal(pnt, ",\"type\":");
+			pnt = export_text(pnt, header.type, header.type_length, export->format);
+			if (callsign)
+			{
+				pnt = export_literal(pnt, ",\"callsign\":");
+				pnt = export_text(pnt, callsign, callsign_length, export->format);
+			}
+			pnt = export_literal(pnt, ",\"time\":\"");
+			format_cot_time(header.time ? header.time : time, pnt);
+			pnt = export_literal(pnt + 24, "\",\"received\":\"");
+			format_cot_time(time, pnt);
+			pnt += 24;
+			*pnt++ = '"';
+			if (header.has_track)
+			{
+				pnt = export_literal(pnt, ",\"course\":");
+				pnt = export_number(pnt, header.course, 1);
+				pnt = export_literal(pnt, ",\"speed\":");
+				pnt = export_number(pnt, header.speed, 2);
+			}
+			pnt = export_literal(pnt, "}}\n");
+			break;
+
+		case EXPORT_KML:
+			pnt = export_literal(pnt, "<Placemark><name>");
+			if (callsign)
+				pnt = export_text(pnt, callsign, callsign_length, export->format);
+			else
+				pnt = export_text(pnt, header.uid, header.uid_length, export->format);
+			pnt = export_literal(pnt, "</name><TimeStamp><when>");
+			format_cot_time(header.time ? header.time : time, pnt);
+			pnt = export_literal(pnt + 24, "</when></TimeStamp><ExtendedData><Data name=\"uid\"><value>");
+			pnt = export_text(pnt, header.uid, header.uid_length, export->format);
+			pnt = export_literal(pnt, "</value></Data><Data name=\"type\"><value>");
+			pnt = export_text(pnt, header.type, header.type_length, export->format);
+			pnt = export_literal(pnt, "</value></Data></ExtendedData><Point><coordinates>");
+			pnt = export_number(pnt, header.lon, 7);
+			*pnt++ = ',';
+			pnt = export_number(pnt, header.lat, 7);
+			pnt = export_literal(pnt, "</coordinates></Point></Placemark>\n");
+			break;
+
+		case EXPORT_CSV:
+			format_cot_time(header.time ? header.time : time, pnt);
+			pnt[24] = ',';
+			format_cot_time(time, pnt + 25);
+			pnt[49] = ',';
+			pnt += 50;
+			pnt = export_text(pnt, header.uid, header.uid_length, export->format);
+			*pnt++ = ',';
+			pnt = export_text(pnt, header.type, header.type_length, export->format);
+			*pnt++ = ',';
+			pnt = export_text(pnt, callsign, callsign_length, export->format);
+			*pnt++ = ',';
+			pnt = export_number(pnt, header.lat, 7);
+			*pnt++ = ',';
+			pnt = export_number(pnt, header.lon, 7);
+			*pnt++ = ',';
+			if (header.has_track)
+			{
+				pnt = export_number(pnt, header.course, 1);
+				*pnt++ = ',';
+				pnt = export_number(pnt, header.speed, 2);
+			}
+			else
+				*pnt++ = ',';
+			*pnt++ = '\n';
+			break;
+		}
+
+		fwrite(line, 1, pnt - line, output);
+		count++;
+	}
+
+	free(line);
+	journal_reader_close(&reader);
+
+	return count;
+}
+
+/*
+copy an attribute value as a JSON string, XML text or CSV field, returning the end of what was written; values are
+taken as they appear in the event, so XML entities are already escaped for KML, and are decoded for the others
+decoding never lengthens a value, so escaping what is decoded needs no more room than escaping the value as it was
+*/
+
+static char *export_text(char *output, const char *value, int length, int format)
+{
+	static const char hex[] = "0123456789abcdef";
+	char decoded[4];
+	int index, consumed, count, character;
+
+	switch (format)
+	{
+	case EXPORT_GEOJSON:
+		*output++ = '"';
+		for (index = 0; index < length; index += consumed)
+		{
+			count = xml_character(value + index, length - index, decoded, &consumed);
+
+			for (character = 0; character < count; character++)
+			{
+				if ((unsigned char)decoded[character] < 0x20)
+				{
+					output = export_literal(output, "\\u00");
+					*output++ = hex[(unsigned char)decoded[character] >> 4];
+					*output++ = hex[decoded[character] & 15];
+					continue;
+				}
+				if ( ('"' == decoded[character]) || ('\\' == decoded[character]) )
+					*output++ = '\\';
+				*output++ = decoded[character];
+			}
+		}
+		*output++ = '"';
+		break;
+
+	case EXPORT_KML:
+		memcpy(output, value, length);
+		output += length;
+		break;
+
+	case EXPORT_CSV:
+		/* an entity may stand for a quote or line break, so any value with one is quoted */
+		if ( !memchr(value, ',', length) && !memchr(value, '"', length) && !memchr(value, '\n', length) && !memchr(value, '\r', length) && !memchr(value, '&', length) )
+		{
+			memcpy(output, value, length);
+			output += length;
+			break;
+		}
+		*output++ = '"';
+		for (index = 0; index < length; index += consumed)
+		{
+			count = xml_character(value + index, length - index, decoded, &consumed);
+
+			for (character = 0; character < count; character++)
+			{
+				if ('"' == decoded[character]) *output++ = '"';
+				*output++ = decoded[character];
+			}
+		}
+		*output++ = '"';
+		break;
+	}
+
+	return output;
+}
+
+/*
+decode the character at the start of some XML text: one of the five predefined entities, a character reference
+(written out in UTF-8), or anything else as it is; returns the number of bytes decoded, and sets how many were read
+*/
+
+static int xml_character(const char *text, int length, char *decoded, int *consumed)
+{
+	static const char *names[] = { "amp;", "lt;", "gt;", "quot;", "apos;" };
+	static const char characters[] = "&<>\"'";
+	unsigned long code;
+	const char *end;
+	char *digits_end;
+	int index, name_length;
+
+	*consumed = 1;
+	decoded[0] = text[0];
+
+	if ('&' != text[0]) return 1;
+
+	for (index = 0; index < 5; index++)
+	{
+		name_length = (int)strlen(names[index]);
+		if ( (length > name_length) && !memcmp(text + 1, names[index], name_length) )
+		{
+			*consumed = 1 + name_length;
+			decoded[0] = characters[index];
+			return 1;
+		}
+	}
+
+	/* &#ddd; or &#xhhh; */
+	end = (const char *)memchr(text, ';', (length < 12) ? length : 12);
+	if ( (NULL == end) || (length < 4) || ('#' != text[1]) ) return 1;
+
+	/* strtoul would also take leading spaces and signs, so the first digit is checked here */
+	if ( ('x' == text[2]) || ('X' == text[2]) )
+	{
+		if ( !text[3] || !strchr("0123456789abcdefABCDEF", text[3]) ) return 1;
+		code = strtoul(text + 3, &digits_end, 16);
+	}
+	else
+	{
+		if ( (text[2] < '0') || (text[2] > '9') ) return 1;
+		code = strtoul(text + 2, &digits_end, 10);
+	}
+
+	if ( (digits_end != end) || (0 == code) || (code > 0x10FFFF) || ((code >= 0xD800) && (code <= 0xDFFF)) )
+		return 1;
+
+	*consumed = (int)(end + 1 - text);
+
+	if (code < 0x80)
+	{
+		decoded[0] = (char)code;
+		return 1;
+	}
+	if (code < 0x800)
+	{
+		decoded[0] = (char)(0xC0 | (code >> 6));
+		decoded[1] = (char)(0x80 | (code & 0x3F));
+		return 2;
+	}
+	if (code < 0x10000)
+	{
+		decoded[0] = (char)(0xE0 | (code >> 12));
+		decoded[1] = (char)(0x80 | ((code >> 6) & 0x3F));
+		decoded[2] = (char)(0x80 | (code & 0x3F));
+		return 3;
+	}
+	decoded[0] = (char)(0xF0 | (code >> 18));
+	decoded[1] = (char)(0x80 | ((code >> 12) & 0x3F));
+	decoded[2] = (char)(0x80 | ((code >> 6) & 0x3F));
+	decoded[3] = (char)(0x80 | (code & 0x3F));
+	return 4;
+}
+
+static char *export_literal(char *output, const char *text)
+{
+	size_t length;
+
+	length = strlen(text);
+	memcpy(output, text, length);
+
+	return output + length;
+}
+
+/* a number with a fixed count of decimal places, as sprintf("%.*f") would write it but much more quickly */
+
+static char *export_number(char *output, double value, int decimals)
+{
+	char digits[32];
+	uint64_t scaled;
+	int count, index;
+
+	/* anything out of the ordinary for a coordinate, course or speed is left to sprintf() */
+	if ( !(value > -1e9) || !(value < 1e9) )
+		return output + sprintf(output, "%.*f", decimals, value);
+
+	if (value < 0.0)
+	{
+		/* as with sprintf(), a value that rounds to zero keeps its sign */
+		*output++ = '-';
+		value = -value;
+	}
+
+	for (index = 0, scaled = 1; index < decimals; index++) scaled *= 10;
+	scaled = (uint64_t)(value * (double)scaled + 0.5);
+
+	count = 0;
+	do
+	{
+		digits[count++] = (char)('0' + scaled % 10);
+		scaled /= 10;
+	} while ( (scaled > 0) || (count <= decimals) );
+
+	while (count > 0)
+	{
+		if (count-- == decimals) *output++ = '.';
+		*output++ = digits[count];
+	}
+
+	return output;
+}
+
+#endif
+
+/* "TAKtick history <directory> <uid> [from [to]]" */
+
+static int run_history(int argc, char *argv[])
+{
+#if defined(_MSC_VER) || defined(__MINGW32__)
+	fprintf(stderr, "ERROR: the journal is not supported on this platform\n");
+	return -1;
+#else
+	int64_t from, to;
+
+	from = (argc > 2) ? parse_cot_time(argv[2], (int)strlen(argv[2])) : 0;
+	to = (argc > 3) ? parse_cot_time(argv[3], (int)strlen(argv[3])) : 0;
+
+	if ( (argc < 2) || ((argc > 2) && (0 == from)) || ((argc > 3) && (0 == to)) )
+	{
+		fprintf(stderr, "TAKtick history <journal_directory> <uid> [from [to]], with times like 2021-10-02T12:00:00Z\n");
+		return -1;
+	}
+
+	journal_history(argv[0], argv[1], (int)strlen(argv[1]), from, to, print_event, stdout);
+
+	return 0;
+#endif
+}
+
+/* "TAKtick export <directory> <geojson|kml|csv> [from [to]]" writes the located events of a journal to standard output */
+
+static int run_export(int argc, char *argv[])
+{
+#if defined(_MSC_VER) || defined(__MINGW32__)
+	fprintf(stderr, "ERROR: the journal is not supported on this platform\n");
+	return -1;
+#else
+	struct export_type export;
+	struct export_segment_type *segment;
+	pthread_t *threads;
+	unsigned long total;
+	char *buffer;
+	size_t length;
+	long cpus;
+	int thread_count, started;
+
+	memset(&export, 0, sizeof(export));
+	export.directory = (argc > 0) ? argv[0] : NULL;
+	export.format = -1;
+	if (argc > 1)
+	{
+		if (!strcmp(argv[1], "geojson"))
+			export.format = EXPORT_GEOJSON;
+		else if (!strcmp(argv[1], "kml"))
+			export.format = EXPORT_KML;
+		else if (!strcmp(argv[1], "csv"))
+			export.format = EXPORT_CSV;
+	}
+	export.from = (argc > 2) ? parse_cot_time(argv[2], (int)strlen(argv[2])) : 0;
+	export.to = (argc > 3) ? parse_cot_time(argv[3], (int)strlen(argv[3])) : INT64_MAX;
+
+	if ( (argc < 2) || (export.format < 0) || ((argc > 2) && (0 == export.from)) || ((argc > 3) && (0 == export.to)) )
+	{
+		fprintf(stderr, "TAKtick export <journal_directory> <geojson|kml|csv> [from [to]], with times like 2021-10-02T12:00:00Z\n");
+		return -1;
+	}
+
+	switch (export.format)
+	{
+	case EXPORT_KML:
+		printf("<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n<kml xmlns=\"http://www.opengis.net/kml/2.2\"><Document>\n");
+		break;
+	case EXPORT_CSV:
+		printf("time,received,uid,type,callsign,lat,lon,course,speed\n");
+		break;
+	}
+
+	total = 0;
+
+	if (journal_sequence_range(export.directory, &export.first, &export.last))
+	{
+		/* a thread per processor, each allowed a couple of segments ahead of the output */
+		cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		thread_count = (cpus > 0) ? (int)cpus : 1;
+		if ((unsigned int)thread_count > export.last - export.first + 1) thread_count = (int)(export.last - export.first + 1);
+		export.ahead = 2 * thread_count;
+		export.next = export.written = export.first;
+
+		export.segments = (struct export_segment_type *)calloc(export.last - export.first + 1, sizeof(struct export_segment_type));
+		assert(export.segments);
+		threads = (pthread_t *)malloc(thread_count * sizeof(pthread_t));
+		assert(threads);
+		buffer = (char *)malloc(1048576);
+		assert(buffer);
+		pthread_mutex_init(&export.lock, NULL);
+		pthread_cond_init(&export.wake, NULL);
+
+		for (started = 0; started < thread_count; started++)
+			if (pthread_create(&threads[started], NULL, export_thread, &export)) break;
+
+		pthread_mutex_lock(&export.lock);
+
+		for (; export.written <= export.last; export.written++)
+		{
+			segment = &export.segments[export.written - export.first];
+
+			/* without any threads, the main thread formats each segment itself */
+			if (0 == started)
+			{
+				segment->output = tmpfile();
+				if (segment->output)
+					segment->count = export_segment(&export, export.written, segment->output);
+				segment->done = true;
+			}
+
+			while (!segment->done)
+				pthread_cond_wait(&export.wake, &export.lock);
+
+			pthread_mutex_unlock(&export.lock);
+
+			if (segment->output)
+			{
+				rewind(segment->output);
+				while ((length = fread(buffer, 1, 1048576, segment->output)) > 0)
+					fwrite(buffer, 1, length, stdout);
+				fclose(segment->output);
+				total += segment->count;
+			}
+
+			pthread_mutex_lock(&export.lock);
+			pthread_cond_broadcast(&export.wake);
+		}
+
+		pthread_mutex_unlock(&export.lock);
+
+		while (started > 0)
+			pthread_join(threads[--started], NULL);
+
+		pthread_cond_destroy(&export.wake);
+		pthread_mutex_destroy(&export.lock);
+		free(buffer);
+		free(threads);
+		free(export.segments);
+	}
+
+	if (EXPORT_KML == export.format)
+		printf("</Document></kml>\n");
+
+	fflush(stdout);
+	fprintf(stderr, "%lu events exported\n", total);
+
+	return 0;
+#endif
+}
+
+/* give the calling thread a flight recorder ring; a thread without one records nothing */
+
+static void flight_register(const char *name)
+{
+#if !defined(_MSC_VER) && !defined(__MINGW32__)
+	struct flight_ring_type *ring;
+	int index;
+
+	ring = (struct flight_ring_type *)calloc(1, sizeof(struct flight_ring_type));
+	assert(ring);
+	strncpy(ring->name, name, sizeof(ring->name) - 1);
+
+	index = __atomic_fetch_add(&flight_ring_count, 1, __ATOMIC_ACQ_REL);
+	if (index >= FLIGHT_MAX_THREADS)
+	{
+		free(ring);
+		return;
+	}
+
+	__atomic_store_n(&flight_rings[index], ring, __ATOMIC_RELEASE);
+	flight_ring = ring;
+#else
+	(void)name;
+#endif
+}
+
+/* note a hot-path event in the calling thread's ring, overwriting the oldest */
+
+static void flight_record(int kind, SOCKET fd, int value)
+{
+#if !defined(_MSC_VER) && !defined(__MINGW32__)
+	struct flight_ring_type *ring;
+	struct flight_record_type *record;
+
+	ring = flight_ring;
+	if (NULL == ring) return;
+
+	record = &ring->records[ring->head & (FLIGHT_RING_SIZE - 1)];
+	record->stamp = ((uint64_t)now_us() << 8) | (uint64_t)kind;
+	record->fd = (int32_t)fd;
+	record->value = value;
+	__atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+#else
+	(void)kind;
+	(void)fd;
+	(void)value;
+#endif
+}
+
+#if !defined(_MSC_VER) && !defined(__MINGW32__)
+
+/*
+write every ring to the dump file; only async-signal-safe calls are used, so that this can be called from a signal handler
+other threads go on recording meanwhile, so the newest records of a busy thread may be torn
+*/
+
+static bool flight_dump(void)
+{
+	struct flight_file_header_type header;
+	struct flight_ring_type *ring;
+	struct timespec ts;
+	int fd, index, count;
+	bool written;
+
+	/* the watchdog, a stall and SIGUSR1 may all want a dump at once; only one writes the file */
+	if (__atomic_exchange_n(&flight_dumping, true, __ATOMIC_ACQUIRE)) return false;
+
+	fd = open(flight_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+	{
+		__atomic_store_n(&flight_dumping, false, __ATOMIC_RELEASE);
+		return false;
+	}
+
+	count = __atomic_load_n(&flight_ring_count, __ATOMIC_ACQUIRE);
+	if (count > FLIGHT_MAX_THREADS) count = FLIGHT_MAX_THREADS;
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, flight_magic, sizeof(header.magic));
+	header.version = (uint32_t)flight_version;
+	header.ring_size = FLIGHT_RING_SIZE;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	header.wall_time = (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	header.now = (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+
+	/* a thread may have taken a place in the table without yet putting its ring there */
+	for (index = 0; index < count; index++)
+		if (__atomic_load_n(&flight_rings[index], __ATOMIC_ACQUIRE)) header.ring_count++;
+
+	written = (write(fd, &header, sizeof(header)) == (ssize_t)sizeof(header));
+
+	for (index = 0; written && (index < count); index++)
+	{
+		ring = __atomic_load_n(&flight_rings[index], __ATOMIC_ACQUIRE);
+		if (ring)
+			written = (write(fd, ring, sizeof(struct flight_ring_type)) == (ssize_t)sizeof(struct flight_ring_type));
+	}
+
+	close(fd);
+	__atomic_store_n(&flight_dumping, false, __ATOMIC_RELEASE);
+
+	return written;
+}
+
+static void flight_signal(int unused)
+{
+	int saved;
+
+	(void)unused;
+
+	saved = errno;
+	flight_dump();
+	errno = saved;
+}
+
+#endif
+
+/* charge the time since the last call to the phase being timed, and begin timing another */
+
+static void loop_phase(struct loop_monitor_type *loop, int phase)
+{
+	int64_t now;
+
+	now = now_us();
+	loop->pass[loop->phase] += now - loop->mark;
+	loop->totals[loop->phase] += now - loop->mark;
+
+#if !defined(_MSC_VER) && !defined(__MINGW32__)
+	__atomic_store_n(&loop->phase, phase, __ATOMIC_RELAXED);
+	__atomic_store_n(&loop->mark, now, __ATOMIC_RELEASE);
+#else
+	loop->phase = phase;
+	loop->mark = now;
+#endif
+}
+
+/* a pass that took too long has held up every participant; say where the time went, and dump the flight recorder to show what it was doing */
+
+static void finish_pass(struct loop_monitor_type *loop)
+{
+	int64_t busy;
+	int index;
+
+	busy = 0;
+	for (index = 0; index < PHASE_COUNT; index++)
+		if (PHASE_WAIT != index) busy += loop->pass[index];
+
+	loop->passes++;
+	record_latency(&loop->lag, busy);
+
+	if ( loop->stall_limit && (busy > (int64_t)loop->stall_limit * 1000) )
+	{
+		loop->stalls++;
+		flight_record(FLIGHT_STALL, 0, (int)(busy / 1000));
+
+		fprintf(stderr, "WARNING: a pass of the main loop took %d ms (", (int)(busy / 1000));
+		for (index = 0; index < PHASE_COUNT; index++)
+			if (PHASE_WAIT != index)
+				fprintf(stderr, "%s%s %.1f", (PHASE_PREPARE == index) ? "" : ", ", phase_names[index], loop->pass[index] / 1000.0);
+		fprintf(stderr, " ms)");
+
+#if !defined(_MSC_VER) && !defined(__MINGW32__)
+		if ( (0 == loop->last_dump) || (loop->mark - loop->last_dump >= (int64_t)stall_dump_interval * 1000000) )
+		{
+			loop->last_dump = loop->mark;
+			if (flight_dump())
+				fprintf(stderr, "; flight recorder dumped to '%s'", flight_path);
+			else
+				fprintf(stderr, "; unable to dump the flight recorder to '%s'", flight_path);
+		}
+#endif
+		fprintf(stderr, "\n");
+	}
+
+	memset(loop->pass, 0, sizeof(loop->pass));
+}
+
+#if !defined(_MSC_VER) && !defined(__MINGW32__)
+
+/* report, once, each time the main loop stays in one phase for longer than the watchdog limit */
+
+static void *watchdog_thread(void *argument)
+{
+	struct loop_monitor_type *loop;
+	struct timespec idle;
+	int64_t mark, reported, stuck;
+
+	loop = (struct loop_monitor_type *)argument;
+	flight_register("watchdog");
+	idle.tv_sec = 0;
+	idle.tv_nsec = 100000000;
+	reported = 0;
+
+	while (!__atomic_load_n(&loop->watchdog_stopping, __ATOMIC_ACQUIRE))
+	{
+		nanosleep(&idle, NULL);
+
+		mark = __atomic_load_n(&loop->mark, __ATOMIC_ACQUIRE);
+		stuck = now_us() - mark;
+		if ( (mark == reported) || (stuck < (int64_t)loop->watchdog_limit * 1000000) ) continue;
+
+		reported = mark;
+		flight_record(FLIGHT_HANG, 0, (int)(stuck / 1000));
+		fprintf(stderr, "WARNING: the main loop has been in its %s phase for %d ms; %s '%s'\n",
+			phase_names[__atomic_load_n(&loop->phase, __ATOMIC_RELAXED)], (int)(stuck / 1000),
+			flight_dump() ? "flight recorder dumped to" : "unable to dump the flight recorder to", flight_path);
+	}
+
+	return NULL;
+}
+
+#endif
+
+/* connections, and the identities they claim, are logged for later inspection */
+
+static void log_connect(struct participant_list_struct *participant, struct server_context_type *ctx)
+{
+#if !defined(_MSC_VER) && !defined(__MINGW32__)
+	struct log_record_type *record;
+
+	record = log_reserve(ctx->logger, LOG_CONNECT, participant->socket);
+	if (NULL == record) return;
+
+	record->values[0] = participant->listener->port;
+	record->values[1] = participant->peer.sin_addr.s_addr;
+	record->values[2] = ntohs(participant->peer.sin_port);
+	log_commit(ctx->logger);
+#endif
+}
+
+static void log_identify(struct participant_list_struct *participant, struct server_context_type *ctx)
+{
+#if !defined(_MSC_VER) && !defined(__MINGW32__)
+	struct log_record_type *record;
+
+	record = log_reserve(ctx->logger, LOG_IDENTIFY, participant->socket);
+	if (NULL == record) return;
+
+	log_identity(record->text, sizeof(record->text), participant->uid, participant->callsign);
+	log_commit(ctx->logger);
+#endif
+}
+
+static void log_evict(struct participant_list_struct *zombie, struct participant_list_struct *participant, struct server_context_type *ctx)
+{
+#if !defined(_MSC_VER) && !defined(__MINGW32__)
+	struct log_record_type *record;
+
+	record = log_reserve(ctx->logger, LOG_EVICT, zombie->socket);
+	if (NULL == record) return;
+
+	record->values[0] = (uint64_t)participant->socket;
+	log_identity(record->text, sizeof(record->text), zombie->uid, NULL);
+	log_commit(ctx->logger);
+#endif
+}
+
+static void log_conflict(struct participant_list_struct *participant, struct participant_list_struct *holder, const char *uid, int uid_length, const char *callsign, int callsign_length, struct server_context_type *ctx)
+{
+#if !defined(_MSC_VER) && !defined(__MINGW32__)
+	struct log_record_type *record;
+	char claimed_uid[sizeof(record->text)], claimed_callsign[sizeof(record->text)];
+
+	record = log_reserve(ctx->logger, LOG_CONFLICT, participant->socket);
+	if (NULL == record) return;
+
+	/* the claims point into the event, so are copied out to be terminated */
+	if (uid_length >= (int)sizeof(claimed_uid)) uid_length = sizeof(claimed_uid) - 1;
+	if (uid_length > 0) memcpy(claimed_uid, uid, uid_length);
+	claimed_uid[uid_length] = '\0';
+	if (callsign_length >= (int)sizeof(claimed_callsign)) callsign_length = sizeof(claimed_callsign) - 1;
+	if (callsign_length > 0) memcpy(claimed_callsign, callsign, callsign_length);
+	claimed_callsign[callsign_length] = '\0';
+
+	record->values[0] = (uint64_t)holder->socket;
+	log_identity(record->text, sizeof(record->text), claimed_uid, claimed_callsign);
+	log_commit(ctx->logger);
+#endif
+}
+
+static void log_disconnect(struct participant_list_struct *participant, struct server_context_type *ctx)
+{
+#if !defined(_MSC_VER) && !defined(__MINGW32__)
+	struct log_record_type *record;
+
+	record = log_reserve(ctx->logger, LOG_DISCONNECT, participant->socket);
+	if (NULL == record) return;
+
+	record->values[0] = participant->counters.bytes_in;
+	record->values[1] = participant->counters.bytes_out;
+	record->values[2] = participant->counters.events_in;
+	record->values[3] = (uint64_t)(record->time - participant->connected);
+	log_identity(record->text, sizeof(record->text), participant->uid, participant->callsign);
+	log_commit(ctx->logger);
+#endif
+}
+
+#if !defined(_MSC_VER) && !defined(__MINGW32__)
+
+/* start the log thread, writing to the file at path (appending to it) or to stderr if path is NULL */
+
+static struct logger_type *log_open(const char *path, int64_t rotate_size)
+{
+	struct logger_type *logger;
+	struct stat info;
+
+	logger = (struct logger_type *)calloc(1, sizeof(struct logger_type));
+	assert(logger);
+	logger->rotate_size = rotate_size;
+
+	if (path)
+	{
+		logger->file = fopen(path, "a");
+		if (NULL == logger->file)
+		{
+			fprintf(stderr, "ERROR: unable to open log file '%s'\n", path);
+			free(logger);
+			return NULL;
+		}
+		logger->path = strdup(path);
+		assert(logger->path);
+		if (0 == fstat(fileno(logger->file), &info)) logger->size = info.st_size;
+	}
+	else
+		logger->file = stderr;
+
+	logger->ring = (struct log_record_type *)malloc(log_ring_records * sizeof(struct log_record_type));
+	assert(logger->ring);
+
+	if (pthread_create(&logger->thread, NULL, log_thread, logger))
+	{
+		fprintf(stderr, "ERROR: unable to start log thread\n");
+		if (logger->path) fclose(logger->file);
+		free(logger->path);
+		free(logger->ring);
+		free(logger);
+		return NULL;
+	}
+
+	return logger;
+}
+
+/* stop the log thread once it has written everything queued */
+
+static void log_close(struct logger_type *logger)
+{
+	__atomic_store_n(&logger->stopping, true, __ATOMIC_RELEASE);
+	pthread_join(logger->thread, NULL);
+
+	if (logger->file != stderr) fclose(logger->file);
+	free(logger->path);
+	free(logger->ring);
+	free(logger);
+}
+
+/* the next free record in the ring, stamped and cleared, or NULL (counted as a drop) if the ring is full; never blocks */
+
+static struct log_record_type *log_reserve(struct logger_type *logger, int kind, SOCKET fd)
+{
+	struct log_record_type *record;
+	uint64_t head;
+
+	if (NULL == logger) return NULL;
+
+	head = logger->head;
+	if (head - __atomic_load_n(&logger->tail, __ATOMIC_ACQUIRE) >= (uint64_t)log_ring_records)
+	{
+		__atomic_add_fetch(&logger->dropped, 1, __ATOMIC_RELAXED);
+		return NULL;
+	}
+
+	record = &logger->ring[head & (log_ring_records - 1)];
+	memset(record, 0, sizeof(struct log_record_type));
+	record->time = wall_clock_ms();
+	record->kind = kind;
+	record->fd = (int32_t)fd;
+
+	return record;
+}
+
+/* hand the record from log_reserve() to the log thread */
+
+static void log_commit(struct logger_type *logger)
+{
+	__atomic_store_n(&logger->head, logger->head + 1, __ATOMIC_RELEASE);
+}
+
+/* copy up to two strings (either may be NULL) into a record's text, each followed by a NUL while there is room */
+
+static void log_identity(char *text, int size, const char *uid, const char *callsign)
+{
+	int length;
+
+	length = uid ? (int)strlen(uid) : 0;
+	if (length >= size) length = size - 1;
+	if (length) memcpy(text, uid, length);
+	text[length] = '\0';
+	text += length + 1;
+	size -= length + 1;
+
+	length = callsign ? (int)strlen(callsign) : 0;
+	if (length > size) length = size;
+	if (length) memcpy(text, callsign, length);
+	if (length < size) text[length] = '\0';
+}
+
+/* format each record as a line of key=value pairs, after the time and kind of record */
+
+static void *log_thread(void *argument)
+{
+	static const char *kinds[] = { "?", "connect", "identify", "evict", "disconnect", "conflict" };
+	struct logger_type *logger;
+	struct log_record_type *record;
+	struct timespec idle;
+	uint64_t head, tail;
+	unsigned long dropped, reported;
+	const char *callsign;
+	char line[512], address[INET_ADDRSTRLEN], *output;
+	struct in_addr peer;
+	int length;
+	bool stopping, written;
+
+	logger = (struct logger_type *)argument;
+	idle.tv_sec = 0;
+	idle.tv_nsec = 10000000;
+	reported = 0;
+
+	for (;;)
+	{
+		/* read the flag first, so that nothing queued before it was raised can be missed */
+		stopping = __atomic_load_n(&logger->stopping, __ATOMIC_ACQUIRE);
+		head = __atomic_load_n(&logger->head, __ATOMIC_ACQUIRE);
+		tail = logger->tail;
+		written = (tail != head);
+
+		for (; tail != head; tail++)
+		{
+			record = &logger->ring[tail & (log_ring_records - 1)];
+
+			output = line;
+			format_cot_time(record->time, output);
+			output += 24;
+			output += sprintf(output, " %s fd=%d", kinds[((record->kind >= LOG_CONNECT) && (record->kind <= LOG_CONFLICT)) ? record->kind : 0], (int)record->fd);
+
+			callsign = record->text + strnlen(record->text, sizeof(record->text));
+			callsign = (callsign < record->text + sizeof(record->text) - 1) ? (callsign + 1) : NULL;
+
+			switch (record->kind)
+			{
+			case LOG_CONNECT:
+				peer.s_addr = (uint32_t)record->values[1];
+				inet_ntop(AF_INET, &peer, address, sizeof(address));
+				output += sprintf(output, " port=%u peer=%s:%u", (unsigned int)record->values[0], address, (unsigned int)record->values[2]);
+				break;
+
+			case LOG_EVICT:
+				output += sprintf(output, " replaced_by=%d", (int)record->values[0]);
+				break;
+
+			case LOG_CONFLICT:
+				output += sprintf(output, " held_by=%d", (int)record->values[0]);
+				break;
+
+			case LOG_DISCONNECT:
+				output += sprintf(output, " seconds=%.3f bytes_in=%llu bytes_out=%llu events_in=%llu", record->values[3] / 1000.0,
+					(unsigned long long)record->values[0], (unsigned long long)record->values[1], (unsigned long long)record->values[2]);
+				break;
+			}
+
+			if (record->text[0])
+			{
+				output = strcpy(output, " uid=") + 5;
+				output = log_value(output, record->text, (int)strnlen(record->text, sizeof(record->text)));
+			}
+			if (callsign && *callsign)
+			{
+				output = strcpy(output, " callsign=") + 10;
+				output = log_value(output, callsign, (int)strnlen(callsign, record->text + sizeof(record->text) - callsign));
+			}
+			*output++ = '\n';
+
+			length = (int)(output - line);
+			fwrite(line, 1, length, logger->file);
+			logger->size += length;
+			__atomic_add_fetch(&logger->records, 1, __ATOMIC_RELAXED);
+		}
+
+		/* records dropped since the last report are noted once the ring has room again */
+		dropped = __atomic_load_n(&logger->dropped, __ATOMIC_RELAXED);
+		if (dropped != reported)
+		{
+			output = line;
+			format_cot_time(wall_clock_ms(), output);
+			output += 24;
+			output += sprintf(output, " dropped records=%lu\n", dropped - reported);
+			length = (int)(output - line);
+			fwrite(line, 1, length, logger->file);
+			logger->size += length;
+			reported = dropped;
+			written = true;
+		}
+
+		if (written)
+		{
+			__atomic_store_n(&logger->tail, tail, __ATOMIC_RELEASE);
+			fflush(logger->file);
+
+			if ( (logger->file != stderr) && (logger->size >= logger->rotate_size) )
+				log_rotate(logger);
+		}
+
+		if (stopping) break;
+
+		nanosleep(&idle, NULL);
+	}
+
+	fflush(logger->file);
+
+	return NULL;
+}
+
+/* a value quoted if it has spaces, quotes or anything unprintable, with those escaped */
+
+static char *log_value(char *output, const char *value, int length)
+{
+	static const char *hex = "0123456789abcdef";
+	int index;
+	bool quote;
+
+	for (index = 0, quote = (0 == length); index < length; index++)
+		if ( ((unsigned char)value[index] <= ' ') || ('"' == value[index]) || ('\\' == value[index]) || ('=' == value[index]) ) quote = true;
+
+	if (!quote)
+	{
+		memcpy(output, value, length);
+		return output + length;
+	}
+
+	*output++ = '"';
+	for (index = 0; index < length; index++)
+	{
+		if ( ('"' == value[index]) || ('\\' == value[index]) )
+		{
+			*output++ = '\\';
+			*output++ = value[index];
+		}
+		else if ((unsigned char)value[index] < ' ')
+		{
+			output = strcpy(output, "\\x") + 2;
+			*output++ = hex[(value[index] >> 4) & 15];
+			*output++ = hex[value[index] & 15];
+		}
+		else
+			*output++ = value[index];
+	}
+	*output++ = '"';
+
+	return output;
+}
+
+/* <file>.3 becomes <file>.4 and so on, <file> becomes <file>.1, and a new <file> is begun */
+
+static void log_rotate(struct logger_type *logger)
+{
+	char from[1100], to[1100];
+	int index;
+	FILE *file;
+
+	fclose(logger->file);
+
+	for (index = log_files_kept; index > 0; index--)
+	{
+		snprintf(to, sizeof(to), "%s.%d", logger->path, index);
+		if (index > 1)
+			snprintf(from, sizeof(from), "%s.%d", logger->path, index - 1);
+		else
+			snprintf(from, sizeof(from), "%s", logger->path);
+		rename(from, to);
+	}
+
+	/* if the new file can't be made, the log carries on to stderr rather than stopping */
+	file = fopen(logger->path, "a");
+	logger->file = file ? file : stderr;
+	if (NULL == file)
+		fprintf(stderr, "ERROR: unable to open log file '%s' after rotating it; logging to stderr\n", logger->path);
+
+	logger->size = 0;
+	__atomic_add_fetch(&logger->rotations, 1, __ATOMIC_RELAXED);
+}
+
+#endif
+
+/* "TAKtick flight <file>": the records of every thread in a dump, merged into one timeline */
+
+static int run_flight(int argc, char *argv[])
+{
+	static const char *kinds[FLIGHT_KIND_COUNT] = { "?", "accept", "recv", "frame", "enqueue", "send", "close", "sync", "stall", "hang" };
+	static const char *units[FLIGHT_KIND_COUNT] = { "", "port", "bytes", "bytes", "bytes", "bytes", "", "usec", "msec", "msec" };
+	struct flight_file_header_type header;
+	struct flight_ring_type *rings;
+	struct flight_record_type *record;
+	uint64_t *next, *end, earliest;
+	unsigned long total;
+	int64_t time;
+	char when[25];
+	FILE *file;
+	int index, chosen, kind;
+
+	if (argc < 1)
+	{
+		fprintf(stderr, "TAKtick flight <dump_file>\n");
+		return -1;
+	}
+
+	file = fopen(argv[0], "rb");
+	if (NULL == file)
+	{
+		fprintf(stderr, "ERROR: unable to open '%s'\n", argv[0]);
+		return -1;
+	}
+
+	if ( (1 != fread(&header, sizeof(header), 1, file)) || memcmp(header.magic, flight_magic, sizeof(header.magic)) ||
+		(header.version != (uint32_t)flight_version) || (header.ring_size != FLIGHT_RING_SIZE) || (header.ring_count > FLIGHT_MAX_THREADS) )
+	{
+		fprintf(stderr, "ERROR: '%s' is not a flight recorder dump of this version\n", argv[0]);
+		fclose(file);
+		return -1;
+	}
+
+	rings = (struct flight_ring_type *)malloc((header.ring_count ? header.ring_count : 1) * sizeof(struct flight_ring_type));
+	next = (uint64_t *)malloc((header.ring_count ? header.ring_count : 1) * sizeof(uint64_t));
+	end = (uint64_t *)malloc((header.ring_count ? header.ring_count : 1) * sizeof(uint64_t));
+	assert(rings && next && end);
+
+	if (header.ring_count && (header.ring_count != fread(rings, sizeof(struct flight_ring_type), header.ring_count, file)))
+	{
+		fprintf(stderr, "ERROR: '%s' is truncated\n", argv[0]);
+		header.ring_count = 0;
+	}
+	fclose(file);
+
+	format_cot_time(header.wall_time, when);
+	when[24] = '\0';
+	printf("flight recorder dump of %u threads taken %s; times are seconds before the dump\n", header.ring_count, when);
+
+	/* each ring holds its last FLIGHT_RING_SIZE records, oldest first from head */
+	for (index = 0; index < (int)header.ring_count; index++)
+	{
+		rings[index].name[sizeof(rings[index].name) - 1] = '\0';
+		end[index] = rings[index].head;
+		next[index] = (end[index] > FLIGHT_RING_SIZE) ? (end[index] - FLIGHT_RING_SIZE) : 0;
+	}
+
+	for (total = 0; ; total++)
+	{
+		chosen = -1;
+		earliest = 0;
+		for (index = 0; index < (int)header.ring_count; index++)
+		{
+			if (next[index] >= end[index]) continue;
+			record = &rings[index].records[next[index] & (FLIGHT_RING_SIZE - 1)];
+			if ( (chosen < 0) || ((record->stamp >> 8) < earliest) )
+			{
+				chosen = index;
+				earliest = record->stamp >> 8;
+			}
+		}
+		if (chosen < 0) break;
+
+		record = &rings[chosen].records[next[chosen]++ & (FLIGHT_RING_SIZE - 1)];
+		time = (int64_t)(record->stamp >> 8) - header.now;
+		kind = (int)(record->stamp & 255);
+		if (kind >= FLIGHT_KIND_COUNT) kind = 0;
+
+		printf("%14.6f  %-10s %-8s fd %-6d %d %s\n", time / 1e6, rings[chosen].name, kinds[kind], (int)record->fd, (int)record->value, units[kind]);
+	}
+
+	printf("%lu records\n", total);
+
+	free(end);
+	free(next);
+	free(rings);
+
+	return 0;
+}
+
+static const char *corpus_names[CORPUS_KIND_COUNT] = { "sa", "chat", "shapes", "alerts", "mixed", "huge" };
+
+/* "TAKtick corpus <kind> [events [seed]]" */
+
+static int run_corpus(int argc, char *argv[])
+{
+	struct corpus_type corpus;
+	int kind, count;
+
+	for (kind = 0; (argc > 0) && (kind < CORPUS_KIND_COUNT); kind++)
+		if (!strcmp(argv[0], corpus_names[kind])) break;
+
+	if ( (argc < 1) || (kind == CORPUS_KIND_COUNT) )
+	{
+		fprintf(stderr, "TAKtick corpus <sa|chat|shapes|alerts|mixed|huge> [events [seed]]\n");
+		return -1;
+	}
+
+	count = (argc > 1) ? atoi(argv[1]) : ((CORPUS_HUGE == kind) ? 4 : 10000);
+
+	memset(&corpus, 0, sizeof(corpus));
+	corpus.random = (argc > 2) ? strtoull(argv[2], NULL, 10) : 1;
+	corpus_generate(&corpus, kind, count);
+
+	fwrite(corpus.data, 1, (size_t)corpus.length, stdout);
+	fprintf(stderr, "%d %s events, %lld bytes\n", corpus.count, corpus_names[kind], (long long)corpus.length);
+
+	free(corpus.ends);
+	free(corpus.data);
+
+	return 0;
+}
+
+static void corpus_generate(struct corpus_type *corpus, int kind, int count)
+{
+	double pick;
+	int index;
+
+	if (0 == corpus->random) corpus->random = 1;
+	corpus->time = 1633176000000LL; /* 2021-10-02T12:00:00Z */
+
+	for (index = 0; index < count; index++)
+	{
+		if (CORPUS_MIXED == kind)
+		{
+			pick = corpus_random(corpus);
+			corpus_event(corpus, (pick < 0.8) ? CORPUS_SA : (pick < 0.9) ? CORPUS_CHAT : (pick < 0.96) ? CORPUS_SHAPES : CORPUS_ALERTS);
+		}
+		else
+			corpus_event(corpus, kind);
+
+		corpus->time += 1 + (int)(corpus_random(corpus) * 20);
+	}
+}
+
+/* append one event of the given kind (other than CORPUS_MIXED) */
+
+static void corpus_event(struct corpus_type *corpus, int kind)
+{
+	static const char *callsigns[] = { "ALPHA", "BRAVO", "CHARLIE", "DELTA", "ECHO", "FOXTROT", "GOLF", "HOTEL" };
+	static const char *teams[] = { "Cyan", "Yellow", "Magenta", "Dark Green", "White" };
+	static const char *alerts[] = { "b-a-o-tbl", "b-a-o-pan", "b-a-o-opn", "b-a-o-can" };
+	static const char *alert_names[] = { "911 Alert", "Ring The Bell", "In Contact", "Cancel" };
+	char time_value[25], stale_value[25], *output, *start;
+	uint64_t unit, id;
+	double lat, lon;
+	int points, length, index, alert;
+	const char *callsign;
+
+	format_cot_time(corpus->time, time_value);
+	format_cot_time(corpus->time + 120000, stale_value);
+	time_value[24] = stale_value[24] = '\0';
+
+	unit = (uint64_t)(corpus_random(corpus) * 200);
+	id = (uint64_t)(corpus_random(corpus) * 4294967296.0);
+	callsign = callsigns[unit % 8];
+	lat = 38.85 + corpus_random(corpus) * 0.1;
+	lon = -77.05 + corpus_random(corpus) * 0.1;
+
+	if (CORPUS_HUGE == kind)
+	{
+		points = 25000 + (int)(corpus_random(corpus) * 75000); /* about 40 bytes each */
+		output = corpus_reserve(corpus, points * 64 + 4096);
+	}
+	else if (CORPUS_SHAPES == kind)
+	{
+		points = 2 + (int)corpus_lognormal(corpus, 6.0, 1.0);
+		if (points > 2000) points = 2000;
+		output = corpus_reserve(corpus, points * 64 + 4096);
+	}
+	else
+	{
+		points = 0;
+		output = corpus_reserve(corpus, 16384);
+	}
+	start = output;
+
+	output += sprintf(output, "<?xml version=\"1.0\" encoding=\"UTF-8\" standalone=\"yes\"?>");
+
+	switch (kind)
+	{
+	case CORPUS_SA:
+		output += sprintf(output,
+			"<event version=\"2.0\" uid=\"ANDROID-%016llx\" type=\"a-f-G-U-C\" time=\"%s\" start=\"%s\" stale=\"%s\" how=\"h-e\">"
+			"<point lat=\"%.7f\" lon=\"%.7f\" hae=\"%.3f\" ce=\"%.1f\" le=\"9999999.0\"/><detail>"
+			"<takv os=\"29\" version=\"4.5.1.4 (bd6b7ee3).1645539651-CIV\" device=\"SAMSUNG SM-G970U\" platform=\"ATAK-CIV\"/>"
+			"<contact endpoint=\"*:-1:stcp\" callsign=\"%s-%llu\"/><uid Droid=\"%s-%llu\"/>"
+			"<precisionlocation altsrc=\"GPS\" geopointsrc=\"GPS\"/><__group role=\"Team Member\" name=\"%s\"/>"
+			"<status battery=\"%d\"/><track course=\"%.8f\" speed=\"%.8f\"/>",
+			(unsigned long long)(unit * 0x9e3779b97f4a7c15ULL), time_value, time_value, stale_value, lat, lon, corpus_random(corpus) * 100.0,
+			3.0 + corpus_random(corpus) * 20.0, callsign, (unsigned long long)unit, callsign, (unsigned long long)unit, teams[unit % 5],
+			(int)(corpus_random(corpus) * 100), corpus_random(corpus) * 360.0, corpus_random(corpus) * 3.0);
+
+		/* a few carry remarks, or a video feed */
+		if (corpus_random(corpus) < 0.2)
+		{
+			length = (int)corpus_lognormal(corpus, 40.0, 1.0);
+			output += sprintf(output, "<remarks>");
+			output = corpus_words(corpus, output, (length < 4096) ? length : 4096);
+			output += sprintf(output, "</remarks>");
+		}
+		if (corpus_random(corpus) < 0.05)
+			output += sprintf(output, "<__video url=\"rtsp://10.0.0.%d:8554/live\"/>", (int)(unit % 250) + 1);
+
+		output += sprintf(output, "</detail></event>");
+		break;
+
+	case CORPUS_CHAT:
+		output += sprintf(output,
+			"<event version=\"2.0\" uid=\"GeoChat.ANDROID-%016llx.All Chat Rooms.%08llx\" type=\"b-t-f\" time=\"%s\" start=\"%s\" stale=\"%s\" how=\"h-g-i-g-o\">"
+			"<point lat=\"%.7f\" lon=\"%.7f\" hae=\"9999999.0\" ce=\"9999999.0\" le=\"9999999.0\"/><detail>"
+			"<__chat parent=\"RootContactGroup\" groupOwner=\"false\" messageId=\"%08llx-%04x-4%03x\" chatroom=\"All Chat Rooms\" id=\"All Chat Rooms\" senderCallsign=\"%s-%llu\">"
+			"<chatgrp uid0=\"ANDROID-%016llx\" uid1=\"All Chat Rooms\" id=\"All Chat Rooms\"/></__chat>"
+			"<link uid=\"ANDROID-%016llx\" type=\"a-f-G-U-C\" relation=\"p-p\"/>"
+			"<remarks source=\"BAO.F.ATAK.ANDROID-%016llx\" to=\"All Chat Rooms\" time=\"%s\">",
+			(unsigned long long)(unit * 0x9e3779b97f4a7c15ULL), (unsigned long long)id, time_value, time_value, stale_value, lat, lon,
+			(unsigned long long)id, (unsigned int)(id >> 16) & 0xffff, (unsigned int)id & 0xfff, callsign, (unsigned long long)unit,
+			(unsigned long long)(unit * 0x9e3779b97f4a7c15ULL), (unsigned long long)(unit * 0x9e3779b97f4a7c15ULL),
+			(unsigned long long)(unit * 0x9e3779b97f4a7c15ULL), time_value);
+		length = 1 + (int)corpus_lognormal(corpus, 30.0, 1.0);
+		output = corpus_words(corpus, output, (length < 8192) ? length : 8192);
+		output += sprintf(output, "</remarks><__serverdestination destinations=\"10.0.0.%d:4242:tcp:ANDROID-%016llx\"/></detail></event>",
+			(int)(unit % 250) + 1, (unsigned long long)(unit * 0x9e3779b97f4a7c15ULL));
+		break;
+
+	case CORPUS_SHAPES:
+	case CORPUS_HUGE:
+		output += sprintf(output,
+			"<event version=\"2.0\" uid=\"%08llx-%04x-4%03x-a%03x-%012llx\" type=\"%s\" time=\"%s\" start=\"%s\" stale=\"%s\" how=\"h-e\">"
+			"<point lat=\"%.7f\" lon=\"%.7f\" hae=\"9999999.0\" ce=\"9999999.0\" le=\"9999999.0\"/><detail>",
+			(unsigned long long)id, (unsigned int)(id >> 8) & 0xffff, (unsigned int)id & 0xfff, (unsigned int)(id >> 20) & 0xfff,
+			(unsigned long long)(id * 0x9e3779b97f4a7c15ULL) & 0xffffffffffffULL, (CORPUS_HUGE == kind) ? "b-m-r" : ((id & 1) ? "u-d-f" : "u-d-r"),
+			time_value, time_value, stale_value, lat, lon);
+		for (index = 0; index < points; index++)
+		{
+			lat += (corpus_random(corpus) - 0.5) * 0.001;
+			lon += (corpus_random(corpus) - 0.5) * 0.001;
+			output += sprintf(output, "<link point=\"%.7f,%.7f\"/>", lat, lon);
+		}
+		output += sprintf(output,
+			"<strokeColor value=\"-65536\"/><strokeWeight value=\"4.0\"/><fillColor value=\"1358888960\"/>"
+			"<contact callsign=\"%s %llu\"/><remarks>",
+			(CORPUS_HUGE == kind) ? "Route" : "Drawing", (unsigned long long)(id % 1000));
+		if (corpus_random(corpus) < 0.3)
+			output = corpus_words(corpus, output, (int)corpus_lognormal(corpus, 20.0, 1.0) % 2048);
+		output += sprintf(output, "</remarks><archive/><labels_on value=\"false\"/><color value=\"-65536\"/></detail></event>");
+		break;
+
+	case CORPUS_ALERTS:
+		alert = (int)(corpus_random(corpus) * 4);
+		output += sprintf(output,
+			"<event version=\"2.0\" uid=\"ANDROID-%016llx-9-1-1\" type=\"%s\" time=\"%s\" start=\"%s\" stale=\"%s\" how=\"h-e\">"
+			"<point lat=\"%.7f\" lon=\"%.7f\" hae=\"%.3f\" ce=\"9999999.0\" le=\"9999999.0\"/><detail>"
+			"<link uid=\"ANDROID-%016llx\" type=\"a-f-G-U-C\" relation=\"p-p\"/><contact callsign=\"%s-%llu-Alert\"/>"
+			"<emergency %stype=\"%s\">%s-%llu</emergency></detail></event>",
+			(unsigned long long)(unit * 0x9e3779b97f4a7c15ULL), alerts[alert], time_value, time_value, stale_value, lat, lon,
+			corpus_random(corpus) * 100.0, (unsigned long long)(unit * 0x9e3779b97f4a7c15ULL), callsign, (unsigned long long)unit,
+			(3 == alert) ? "cancel=\"true\" " : "", alert_names[alert], callsign, (unsigned long long)unit);
+		break;
+	}
+
+	corpus->length += output - start;
+
+	if (corpus->count == corpus->max_count)
+	{
+		corpus->max_count = corpus->max_count ? (corpus->max_count * 2) : 1024;
+		corpus->ends = (int64_t *)realloc(corpus->ends, corpus->max_count * sizeof(int64_t));
+		assert(corpus->ends);
+	}
+	corpus->ends[corpus->count++] = corpus->length;
+}
+
+/* room for length more bytes at the end of the corpus, returned */
+
+static char *corpus_reserve(struct corpus_type *corpus, int length)
+{
+	if (corpus->length + length > corpus->max)
+	{
+		corpus->max = (corpus->max + length) * 2;
+		corpus->data = (char *)realloc(corpus->data, (size_t)corpus->max);
+		assert(corpus->data);
+	}
+
+	return corpus->data + corpus->length;
+}
+
+/* text of about the given length, of words drawn from a short list */
+
+static char *corpus_words(struct corpus_type *corpus, char *output, int length)
+{
+	static const char *words[] = { "contact", "moving", "north", "south", "of", "the", "bridge", "checkpoint", "two", "vehicles",
+		"copy", "all", "stations", "hold", "at", "phase", "line", "green", "eta", "five", "mikes", "roger", "over" };
+	const char *word;
+	char *end;
+
+	for (end = output + length; output < end; )
+	{
+		word = words[(int)(corpus_random(corpus) * (sizeof(words) / sizeof(words[0])))];
+		output += sprintf(output, "%s ", word);
+	}
+
+	return output;
+}
+
+/* xorshift64*, uniform in [0, 1) */
+
+static double corpus_random(struct corpus_type *corpus)
+{
+	corpus->random ^= corpus->random >> 12;
+	corpus->random ^= corpus->random << 25;
+	corpus->random ^= corpus->random >> 27;
+
+	return ((corpus->random * 0x2545f4914f6cdd1dULL) >> 11) / 9007199254740992.0;
+}
+
+/* lognormally distributed, with the given median and spread (the standard deviation of its logarithm) */
+
+static double corpus_lognormal(struct corpus_type *corpus, double median, double sigma)
+{
+	double normal;
 
-#if defined(_MSC_VER) || defined(__MINGW32__)
-	/* Initialize WinSock and check the version */
-	rc = WSAStartup(MAKEWORD(2,0), &wsaData);
+	/* Box-Muller */
+	normal = sqrt(-2.0 * log(1.0 - corpus_random(corpus))) * cos(2.0 * 3.14159265358979323846 * corpus_random(corpus));
 
-	/* check the version */
-	if (MAKEWORD(2,0) != wsaData.wVersion)
-	{
-		fprintf(stderr, "ERROR: WSAStartup() failed\n");
-		goto finished_nochangemode;
-	}
-#endif
+	return median * exp(sigma * normal);
+}
 
-	/* establish a socket to listen for incoming connections */
-	local.sin_family = AF_INET;
-	local.sin_addr.s_addr = htonl(INADDR_ANY);
-	local.sin_port = htons((unsigned short)atoi(argv[1]));
+/*
+"TAKtick bench framing [events]": the framer over each kind of corpus, fed as a socket might deliver it
+whole: 64 KB reads, as from a busy connection; mtu: a TCP segment's worth at a time; random: 1 byte to 4 KB;
+split: every read ends half way through a terminator; byte: one byte at a time
+*/
 
-	local_socket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+static int bench_framing(int argc, char *argv[])
+{
+	static const char *patterns[] = { "whole", "mtu", "random", "split", "byte" };
+	struct server_context_type ctx;
+	struct participant_list_struct participant;
+	struct corpus_type corpus;
+	int64_t offset, next, started, elapsed, bytes;
+	unsigned long events;
+	int count, kind, pattern, chunk, event, passes;
+	bool failed;
 
-#if defined(_MSC_VER) || defined(__MINGW32__)
-	if (INVALID_SOCKET == local_socket)
-#else
-	if (local_socket <= 0)
-#endif
-		goto finished_nochangemode;
+	count = (argc > 0) ? atoi(argv[0]) : 20000;
+	if (count <= 0) count = 20000;
 
-	rc = bind(local_socket, (LPSOCKADDR)&local, sizeof(local));
+	memset(&ctx, 0, sizeof(ctx));
+	failed = false;
 
-	if (rc)
+	for (kind = 0; kind < CORPUS_KIND_COUNT; kind++)
 	{
-		fprintf(stderr, "ERROR: unable to bind(); the socket may already be in use or is in timeout\n");
-		goto finished_nochangemode;
-	}
+		memset(&corpus, 0, sizeof(corpus));
+		corpus.random = 1 + kind;
+		corpus_generate(&corpus, kind, (CORPUS_HUGE == kind) ? 4 : count);
 
-	rc = listen(local_socket, SOMAXCONN);
+		printf("framing: %s, %d events, %.1f MB\n", corpus_names[kind], corpus.count, corpus.length / 1048576.0);
 
-	if (rc)	goto finished_nochangemode;
+		for (pattern = 0; pattern < (int)(sizeof(patterns) / sizeof(patterns[0])); pattern++)
+		{
+			memset(&participant, 0, sizeof(participant));
+			participant.socket = -1;
+			bytes = 0;
+			events = 0;
+			elapsed = 0;
 
-	printf("Press 'Q' to exit program\n");
-	changemode(1); /* disable keyboard echo */
-#if !defined(_MSC_VER) && !defined(__MINGW32__)
-	signal(SIGINT, intHandler);
-#endif
+			/* small corpora are framed repeatedly, for long enough to time */
+			for (passes = 0; (0 == passes) || (elapsed < 200000); passes++)
+			{
+				corpus.random = 1 + pattern;
+				event = 0;
+				started = now_us();
 
-	for (;;)
-	{
-		/* FD_SET "reads" with all the sockets we are listening on */
-		FD_ZERO(&reads);
-		FD_SET(local_socket, &reads);
-		highest_socket = set_reads(&reads, local_socket, &ctx);
-		FD_ZERO(&writes);
+				for (offset = 0; offset < corpus.length; offset = next)
+				{
+					switch (pattern)
+					{
+					case 0: chunk = buffer_chunk_size; break;
+					case 1: chunk = 1448; break;
+					case 2: chunk = 1 + (int)(corpus_random(&corpus) * 4096); break;
+					case 4: chunk = 1; break;
+					default:
+						/* up to four bytes into the next terminator, or 64 KB on the way to it */
+						while ( (event < corpus.count) && (corpus.ends[event] - 4 <= offset) ) event++;
+						chunk = (event < corpus.count) ? (int)(corpus.ends[event] - 4 - offset) : buffer_chunk_size;
+						if (chunk > buffer_chunk_size) chunk = buffer_chunk_size;
+						break;
+					}
 
-		/* block until something happens or timeout occurs */
-		tv.tv_sec = 0;
-		tv.tv_usec = 100000;
-		rc = select(highest_socket + 1, &reads, &writes, NULL, &tv);
+					next = offset + chunk;
+					if (next > corpus.length) next = corpus.length;
 
-		if (_kbhit())
-		{
-#if defined(_MSC_VER) || defined(__MINGW32__)
-			ch = getch();
-#else
-			ch = getchar();
-#endif
-			if ( ('q' == ch) || ('Q' == ch) ) break;
+					/* copied in as recv() would */
+					reserve_input(&participant);
+					memcpy(participant.buffer + participant.length, corpus.data + offset, (size_t)(next - offset));
+					frame_events(&participant, (int)(next - offset), discard_event, &ctx);
+				}
 
-			printf("%d participants currently; press 'Q' to exit program\n", ctx.participant_count);
-		}
-		
-		if (rc < 0) goto finished;
+				elapsed += now_us() - started;
+				bytes += corpus.length;
+				events += corpus.count;
+			}
 
-		if (rc > 0) /* rc is positive, indicating the number of sockets worthy of attention */
-		{
-			/* first, we check "local_socket", which will have activity if a new connection is attempted */
-			if (FD_ISSET(local_socket, &reads))
-				add_participant(local_socket, &ctx);
+			if ( (participant.counters.events_in != events) || participant.length )
+			{
+				printf("  %-7s framed %llu events of %lu, with %d bytes left over\n", patterns[pattern],
+					(unsigned long long)participant.counters.events_in, events, participant.length);
+				failed = true;
+			}
+			else
+				printf("  %-7s %7.3f ns/byte, %11.0f events/s, %8.1f MB/s\n", patterns[pattern], elapsed * 1000.0 / bytes,
+					events * 1000000.0 / elapsed, bytes / 1048576.0 * 1000000.0 / elapsed);
 
-			/* cycle through all the participants, processing all incoming data and closing terminated sockets */
-			service_participants(&reads, &ctx);
+			free(participant.buffer);
 		}
 
+		free(corpus.ends);
+		free(corpus.data);
 	}
 
-	/* mop up any remaining sockets */
-	terminate_participants(&ctx, true);
-
-finished:
-	changemode(0); /* re-enable keyboard echo */
-
-finished_nochangemode:
-	return 0;
+	return failed ? -1 : 0;
 }
 
-/* accept() new socket and add new incoming participant to list */
+/* the framer's handler for the benchmark, so that only framing is timed */
 
-static void add_participant(SOCKET listen_socket, struct server_context_type *ctx)
+static void discard_event(struct participant_list_struct *sender, const char *buffer, int length, struct server_context_type *ctx)
 {
-	SOCKET participant_socket;
-	struct participant_list_struct *pnt, *prev_pnt, *new_entry;
+	(void)sender;
+	(void)buffer;
+	(void)length;
+	(void)ctx;
+}
 
-	participant_socket = accept(listen_socket, NULL, NULL);
+/* "TAKtick bench <name> [arguments]" */
 
-#if defined(_MSC_VER) || defined(__MINGW32__)
-	if (INVALID_SOCKET == participant_socket) return;
-#else
-	if (participant_socket <= 0) return;
+static int run_bench(int argc, char *argv[])
+{
+#if !defined(_MSC_VER) && !defined(__MINGW32__)
+	if (!strcmp(argv[0], "journal"))
+		return bench_journal(argc - 1, argv + 1);
+#endif
+#if !defined(_MSC_VER) && !defined(__MINGW32__)
+	if (!strcmp(argv[0], "state"))
+		return bench_state(argc - 1, argv + 1);
+#endif
+#if defined(HAVE_ZLIB)
+	if (!strcmp(argv[0], "compression"))
+		return bench_compression(argc - 1, argv + 1);
 #endif
+	if (!strcmp(argv[0], "framing"))
+		return bench_framing(argc - 1, argv + 1);
 
-	/* set for non-blocking, as we will use select() to achieve blocking */
-	set_nonblocking(participant_socket);
+	fprintf(stderr, "ERROR: unknown benchmark '%s'\n", argv[0]);
+	return -1;
+}
 
-	/* search through participant list to for an existing entry */
+/* print the participant count and the effective egress batch size of each listener */
 
-	pnt = ctx->participant_list_base;
-	prev_pnt = NULL;
+static void report_status(struct server_context_type *ctx)
+{
+	struct listener_list_struct *listener;
 
-	while (pnt)
+	printf("%d participants currently; press 'Q' to exit program\n", ctx->participant_count);
+	printf("  %d uids cached for replay to joining participants\n", ctx->state_count);
+	printf("  %lu duplicate events dropped\n", ctx->duplicates_dropped);
+	printf("  %lu events delivered directly to their marti destinations\n", ctx->events_directed);
+	printf("  %lu pings answered\n", ctx->pings_answered);
+	printf("  %lu stale connections evicted on reconnect\n", ctx->zombies_evicted);
+	if (ctx->identity_conflicts)
+		printf("  %lu claims refused on a uid or callsign held by another connection\n", ctx->identity_conflicts);
+	if (ctx->connections_refused)
+		printf("  %lu connections refused for want of room in select()'s socket sets\n", ctx->connections_refused);
+	if (ctx->groups_refused)
+		printf("  %lu group names ignored, as %d groups exist or a name was over %d bytes\n", ctx->groups_refused, MAX_GROUPS, MAX_GROUP_NAME);
+	printf("  %lu updates thinned, %lu rate limited\n", ctx->updates_thinned, ctx->updates_rate_limited);
+#if !defined(_MSC_VER) && !defined(__MINGW32__)
+	if (ctx->replay)
 	{
-		if (pnt->socket == participant_socket)
-			break;
-		prev_pnt = pnt;
-		pnt = pnt->next;
+		printf("  ");
+		report_replay(ctx->replay);
 	}
+	if (ctx->state_saver)
+		printf("  %lu state snapshots saved to '%s', %lu failed\n", ctx->state_saver->saves, ctx->state_saver->path, ctx->state_saver->failures);
+	if (ctx->journal)
+		printf("  %lu events journalled in %lu segments, %lu group commits, %lu dropped (%lu too large)\n",
+			__atomic_load_n(&ctx->journal->records, __ATOMIC_RELAXED), __atomic_load_n(&ctx->journal->segments, __ATOMIC_RELAXED) + 1,
+			__atomic_load_n(&ctx->journal->syncs, __ATOMIC_RELAXED), __atomic_load_n(&ctx->journal->dropped, __ATOMIC_RELAXED),
+			__atomic_load_n(&ctx->journal->oversized, __ATOMIC_RELAXED));
+	if (ctx->logger)
+		printf("  %lu log records written to %s, %lu rotations, %lu dropped\n", __atomic_load_n(&ctx->logger->records, __ATOMIC_RELAXED),
+			ctx->logger->path ? ctx->logger->path : "stderr", __atomic_load_n(&ctx->logger->rotations, __ATOMIC_RELAXED),
+			__atomic_load_n(&ctx->logger->dropped, __ATOMIC_RELAXED));
+#endif
 
-	if (pnt)
+	if (ctx->loop.lag.count)
+		printf("  main loop lag p50 %.3f ms, p99 %.3f ms, p99.9 %.3f ms, max %.3f ms over %llu passes, %llu stalls\n",
+			latency_quantile(&ctx->loop.lag, 0.5) / 1000.0, latency_quantile(&ctx->loop.lag, 0.99) / 1000.0,
+			latency_quantile(&ctx->loop.lag, 0.999) / 1000.0, ctx->loop.lag.max / 1000.0,
+			(unsigned long long)ctx->loop.passes, (unsigned long long)ctx->loop.stalls);
+
+	if (ctx->groups.count > 1)
 	{
-		return;
-	}
+		struct hash_node_struct *node;
+		struct group_type *group;
+		int bucket;
 
-	/* create a new entry for this new participant */
+		for (bucket = 0; bucket < ctx->groups.bucket_count; bucket++)
+		{
+			for (node = ctx->groups.buckets[bucket]; node; node = node->next)
+			{
+				group = (struct group_type *)node->value;
+				printf("  group '%s': %d participants\n", group->name, group->count);
+			}
+		}
+	}
 
-	new_entry = (struct participant_list_struct *)malloc(sizeof(struct participant_list_struct));
-	assert(new_entry);
-	memset(new_entry, 0, sizeof(struct participant_list_struct));
-	new_entry->socket = participant_socket;
-	new_entry->closed = false;
-	new_entry->max_length = new_entry->length = 0;
-	new_entry->buffer = NULL;
+	for (listener = ctx->listener_list_base; listener; listener = listener->next)
+	{
+		if (EGRESS_THROUGHPUT == listener->egress_mode)
+			printf("  port %u: throughput mode, %d usec window", listener->port, listener->batch_window);
+		else
+			printf("  port %u: latency mode", listener->port);
 
-	if (NULL == prev_pnt)
-		ctx->participant_list_base = new_entry;
-	else
-		prev_pnt->next = new_entry;
+		printf(", %.2f events per write batch, %s priority, %lu bulk messages shed\n",
+			listener->batch_flushes ? ((double)listener->batched_events / listener->batch_flushes) : 0.0,
+			(SCHEDULE_WEIGHTED == listener->schedule) ? "weighted" : "strict", listener->messages_shed);
 
-	ctx->participant_count++;
+		if (listener->latency.count)
+			printf("    delivery latency p50 %.3f ms, p99 %.3f ms, p99.9 %.3f ms, max %.3f ms over %llu deliveries\n",
+				latency_quantile(&listener->latency, 0.5) / 1000.0, latency_quantile(&listener->latency, 0.99) / 1000.0,
+				latency_quantile(&listener->latency, 0.999) / 1000.0, listener->latency.max / 1000.0, (unsigned long long)listener->latency.count);
+	}
 }
 
-static void terminate_participants(struct server_context_type *ctx, bool force_all)
-{
-	struct participant_list_struct *pnt, *prev_pnt, *next_pnt;
+/* wall clock in milliseconds since the epoch, for comparison against CoT timestamps */
 
-	pnt = ctx->participant_list_base;
-	prev_pnt = NULL;
+static int64_t wall_clock_ms(void)
+{
+#if defined(_MSC_VER) || defined(__MINGW32__)
+	FILETIME ft;
+	int64_t ticks;
 
-	while (pnt)
-	{
-		next_pnt = pnt->next;
+	GetSystemTimeAsFileTime(&ft);
+	ticks = ((int64_t)ft.dwHighDateTime << 32) | ft.dwLowDateTime;
 
-		if (pnt->closed || force_all)
-		{
-#if defined(_MSC_VER) || defined(__MINGW32__)
-			closesocket(pnt->socket);
+	return ticks / 10000 - 11644473600000LL; /* 100ns ticks since 1601 to milliseconds since 1970 */
 #else
-			close(pnt->socket);
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+
+	return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
 #endif
+}
 
-			ctx->participant_count--;
+/* monotonic clock in microseconds */
 
-			if (prev_pnt)
-				prev_pnt->next = pnt->next;
-			else
-				ctx->participant_list_base = pnt->next;
+static int64_t now_us(void)
+{
+#if defined(_MSC_VER) || defined(__MINGW32__)
+	static LARGE_INTEGER frequency;
+	LARGE_INTEGER counter;
 
-			if (pnt->buffer) free(pnt->buffer);
-			free(pnt);
-		}
-		else
-		{
-			prev_pnt = pnt;
-		}
+	if (0 == frequency.QuadPart) QueryPerformanceFrequency(&frequency);
+	QueryPerformanceCounter(&counter);
 
-		pnt = next_pnt;
-	}
-}
+	return (int64_t)(counter.QuadPart / frequency.QuadPart) * 1000000 + (int64_t)((counter.QuadPart % frequency.QuadPart) * 1000000 / frequency.QuadPart);
+#else
+	struct timespec ts;
 
-static void service_participants(fd_set *state, struct server_context_type *ctx)
-{
-	struct participant_list_struct *pnt;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
 
-	/*
-	sequence through each entry in the linked list
-	if state indicates that this socket should be polled, we call parse_data() for it
-	*/
+	return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+}
 
-	pnt = ctx->participant_list_base;
+/* the histogram bucket of a value: the value itself below 64, otherwise 32 buckets for each doubling */
 
-	while (pnt)
-	{
-		if (FD_ISSET(pnt->socket, state))
-			parse_data(pnt, ctx);
+static int latency_bucket(uint64_t value)
+{
+	int shift;
 
-		pnt = pnt->next;
-	}
+	if (value < 64) return (int)value;
 
-	/*
-	sequence again through each entry in the linked list
-	if 'closed' indicates that this socket should be closed, we do so
-	*/
+	for (shift = 1; (value >> shift) >= 64; shift++)
+		;
 
-	terminate_participants(ctx, false);
+	/* value >> shift is now between 32 and 63 */
+	shift = 32 * shift + (int)(value >> shift);
+
+	return (shift < LATENCY_BUCKETS) ? shift : (LATENCY_BUCKETS - 1);
 }
 
-static void parse_data(struct participant_list_struct *participant, struct server_context_type *ctx)
+static void record_latency(struct latency_histogram_type *histogram, int64_t value)
 {
-	int numRead, onset;
-	char *pnt;
+	if (value < 0) value = 0;
 
-	do
-	{
-		if ( (participant->max_length <= 0) || ((participant->length + buffer_chunk_size) > participant->max_length) )
-		{
-			/* we'll likely run out of buffer space, so re-allocate more (2x as much) */
-			participant->max_length = (participant->max_length <= 0) ? buffer_chunk_size : (participant->max_length << 1);
-			participant->buffer = realloc(participant->buffer, participant->max_length);
-			assert(participant->buffer);
-		}
+	histogram->counts[latency_bucket((uint64_t)value)]++;
+	histogram->count++;
+	histogram->sum += (uint64_t)value;
+	if ((uint64_t)value > histogram->max) histogram->max = (uint64_t)value;
+}
 
-		numRead = recv(participant->socket, participant->buffer + participant->length, participant->max_length - participant->length, 0);
+static void merge_latency(struct latency_histogram_type *total, const struct latency_histogram_type *histogram)
+{
+	int bucket;
 
-		switch (numRead)
-		{
-		case -1:
-#if defined(_MSC_VER) || defined(__MINGW32__)
-			if (WSAEWOULDBLOCK == WSAGetLastError())
-#else
-			if (EAGAIN == errno)
-#endif
-				break;
-		case 0:
-			participant->closed = true;
-			break;
-		default:
-			onset = (participant->length > terminator_length) ? (participant->length - terminator_length) : 0;
-			participant->length += numRead;
-			if (pnt = memmem(participant->buffer + onset, participant->length - onset, terminator_string, terminator_length))
-			{
-				int size = pnt + terminator_length - participant->buffer;
-				share_data(participant->buffer, size, ctx);
-				participant->length -= size;
-				memmove(participant->buffer, pnt + terminator_length, participant->length);
-			}
-			break;
-		}
+	for (bucket = 0; bucket < LATENCY_BUCKETS; bucket++)
+		total->counts[bucket] += histogram->counts[bucket];
 
-	} while (numRead > 0);
+	total->count += histogram->count;
+	total->sum += histogram->sum;
+	if (histogram->max > total->max) total->max = histogram->max;
 }
 
-/* utility function to FD_SET all sockets in the participant list, and track the highest socket (for select()) */
+/* the value below which the given fraction of those recorded fall, taken as the middle of its bucket (but never above the maximum) */
 
-static SOCKET set_reads(fd_set *state, SOCKET highest_socket, struct server_context_type *ctx)
+static uint64_t latency_quantile(const struct latency_histogram_type *histogram, double quantile)
 {
-	struct participant_list_struct *pnt;
+	uint64_t rank, seen, value;
+	int bucket, shift;
 
-	pnt = ctx->participant_list_base;
+	if (0 == histogram->count) return 0;
 
-	while (pnt)
-	{
-		FD_SET(pnt->socket, state);
+	rank = (uint64_t)ceil(quantile * (double)histogram->count);
+	if (rank < 1) rank = 1;
 
-		if (pnt->socket > highest_socket)
-			highest_socket = pnt->socket;
+	for (bucket = 0, seen = 0; bucket < LATENCY_BUCKETS - 1; bucket++)
+	{
+		seen += histogram->counts[bucket];
+		if (seen >= rank) break;
+	}
 
-		pnt = pnt->next;
+	if (bucket < 64)
+		value = (uint64_t)bucket;
+	else
+	{
+		shift = bucket / 32 - 1;
+		value = ((uint64_t)(bucket - 32 * shift) << shift) + (((uint64_t)1 << shift) >> 1);
 	}
 
-	return highest_socket;
+	return (value < histogram->max) ? value : histogram->max;
 }
 
-/* utility function to configure a socket as non-blocking */
+/* 64-bit FNV-1a */
 
-static void set_nonblocking(SOCKET sock)
+static uint64_t hash_bytes(const void *data, int length)
 {
-#if defined(_MSC_VER) || defined(__MINGW32__)
-	u_long nonblocking = 1;
-	ioctlsocket(sock, FIONBIO, &nonblocking);
-#else
-	int opts;
+	const unsigned char *pnt;
+	uint64_t hash;
 
-	opts = fcntl(sock, F_GETFL);
+	hash = 14695981039346656037ULL;
 
-	if (opts > 0)
+	for (pnt = data; length > 0; length--, pnt++)
 	{
-		opts = (opts | O_NONBLOCK);
-		fcntl(sock, F_SETFL, opts);
+		hash ^= *pnt;
+		hash *= 1099511628211ULL;
 	}
-#endif
+
+	return hash;
 }
 
-/* send provided message to all participants */
+/* hash table keyed by a counted string; the key is copied, the value is not */
 
-static void share_data(const char *buffer, int length, struct server_context_type *ctx)
+static void *hash_find(struct hash_table_type *table, const char *key, int length)
 {
-	struct participant_list_struct *pnt;
-	int outcome;
+	struct hash_node_struct *node;
+	uint64_t hash;
 
-	pnt = ctx->participant_list_base;
+	if (0 == table->bucket_count) return NULL;
 
-	while (pnt)
+	hash = hash_bytes(key, length);
+
+	for (node = table->buckets[hash & (table->bucket_count - 1)]; node; node = node->next)
 	{
-		outcome = send(pnt->socket, buffer, length, MSG_NOSIGNAL);
+		if ( (node->hash == hash) && (node->key_length == length) && !memcmp(node->key, key, length) )
+			return node->value;
+	}
+
+	return NULL;
+}
 
-		if (outcome <= 0) pnt->closed = true;
+static void hash_insert(struct hash_table_type *table, const char *key, int length, void *value)
+{
+	struct hash_node_struct *node, *next, **buckets;
+	int index;
 
-		pnt = pnt->next;
+	if (table->count >= table->bucket_count)
+	{
+		/* keep the load factor at or below one by doubling the bucket count */
+		index = (table->bucket_count <= 0) ? 256 : (table->bucket_count << 1);
+		buckets = (struct hash_node_struct **)calloc(index, sizeof(struct hash_node_struct *));
+		assert(buckets);
+
+		while (table->bucket_count > 0)
+		{
+			for (node = table->buckets[--table->bucket_count]; node; node = next)
+			{
+				next = node->next;
+				node->next = buckets[node->hash & (index - 1)];
+				buckets[node->hash & (index - 1)] = node;
+			}
+		}
+
+		if (table->buckets) free(table->buckets);
+		table->buckets = buckets;
+		table->bucket_count = index;
+	}
+
+	node = (struct hash_node_struct *)malloc(sizeof(struct hash_node_struct) + length);
+	assert(node);
+	node->hash = hash_bytes(key, length);
+	node->value = value;
+	node->key_length = length;
+	memcpy(node->key, key, length);
+
+	index = (int)(node->hash & (table->bucket_count - 1));
+	node->next = table->buckets[index];
+	table->buckets[index] = node;
+	table->count++;
+}
+
+static void *hash_remove(struct hash_table_type *table, const char *key, int length)
+{
+	struct hash_node_struct *node, **link;
+	uint64_t hash;
+	void *value;
+
+	if (0 == table->bucket_count) return NULL;
+
+	hash = hash_bytes(key, length);
+
+	for (link = &table->buckets[hash & (table->bucket_count - 1)]; (node = *link); link = &node->next)
+	{
+		if ( (node->hash == hash) && (node->key_length == length) && !memcmp(node->key, key, length) )
+		{
+			*link = node->next;
+			value = node->value;
+			free(node);
+			table->count--;
+			return value;
+		}
 	}
+
+	return NULL;
 }
 
 /* bounded equivalent to strstr(); only Linux gcc has an implementation, so we provide one */
 
 static void *memmem(const void *haystack, size_t haystacklen, const void * const needle, const size_t needlelen)
 {
-	const char *h;
+	const char *h, *end;
 
 	if ( (haystack == NULL) || (needle == NULL) ) return NULL;
 	if ( (haystacklen == 0) || (needlelen == 0) ) return NULL;
+	if (haystacklen < needlelen) return NULL;
 
-	for (h = haystack; haystacklen >= needlelen; ++h, --haystacklen)
+	/* memchr() skips quickly to each occurrence of the needle's first byte; only those are compared in full */
+	end = (const char *)haystack + haystacklen - needlelen + 1;
+	for (h = haystack; (h = memchr(h, *(const char *)needle, end - h)); ++h)
 	{
 		if (!memcmp(h, needle, needlelen)) return (void *)h;
 	}
@@ -0,0 +1,740 @@
+/*
+    taktick-bench: CoT load generator for TAKtick
+                   which drives many simulated clients through one server and measures what comes back
+
+    Copyright (C) 2021 Peter Lawrence
+
+    Permission is hereby granted, free of charge, to any person obtaining a
+    copy of this software and associated documentation files (the "Software"),
+    to deal in the Software without restriction, including without limitation
+    the rights to use, copy, modify, merge, publish, distribute, sublicense,
+    and/or sell copies of the Software, and to permit persons to whom the
+    Software is furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in
+    all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+    THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+    FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+    DEALINGS IN THE SOFTWARE.
+*/
+
+/*
+each simulated client sends SA events for a uid of its own, stamped with the time they were sent; every client reads
+everything the server relays to it, and the stamps of this run's events give the delivery latency from client to client
+Linux only, as it relies on epoll to keep tens of thousands of connections busy from one thread
+*/
+
+#define _GNU_SOURCE /* for memmem() */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <memory.h>
+#include <string.h>
+#include <assert.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#define LATENCY_BUCKETS 1184 /* enough for latencies up to 2^41 microseconds; see latency_bucket() */
+#define MAX_EVENTS 1024 /* taken from epoll_wait() at once */
+
+static const char *terminator_string = "</event>";
+static const int terminator_length = 8;
+static const int buffer_chunk_size = 65536;
+static const int max_output_size = 262144; /* a client that falls this far behind skips events until it catches up */
+static const int connect_batch = 256; /* most connections being established at once */
+static const int connect_timeout = 30; /* seconds */
+static const int drain_timeout = 500; /* milliseconds without anything arriving that end a run */
+static const char *stamp_prefix = "<__bench run=\"";
+
+/* log-linear histogram of latencies in microseconds, as in TAKtick: accurate to about 3% */
+struct latency_histogram_type
+{
+	uint64_t counts[LATENCY_BUCKETS];
+	uint64_t count, sum, max;
+};
+
+struct client_type
+{
+	int socket;
+	bool connected, closed;
+	char *input, *output;
+	int input_length, input_max, output_offset, output_length, output_max;
+	unsigned long sequence;
+	int64_t last_time; /* of the latest event sent, so that no two share a time and are taken as duplicates */
+	double lat, lon;
+};
+
+/* totals since the start of a run, or of a report interval */
+struct traffic_type
+{
+	unsigned long sent, skipped, received, foreign;
+	uint64_t bytes_sent, bytes_received;
+	struct latency_histogram_type latency;
+};
+
+struct bench_type
+{
+	struct sockaddr_in address;
+	int client_count, sender_count;
+	double rate;             /* events per second per sender */
+	bool poisson;            /* exponentially distributed gaps between events, rather than even spacing */
+	int min_size, max_size;  /* of each event, in bytes */
+	bool log_sizes;          /* sizes drawn evenly on a log scale, so that small events are the most common */
+	int duration;            /* seconds */
+	int epoll;
+	struct client_type *clients;
+	int connected, connecting, failed, disconnected;
+	uint32_t run;            /* identifies this run's events among any others the server relays */
+	uint64_t random;
+	int next_sender;
+	int64_t next_send;       /* microseconds */
+	struct traffic_type total, interval;
+};
+
+static void usage(const char *name);
+static bool parse_size(const char *spec, struct bench_type *bench);
+static bool resolve(const char *host, unsigned short port, struct sockaddr_in *address);
+static void raise_file_limit(int needed);
+static bool open_client(struct bench_type *bench, int index);
+static void close_client(struct bench_type *bench, struct client_type *client);
+static void service_client(struct bench_type *bench, int index, uint32_t events);
+static void receive_events(struct bench_type *bench, struct client_type *client);
+static void frame_events(struct bench_type *bench, struct client_type *client);
+static void send_event(struct bench_type *bench, struct client_type *client, int index);
+static void flush_client(struct bench_type *bench, struct client_type *client);
+static void watch_output(struct bench_type *bench, struct client_type *client, int index, bool output);
+static int64_t send_gap(struct bench_type *bench);
+static double random_unit(struct bench_type *bench);
+static void report(double seconds, const struct traffic_type *traffic);
+static void add_traffic(struct traffic_type *total, const struct traffic_type *traffic);
+static int latency_bucket(uint64_t value);
+static void record_latency(struct latency_histogram_type *histogram, int64_t value);
+static uint64_t latency_quantile(const struct latency_histogram_type *histogram, double quantile);
+static void format_cot_time(int64_t ms, char *value);
+static int64_t now_us(void);
+static int64_t wall_clock_ms(void);
+
+int main(int argc, char *argv[])
+{
+	struct bench_type bench;
+	struct epoll_event events[MAX_EVENTS];
+	int64_t now, started, connect_started, last_report, finish;
+	int index, count, opened, wait;
+
+	memset(&bench, 0, sizeof(bench));
+	bench.client_count = 100;
+	bench.sender_count = -1;
+	bench.rate = 1.0;
+	bench.min_size = bench.max_size = 600;
+	bench.duration = 10;
+
+	/* options precede the host and port */
+	for (index = 1; index < argc - 2; index += 2)
+	{
+		if (!strcmp(argv[index], "-clients"))
+			bench.client_count = atoi(argv[index + 1]);
+		else if (!strcmp(argv[index], "-senders"))
+			bench.sender_count = atoi(argv[index + 1]);
+		else if (!strcmp(argv[index], "-rate"))
+		{
+			bench.rate = atof(argv[index + 1]);
+			bench.poisson = (NULL != strstr(argv[index + 1], ",poisson"));
+		}
+		else if (!strcmp(argv[index], "-size"))
+		{
+			if (!parse_size(argv[index + 1], &bench)) break;
+		}
+		else if (!strcmp(argv[index], "-duration"))
+			bench.duration = atoi(argv[index + 1]);
+		else
+			break;
+	}
+
+	if (bench.sender_count < 0) bench.sender_count = bench.client_count;
+
+	/* TAKtick drops an event whose uid, type and time match one already seen, and times are to the millisecond */
+	if ( (index != argc - 2) || (bench.client_count <= 0) || (bench.sender_count > bench.client_count) || (bench.rate <= 0.0) ||
+		(bench.rate > 1000.0) || (bench.duration <= 0) )
+	{
+		usage(argv[0]);
+		return -1;
+	}
+
+	if (!resolve(argv[argc - 2], (unsigned short)atoi(argv[argc - 1]), &bench.address))
+	{
+		fprintf(stderr, "ERROR: unable to resolve '%s'\n", argv[argc - 2]);
+		return -1;
+	}
+
+	raise_file_limit(bench.client_count + 16);
+	signal(SIGPIPE, SIG_IGN);
+
+	bench.epoll = epoll_create1(0);
+	if (bench.epoll < 0)
+	{
+		fprintf(stderr, "ERROR: epoll_create1() failed\n");
+		return -1;
+	}
+
+	bench.clients = (struct client_type *)calloc(bench.client_count, sizeof(struct client_type));
+	assert(bench.clients);
+	bench.random = ((uint64_t)now_us() << 16) ^ (uint64_t)getpid() ^ 0x9e3779b97f4a7c15ULL;
+	bench.run = (uint32_t)(bench.random >> 32) ^ (uint32_t)bench.random;
+
+	/* connect everyone first, a batch at a time, so that the server's listen backlog isn't overwhelmed */
+	connect_started = now_us();
+	for (opened = 0; (bench.connected + bench.failed < bench.client_count) && (now_us() - connect_started < (int64_t)connect_timeout * 1000000); )
+	{
+		while ( (opened < bench.client_count) && (bench.connecting < connect_batch) )
+		{
+			if (!open_client(&bench, opened)) bench.failed++;
+			opened++;
+		}
+
+		count = epoll_wait(bench.epoll, events, MAX_EVENTS, 100);
+		for (index = 0; index < count; index++)
+			service_client(&bench, (int)events[index].data.u32, events[index].events);
+	}
+
+	printf("%d clients connected to %s:%u in %.3f s", bench.connected, inet_ntoa(bench.address.sin_addr), ntohs(bench.address.sin_port),
+		(now_us() - connect_started) / 1e6);
+	if (bench.failed || (bench.connected + bench.failed < bench.client_count))
+		printf(", %d failed", bench.client_count - bench.connected);
+	printf("; %d sending %.1f events/s each%s, %d to %d bytes%s, for %d s\n", bench.sender_count, bench.rate, bench.poisson ? " (Poisson)" : "",
+		bench.min_size, bench.max_size, bench.log_sizes ? " (log scale)" : "", bench.duration);
+
+	/* the events of every sender are spread evenly over time, the senders taking turns */
+	started = last_report = now_us();
+	finish = started + (int64_t)bench.duration * 1000000;
+	bench.next_send = started;
+	memset(&bench.total, 0, sizeof(bench.total));
+	memset(&bench.interval, 0, sizeof(bench.interval));
+
+	for (;;)
+	{
+		now = now_us();
+		if (now >= finish) break;
+
+		while ( bench.sender_count && (bench.next_send <= now) )
+		{
+			if (!bench.clients[bench.next_sender].closed && bench.clients[bench.next_sender].connected)
+				send_event(&bench, &bench.clients[bench.next_sender], bench.next_sender);
+			bench.next_sender = (bench.next_sender + 1) % bench.sender_count;
+			bench.next_send += send_gap(&bench);
+		}
+
+		if (now - last_report >= 1000000)
+		{
+			report((now - started) / 1e6, &bench.interval);
+			add_traffic(&bench.total, &bench.interval);
+			memset(&bench.interval, 0, sizeof(bench.interval));
+			last_report += 1000000;
+		}
+
+		wait = 1;
+		if (bench.next_send - now > 1000) wait = (int)((bench.next_send - now) / 1000);
+		if (wait > 100) wait = 100;
+
+		count = epoll_wait(bench.epoll, events, MAX_EVENTS, wait);
+		for (index = 0; index < count; index++)
+			service_client(&bench, (int)events[index].data.u32, events[index].events);
+	}
+
+	/* events still on their way are waited for, until nothing has arrived for a while */
+	for (last_report = now_us(); now_us() - last_report < (int64_t)drain_timeout * 1000; )
+	{
+		count = epoll_wait(bench.epoll, events, MAX_EVENTS, 100);
+		if (count > 0) last_report = now_us();
+		for (index = 0; index < count; index++)
+			service_client(&bench, (int)events[index].data.u32, events[index].events);
+	}
+
+	add_traffic(&bench.total, &bench.interval);
+	printf("total, including events still arriving when sending stopped:\n");
+	report((finish - started) / 1e6, &bench.total);
+	printf("  %.1f events received per event sent; %lu events skipped for a backlog, %lu from elsewhere, %d clients disconnected\n",
+		bench.total.sent ? (double)bench.total.received / bench.total.sent : 0.0, bench.total.skipped, bench.total.foreign, bench.disconnected);
+
+	return 0;
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "%s [-clients count] [-senders count] [-rate events_per_sec[,poisson]] [-size bytes|min-max[,log]] [-duration seconds] <host> <port>\n", name);
+	fprintf(stderr, "  -clients   connections made to the server, each reading everything relayed to it (default 100)\n");
+	fprintf(stderr, "  -senders   how many of those also send SA events (default all)\n");
+	fprintf(stderr, "  -rate      events each sender sends per second, at most 1000; evenly spaced, or with Poisson arrivals (default 1)\n");
+	fprintf(stderr, "  -size      length of each event, or a range drawn from evenly or on a log scale (default 600)\n");
+	fprintf(stderr, "  -duration  seconds to send for (default 10)\n");
+}
+
+/* "bytes", "min-max" or "min-max,log" */
+
+static bool parse_size(const char *spec, struct bench_type *bench)
+{
+	char *end;
+
+	bench->min_size = bench->max_size = (int)strtol(spec, &end, 10);
+	if ('-' == *end)
+		bench->max_size = (int)strtol(end + 1, &end, 10);
+
+	bench->log_sizes = !strcmp(end, ",log");
+	if (*end && !bench->log_sizes) return false;
+
+	/* the smallest SA event is about 400 bytes; the largest is kept within what TAKtick accepts without fuss */
+	return (bench->min_size >= 400) && (bench->max_size >= bench->min_size) && (bench->max_size <= 1048576);
+}
+
+static bool resolve(const char *host, unsigned short port, struct sockaddr_in *address)
+{
+	struct addrinfo hints, *result;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+	if (getaddrinfo(host, NULL, &hints, &result) || (NULL == result)) return false;
+
+	memcpy(address, result->ai_addr, sizeof(struct sockaddr_in));
+	address->sin_port = htons(port);
+	freeaddrinfo(result);
+
+	return true;
+}
+
+/* tens of thousands of connections need more descriptors than a process is usually allowed by default */
+
+static void raise_file_limit(int needed)
+{
+	struct rlimit limit;
+
+	if (getrlimit(RLIMIT_NOFILE, &limit)) return;
+	if (limit.rlim_cur >= (rlim_t)needed) return;
+
+	limit.rlim_cur = (limit.rlim_max >= (rlim_t)needed) ? (rlim_t)needed : limit.rlim_max;
+	setrlimit(RLIMIT_NOFILE, &limit);
+
+	if (limit.rlim_cur < (rlim_t)needed)
+		fprintf(stderr, "WARNING: only %lu file descriptors are allowed; raise the hard limit (ulimit -Hn) for %d clients\n",
+			(unsigned long)limit.rlim_cur, needed - 16);
+}
+
+/* begin connecting a client; the connection completes (or fails) in service_client() */
+
+static bool open_client(struct bench_type *bench, int index)
+{
+	struct client_type *client;
+	struct epoll_event event;
+	int flag;
+
+	client = &bench->clients[index];
+	client->socket = socket(AF_INET, SOCK_STREAM, 0);
+	if (client->socket < 0)
+	{
+		client->closed = true;
+		return false;
+	}
+
+	fcntl(client->socket, F_SETFL, fcntl(client->socket, F_GETFL, 0) | O_NONBLOCK);
+	flag = 1;
+	setsockopt(client->socket, IPPROTO_TCP, TCP_NODELAY, (const char *)&flag, sizeof(flag));
+
+	if ( connect(client->socket, (struct sockaddr *)&bench->address, sizeof(bench->address)) && (EINPROGRESS != errno) )
+	{
+		close(client->socket);
+		client->closed = true;
+		return false;
+	}
+
+	/* each client sends from a point of its own near 0,0 */
+	client->lat = random_unit(bench) - 0.5;
+	client->lon = random_unit(bench) - 0.5;
+
+	event.events = EPOLLIN | EPOLLOUT;
+	event.data.u32 = (uint32_t)index;
+	epoll_ctl(bench->epoll, EPOLL_CTL_ADD, client->socket, &event);
+	bench->connecting++;
+
+	return true;
+}
+
+static void close_client(struct bench_type *bench, struct client_type *client)
+{
+	if (client->closed) return;
+
+	epoll_ctl(bench->epoll, EPOLL_CTL_DEL, client->socket, NULL);
+	close(client->socket);
+	client->closed = true;
+
+	if (client->connected)
+	{
+		bench->connected--;
+		bench->disconnected++;
+	}
+	else
+	{
+		bench->connecting--;
+		bench->failed++;
+	}
+}
+
+static void service_client(struct bench_type *bench, int index, uint32_t events)
+{
+	struct client_type *client;
+	int error;
+	socklen_t length;
+
+	client = &bench->clients[index];
+	if (client->closed) return;
+
+	if (!client->connected)
+	{
+		length = sizeof(error);
+		if ( getsockopt(client->socket, SOL_SOCKET, SO_ERROR, &error, &length) || error || (events & (EPOLLERR | EPOLLHUP)) )
+		{
+			close_client(bench, client);
+			return;
+		}
+
+		if (!(events & EPOLLOUT)) return;
+
+		client->connected = true;
+		bench->connecting--;
+		bench->connected++;
+		watch_output(bench, client, index, false);
+		return;
+	}
+
+	if (events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+		receive_events(bench, client);
+
+	if ( !client->closed && (events & EPOLLOUT) )
+	{
+		flush_client(bench, client);
+		if (!client->closed && (client->output_offset == client->output_length))
+			watch_output(bench, client, index, false);
+	}
+}
+
+/* read everything available, then frame it */
+
+static void receive_events(struct bench_type *bench, struct client_type *client)
+{
+	ssize_t amount;
+	int space;
+
+	for (;;)
+	{
+		if (client->input_max - client->input_length < buffer_chunk_size)
+		{
+			client->input_max = client->input_length + buffer_chunk_size;
+			client->input = (char *)realloc(client->input, client->input_max);
+			assert(client->input);
+		}
+
+		space = client->input_max - client->input_length;
+		amount = recv(client->socket, client->input + client->input_length, space, 0);
+		if (amount > 0)
+		{
+			client->input_length += (int)amount;
+			bench->interval.bytes_received += amount;
+			if (amount < space) break; /* nothing more waiting */
+			continue;
+		}
+
+		if ( (amount < 0) && ((EAGAIN == errno) || (EWOULDBLOCK == errno) || (EINTR == errno)) ) break;
+
+		close_client(bench, client);
+		return;
+	}
+
+	frame_events(bench, client);
+}
+
+/* count each complete event, and the latency of those sent by this run */
+
+static void frame_events(struct bench_type *bench, struct client_type *client)
+{
+	const char *start, *end, *stamp, *limit;
+	char *stop;
+	uint32_t run;
+	int64_t sent, now;
+
+	now = 0;
+	start = client->input;
+	limit = client->input + client->input_length;
+
+	while ( (end = memmem(start, limit - start, terminator_string, terminator_length)) )
+	{
+		end += terminator_length;
+
+		stamp = memmem(start, end - start, stamp_prefix, strlen(stamp_prefix));
+		run = stamp ? (uint32_t)strtoul(stamp + strlen(stamp_prefix), &stop, 10) : 0;
+		if ( stamp && (run == bench->run) && !strncmp(stop, "\" sent=\"", 8) )
+		{
+			sent = strtoll(stop + 8, NULL, 10);
+			if (0 == now) now = now_us();
+			record_latency(&bench->interval.latency, now - sent);
+			bench->interval.received++;
+		}
+		else
+			bench->interval.foreign++;
+
+		start = end;
+	}
+
+	client->input_length = (int)(limit - start);
+	memmove(client->input, start, client->input_length);
+}
+
+/* a CoT SA event, padded with remarks to the length drawn */
+
+static void send_event(struct bench_type *bench, struct client_type *client, int index)
+{
+	char time_value[25], stale_value[25], *output;
+	int64_t now, wall;
+	int size, length;
+
+	if (client->output_length - client->output_offset > max_output_size)
+	{
+		bench->interval.skipped++;
+		return;
+	}
+
+	if (bench->min_size == bench->max_size)
+		size = bench->min_size;
+	else if (bench->log_sizes)
+		size = (int)(bench->min_size * pow((double)bench->max_size / bench->min_size, random_unit(bench)));
+	else
+		size = bench->min_size + (int)(random_unit(bench) * (bench->max_size - bench->min_size + 1));
+	if (size > bench->max_size) size = bench->max_size;
+
+	if (client->output_max < client->output_length + size + 1024)
+	{
+		client->output_max = client->output_length + size + buffer_chunk_size;
+		client->output = (char *)realloc(client->output, client->output_max);
+		assert(client->output);
+	}
+
+	wall = wall_clock_ms();
+	if (wall <= client->last_time) wall = client->last_time + 1;
+	client->last_time = wall;
+	format_cot_time(wall, time_value);
+	format_cot_time(wall + 120000, stale_value);
+	time_value[24] = stale_value[24] = '\0';
+
+	now = now_us();
+	output = client->output + client->output_length;
+	length = sprintf(output,
+		"<?xml version=\"1.0\" encoding=\"UTF-8\" standalone=\"yes\"?>"
+		"<event version=\"2.0\" uid=\"bench-%u-%d\" type=\"a-f-G-U-C\" how=\"m-g\" time=\"%s\" start=\"%s\" stale=\"%s\">"
+		"<point lat=\"%.6f\" lon=\"%.6f\" hae=\"0.0\" ce=\"10.0\" le=\"10.0\"/>"
+		"<detail><contact callsign=\"bench-%d\"/>%s%u\" sent=\"%lld\" seq=\"%lu\"/><remarks>",
+		bench->run, index, time_value, time_value, stale_value, client->lat, client->lon, index, stamp_prefix, bench->run, (long long)now, client->sequence++);
+
+	/* the remarks make up the length, and are left empty if the event is already longer */
+	length += 27; /* "</remarks></detail></event>" */
+	if (length < size)
+	{
+		memset(output + length - 27, 'x', size - length);
+		length = size;
+	}
+	memcpy(output + length - 27, "</remarks></detail></event>", 27);
+
+	client->output_length += length;
+	bench->interval.sent++;
+	bench->interval.bytes_sent += length;
+
+	flush_client(bench, client);
+	if (!client->closed && (client->output_offset < client->output_length))
+		watch_output(bench, client, index, true);
+}
+
+static void flush_client(struct bench_type *bench, struct client_type *client)
+{
+	ssize_t amount;
+
+	while (client->output_offset < client->output_length)
+	{
+		amount = send(client->socket, client->output + client->output_offset, client->output_length - client->output_offset, MSG_NOSIGNAL);
+		if (amount > 0)
+		{
+			client->output_offset += (int)amount;
+			continue;
+		}
+
+		if ( (amount < 0) && ((EAGAIN == errno) || (EWOULDBLOCK == errno) || (EINTR == errno)) ) break;
+
+		close_client(bench, client);
+		return;
+	}
+
+	if (client->output_offset == client->output_length)
+		client->output_offset = client->output_length = 0;
+}
+
+/* ask epoll to report the socket writable only while there is something waiting to be written */
+
+static void watch_output(struct bench_type *bench, struct client_type *client, int index, bool output)
+{
+	struct epoll_event event;
+
+	event.events = EPOLLIN | (output ? EPOLLOUT : 0);
+	event.data.u32 = (uint32_t)index;
+	epoll_ctl(bench->epoll, EPOLL_CTL_MOD, client->socket, &event);
+}
+
+/* microseconds from one event to the next, over all senders */
+
+static int64_t send_gap(struct bench_type *bench)
+{
+	double mean;
+
+	mean = 1000000.0 / (bench->rate * bench->sender_count);
+	if (!bench->poisson) return (int64_t)mean + ((random_unit(bench) < mean - floor(mean)) ? 1 : 0);
+
+	return (int64_t)(-log(1.0 - random_unit(bench)) * mean);
+}
+
+/* xorshift64*, uniform in [0, 1) */
+
+static double random_unit(struct bench_type *bench)
+{
+	bench->random ^= bench->random >> 12;
+	bench->random ^= bench->random << 25;
+	bench->random ^= bench->random >> 27;
+
+	return ((bench->random * 0x2545f4914f6cdd1dULL) >> 11) / 9007199254740992.0;
+}
+
+/* one line for a second of the run (or the whole of it), ending with the time from its start */
+
+static void report(double seconds, const struct traffic_type *traffic)
+{
+	printf("%7.1f s: sent %lu events (%.1f MB), received %lu (%.1f MB)", seconds, traffic->sent, traffic->bytes_sent / 1048576.0,
+		traffic->received, traffic->bytes_received / 1048576.0);
+	if (traffic->latency.count)
+		printf(", latency p50 %.3f ms, p99 %.3f ms, p99.9 %.3f ms, max %.3f ms", latency_quantile(&traffic->latency, 0.5) / 1000.0,
+			latency_quantile(&traffic->latency, 0.99) / 1000.0, latency_quantile(&traffic->latency, 0.999) / 1000.0, traffic->latency.max / 1000.0);
+	printf("\n");
+}
+
+static void add_traffic(struct traffic_type *total, const struct traffic_type *traffic)
+{
+	int index;
+
+	total->sent += traffic->sent;
+	total->skipped += traffic->skipped;
+	total->received += traffic->received;
+	total->foreign += traffic->foreign;
+	total->bytes_sent += traffic->bytes_sent;
+	total->bytes_received += traffic->bytes_received;
+
+	for (index = 0; index < LATENCY_BUCKETS; index++)
+		total->latency.counts[index] += traffic->latency.counts[index];
+	total->latency.count += traffic->latency.count;
+	total->latency.sum += traffic->latency.sum;
+	if (traffic->latency.max > total->latency.max) total->latency.max = traffic->latency.max;
+}
+
+static int latency_bucket(uint64_t value)
+{
+	int shift;
+
+	if (value < 64) return (int)value;
+
+	for (shift = 1; (value >> shift) >= 64; shift++)
+		;
+
+	/* value >> shift is now between 32 and 63 */
+	shift = 32 * shift + (int)(value >> shift);
+
+	return (shift < LATENCY_BUCKETS) ? shift : (LATENCY_BUCKETS - 1);
+}
+
+static void record_latency(struct latency_histogram_type *histogram, int64_t value)
+{
+	if (value < 0) value = 0;
+
+	histogram->counts[latency_bucket((uint64_t)value)]++;
+	histogram->count++;
+	histogram->sum += (uint64_t)value;
+	if ((uint64_t)value > histogram->max) histogram->max = (uint64_t)value;
+}
+
+static uint64_t latency_quantile(const struct latency_histogram_type *histogram, double quantile)
+{
+	uint64_t rank, seen, value;
+	int bucket, shift;
+
+	if (0 == histogram->count) return 0;
+
+	rank = (uint64_t)ceil(quantile * (double)histogram->count);
+	if (rank < 1) rank = 1;
+
+	for (bucket = 0, seen = 0; bucket < LATENCY_BUCKETS - 1; bucket++)
+	{
+		seen += histogram->counts[bucket];
+		if (seen >= rank) break;
+	}
+
+	if (bucket < 64)
+		value = (uint64_t)bucket;
+	else
+	{
+		shift = bucket / 32 - 1;
+		value = ((uint64_t)(bucket - 32 * shift) << shift) + (((uint64_t)1 << shift) >> 1);
+	}
+
+	return (value < histogram->max) ? value : histogram->max;
+}
+
+/* 24 characters (with no terminator) like 2021-10-02T12:00:00.000Z */
+
+static void format_cot_time(int64_t ms, char *value)
+{
+	struct tm tm;
+	time_t seconds;
+
+	seconds = (time_t)(ms / 1000);
+	gmtime_r(&seconds, &tm);
+	sprintf(value, "%04d-%02d-%02dT%02d:%02d:%02d.%03dZ", tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec, (int)(ms % 1000));
+}
+
+/* monotonic clock in microseconds, the same for every process on the machine */
+
+static int64_t now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int64_t wall_clock_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+
+	return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}